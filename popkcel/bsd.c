@@ -57,6 +57,17 @@ int popkcel_initLoop(struct Popkcel_Loop *loop, size_t maxEvents)
     loop->events = malloc(sizeof(struct kevent) * maxEvents);
     loop->maxEvents = maxEvents;
     loop->timers = NULL;
+#ifndef POPKCEL_NOFAKESYNC
+    loop->readyHead = loop->readyTail = loop->runningReady = loop->freeContexts = NULL;
+    loop->curDeadline = NULL;
+    loop->readyTaken = 0;
+#endif
+#ifndef POPKCEL_SINGLETHREAD
+    loop->workerPool = NULL;
+    loop->workNotifier = NULL;
+    loop->doneHead = loop->doneTail = NULL;
+    pthread_mutex_init(&loop->workMutex, NULL);
+#endif
     loop->running = 0;
     return POPKCEL_OK;
 }
@@ -124,6 +135,9 @@ int popkcel_runLoop(struct Popkcel_Loop *loop)
         }
         // int er = errno;
         loop->curIndex = 0;
+#ifndef POPKCEL_NOFAKESYNC
+        loop->readyTaken = 0;
+#endif
         if (!loop->inited) {
             loop->inited = 1;
 #ifndef POPKCEL_NOFAKESYNC
@@ -154,6 +168,11 @@ int popkcel_runLoop(struct Popkcel_Loop *loop)
                 return 0;
             loop->curIndex++;
         }
+#ifndef POPKCEL_NOFAKESYNC
+        popkcel__runReady(loop);
+        if (!loop->running)
+            break;
+#endif
     }
     return 0;
 }
@@ -76,6 +76,9 @@ int popkcel_runLoop(struct Popkcel_Loop *loop)
         r = errno;
 */
         loop->curIndex = 0;
+#ifndef POPKCEL_NOFAKESYNC
+        loop->readyTaken = 0;
+#endif
         if (!loop->inited) {
             loop->inited = 1;
 #ifndef POPKCEL_NOFAKESYNC
@@ -97,6 +100,11 @@ int popkcel_runLoop(struct Popkcel_Loop *loop)
                 return 0;
             loop->curIndex++;
         }
+#ifndef POPKCEL_NOFAKESYNC
+        popkcel__runReady(loop);
+        if (!loop->running)
+            break;
+#endif
     }
     return 0;
 }
@@ -243,5 +251,16 @@ int popkcel_initLoop(struct Popkcel_Loop *loop, size_t maxEvents)
     loop->maxEvents = maxEvents;
     loop->running = 0;
     loop->timers = NULL;
+#ifndef POPKCEL_NOFAKESYNC
+    loop->readyHead = loop->readyTail = loop->runningReady = loop->freeContexts = NULL;
+    loop->curDeadline = NULL;
+    loop->readyTaken = 0;
+#endif
+#ifndef POPKCEL_SINGLETHREAD
+    loop->workerPool = NULL;
+    loop->workNotifier = NULL;
+    loop->doneHead = loop->doneTail = NULL;
+    pthread_mutex_init(&loop->workMutex, NULL);
+#endif
     return POPKCEL_OK;
 }
@@ -68,6 +68,11 @@ int popkcel__checkTimers()
             break;
         }
     }
+#ifndef POPKCEL_NOFAKESYNC
+    // 有就绪的协程时，不能让loop阻塞等待事件
+    if (popkcel_threadLoop->readyHead || popkcel_threadLoop->runningReady)
+        rv = 0;
+#endif
     return rv;
 }
 
@@ -203,7 +208,12 @@ void popkcel_suspend(struct Popkcel_Context *context)
         // context->stackPos = (char*)sp + 1;
         stackSize = popkcel_threadLoop->stackPos - context->stackPos;
         // printf("%d\n", stackSize);
-        context->savedStack = malloc(stackSize);
+        // 同一个context可能被多次挂起，比如popkcel_yield，之前保存的stack已经没用了，够大时直接覆盖
+        if (context->savedSize < stackSize) {
+            free(context->savedStack);
+            context->savedStack = malloc(stackSize);
+            context->savedSize = stackSize;
+        }
         memcpy(context->savedStack, context->stackPos, stackSize);
 #    else
         // context->stackPos = (char*)sp;
@@ -211,6 +221,9 @@ void popkcel_suspend(struct Popkcel_Context *context)
         context->savedStack = new char[stackSize];
         memcpy(context->savedStack, threadLoop->stackPos, stackSize);
 #    endif
+        // Deadline属于协程，回到事件循环时要暂时移走
+        context->deadline = popkcel_threadLoop->curDeadline;
+        popkcel_threadLoop->curDeadline = NULL;
         POPKCLONGJMP(popkcel_threadLoop->jmpBuf, 1);
     } break;
     default:
@@ -221,9 +234,110 @@ void popkcel_suspend(struct Popkcel_Context *context)
 void popkcel_resume(struct Popkcel_Context *context)
 {
     popkcel_threadLoop->curContext = context;
+    popkcel_threadLoop->curDeadline = context->deadline;
     POPKCLONGJMP(context->jmpBuf, 1);
 }
 
+/// 由popkcel_spawn创建的协程
+struct Popkcel_Coroutine
+{
+    /// 用于把协程放进就绪队列
+    struct Popkcel_Context context;
+    /// 协程执行的函数
+    Popkcel_FuncCallback cb;
+    /// 传入函数的用户数据
+    void *data;
+};
+
+static void pushReady(struct Popkcel_Loop *loop, struct Popkcel_Context *context)
+{
+    context->nextReady = NULL;
+    if (loop->readyTail)
+        loop->readyTail->nextReady = context;
+    else
+        loop->readyHead = context;
+    loop->readyTail = context;
+}
+
+void popkcel_resumeLater(struct Popkcel_Context *context)
+{
+    if (context->readyState != POPKCEL_RS_NONE)
+        return;
+    context->readyState = POPKCEL_RS_RESUME;
+    pushReady(popkcel_threadLoop, context);
+}
+
+void popkcel_spawn(struct Popkcel_Loop *loop, Popkcel_FuncCallback cb, void *data)
+{
+    struct Popkcel_Coroutine *co = malloc(sizeof(struct Popkcel_Coroutine));
+    popkcel_initContext(&co->context);
+    co->context.readyState = POPKCEL_RS_SPAWN;
+    co->cb = cb;
+    co->data = data;
+    pushReady(loop, &co->context);
+}
+
+void popkcel_yield()
+{
+    // 用过的Context连同保存stack的内存一起留在loop中，反复yield时不用再分配
+    struct Popkcel_Loop *loop = popkcel_threadLoop;
+    struct Popkcel_Context *context = loop->freeContexts;
+    if (context)
+        loop->freeContexts = context->nextReady;
+    else {
+        context = malloc(sizeof(struct Popkcel_Context));
+        popkcel_initContext(context);
+    }
+    popkcel_resumeLater(context);
+    popkcel_suspend(context);
+    loop = popkcel_threadLoop;
+    context->nextReady = loop->freeContexts;
+    loop->freeContexts = context;
+}
+
+void popkcel__freeContexts(struct Popkcel_Loop *loop)
+{
+    while (loop->freeContexts) {
+        struct Popkcel_Context *context = loop->freeContexts;
+        loop->freeContexts = context->nextReady;
+        popkcel_destroyContext(context);
+        free(context);
+    }
+}
+
+void popkcel__runReady(struct Popkcel_Loop *loop)
+{
+    struct Popkcel_Context *context;
+    // 每轮循环只取一次就绪队列。协程挂起后会longjmp回事件循环，再次进入本函数时，继续处理这一批中剩下的协程
+    if (!loop->readyTaken) {
+        loop->readyTaken = 1;
+        if (!loop->runningReady) {
+            loop->runningReady = loop->readyHead;
+            loop->readyHead = loop->readyTail = NULL;
+        }
+    }
+
+    while (loop->running && (context = loop->runningReady)) {
+        loop->runningReady = context->nextReady;
+        if (context->readyState == POPKCEL_RS_SPAWN) {
+            struct Popkcel_Coroutine *co = (struct Popkcel_Coroutine *)context;
+            context->readyState = POPKCEL_RS_NONE;
+            loop->curDeadline = NULL;
+            co->cb(co->data, POPKCEL_OK);
+            // 如果协程中途挂起过，那么执行到这里时，本函数的stack已从协程保存的stack中恢复，co仍然有效
+            popkcel_destroyContext(&co->context);
+            free(co);
+            loop = popkcel_threadLoop;
+            assert(!loop->curDeadline && "popkcel_clearDeadline must be called before the coroutine ends!");
+            loop->curDeadline = NULL;
+        }
+        else {
+            context->readyState = POPKCEL_RS_NONE;
+            popkcel_resume(context);
+        }
+    }
+}
+
 void popkcel_initMultiOperation(struct Popkcel_MultiOperation *mo, struct Popkcel_Loop *loop)
 {
 #    ifndef NDEBUG
@@ -234,6 +348,7 @@ void popkcel_initMultiOperation(struct Popkcel_MultiOperation *mo, struct Popkce
     mo->loop = loop;
     mo->rvs = NULL;
     mo->count = 0;
+    mo->deadline = NULL;
     // popkcel_hashInsert(loop->moHash, loop->hashSize, (struct Popkcel_HashInfo*)mo);
     popkcel_initTimer(&mo->timer, loop);
     popkcel_initContext(&mo->context);
@@ -249,6 +364,11 @@ void popkcel_resetMultiOperation(struct Popkcel_MultiOperation *mo)
     }
     mo->rvs = NULL;
     mo->count = 0;
+    if (mo->deadline) {
+        if (mo->deadline->expireData == mo)
+            mo->deadline->expireCb = NULL;
+        mo->deadline = NULL;
+    }
     popkcel_stopTimer(&mo->timer);
     popkcel_destroyContext(&mo->context);
     popkcel_initContext(&mo->context);
@@ -260,17 +380,19 @@ void popkcel_destroyMultiOperation(struct Popkcel_MultiOperation *mo)
     // popkcel_hashRemove(mo->loop->moHash, mo->loop->hashSize, (struct Popkcel_HashInfo*)mo);
 }
 
-void popkcel_multiOperationReblock(struct Popkcel_MultiOperation *mo)
+inline static void moWake(struct Popkcel_MultiOperation *mo)
 {
-    if (mo->count <= 0 || mo->timeOuted)
-        return;
-    POPKCLONGJMP(mo->loop->jmpBuf, 1);
+    // 多次回调模式中，每次回调都要让协程处理当前的socket，所以只能直接恢复
+    if (mo->multiCallback)
+        popkcel_resume(&mo->context);
+    else
+        popkcel_resumeLater(&mo->context);
 }
 
 inline static void moCheckCount(struct Popkcel_MultiOperation *mo)
 {
     if (mo->multiCallback || mo->count <= 0) {
-        popkcel_resume(&mo->context);
+        moWake(mo);
     }
 }
 
@@ -292,24 +414,57 @@ static int moTimerCb(void *data, intptr_t rv)
     if (mo->count > 0) {
         mo->timeOuted = 1;
         mo->curSocket = NULL;
-        popkcel_resume(&mo->context);
+        moWake(mo);
     }
     return 0;
 }
 
+static void moWaitDeadline(struct Popkcel_MultiOperation *mo)
+{
+    mo->deadline->expireCb = &moTimerCb;
+    mo->deadline->expireData = mo;
+}
+
 void popkcel_multiOperationWait(struct Popkcel_MultiOperation *mo, int timeout, char multiCallback)
 {
+    struct Popkcel_Deadline *dl = mo->loop->curDeadline;
     mo->timeOuted = 0;
     mo->multiCallback = multiCallback;
     mo->curSocket = NULL;
+    mo->deadline = NULL;
     if (!mo->count)
         return;
+    if (dl) {
+        if (dl->expired) {
+            mo->timeOuted = 1;
+            return;
+        }
+        // Deadline更早到期时，直接用Deadline的timer，不再单独设置timer
+        if (timeout <= 0 || dl->time <= popkcel_getCurrentTime() + timeout) {
+            mo->deadline = dl;
+            moWaitDeadline(mo);
+            timeout = 0;
+        }
+    }
     if (timeout > 0) {
         mo->timer.funcCb = &moTimerCb;
         mo->timer.cbData = mo;
         popkcel_setTimer(&mo->timer, timeout, 0);
     }
     popkcel_suspend(&mo->context);
+    // 多次回调模式中，每次回调都会回到这里。Deadline的回调只会调用一次，所以要在popkcel_multiOperationReblock中重新设置
+    if (mo->deadline && mo->deadline->expireData == mo)
+        mo->deadline->expireCb = NULL;
+}
+
+void popkcel_multiOperationReblock(struct Popkcel_MultiOperation *mo)
+{
+    if (mo->count <= 0 || mo->timeOuted)
+        return;
+    if (mo->deadline)
+        moWaitDeadline(mo);
+    mo->loop->curDeadline = NULL;
+    POPKCLONGJMP(mo->loop->jmpBuf, 1);
 }
 
 int popkcel_initPSSocket(struct Popkcel_PSSocket *sock, struct Popkcel_Loop *loop, int socketType, Popkcel_HandleType fd)
@@ -502,6 +657,342 @@ intptr_t popkcel_multiOperationGetResult(struct Popkcel_MultiOperation *mo, stru
     else
         return (intptr_t)it->value;
 }
+
+/// 在WaitQueue上挂起的协程
+struct Popkcel_Waiter
+{
+    /// 挂起时使用的Context
+    struct Popkcel_Context context;
+    struct Popkcel_Waiter *next, *prev;
+    /// 所在的WaitQueue
+    struct Popkcel_WaitQueue *queue;
+    /// 等待时所在的Deadline作用域
+    struct Popkcel_Deadline *deadline;
+    /// 传递的数据
+    void *value;
+    /// 等待的结果
+    int rv;
+};
+
+static void waitQueueRemove(struct Popkcel_WaitQueue *wq, struct Popkcel_Waiter *w)
+{
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        wq->head = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    else
+        wq->tail = w->prev;
+}
+
+// Deadline到期时，把协程从WaitQueue中移除并恢复
+static int waiterExpireCb(void *data, intptr_t rv)
+{
+    struct Popkcel_Waiter *w = data;
+    waitQueueRemove(w->queue, w);
+    w->rv = (int)rv;
+    popkcel_resumeLater(&w->context);
+    return 0;
+}
+
+// 挂起当前协程，直到被wakeOne或wakeAll唤醒，返回唤醒时传入的rv。到达Deadline时返回POPKCEL_WOULDBLOCK
+static int waitOn(struct Popkcel_WaitQueue *wq, void **value)
+{
+    struct Popkcel_Deadline *dl = popkcel_threadLoop->curDeadline;
+    if (dl && dl->expired)
+        return POPKCEL_WOULDBLOCK;
+    struct Popkcel_Waiter *w = malloc(sizeof(struct Popkcel_Waiter));
+    popkcel_initContext(&w->context);
+    w->queue = wq;
+    w->deadline = dl;
+    if (dl) {
+        dl->expireCb = &waiterExpireCb;
+        dl->expireData = w;
+    }
+    w->value = value ? *value : NULL;
+    w->next = NULL;
+    w->prev = wq->tail;
+    if (wq->tail)
+        wq->tail->next = w;
+    else
+        wq->head = w;
+    wq->tail = w;
+    popkcel_suspend(&w->context);
+    int r = w->rv;
+    if (value)
+        *value = w->value;
+    popkcel_destroyContext(&w->context);
+    free(w);
+    return r;
+}
+
+static struct Popkcel_Waiter *wakeOne(struct Popkcel_WaitQueue *wq, int rv)
+{
+    struct Popkcel_Waiter *w = wq->head;
+    if (w) {
+        waitQueueRemove(wq, w);
+        if (w->deadline)
+            w->deadline->expireCb = NULL;
+        w->rv = rv;
+        popkcel_resumeLater(&w->context);
+    }
+    return w;
+}
+
+static void wakeAll(struct Popkcel_WaitQueue *wq, int rv)
+{
+    while (wakeOne(wq, rv))
+        ;
+}
+
+int popkcel_initChannel(struct Popkcel_Channel *ch, size_t capacity)
+{
+#    ifndef NDEBUG
+    if (popkcel_threadLoop && popkcel_threadLoop->running) {
+        ELCHECKIFONSTACK(popkcel_threadLoop, ch, "Do not allocate Channel on stack!");
+    }
+#    endif
+    if (capacity) {
+        ch->items = malloc(sizeof(void *) * capacity);
+        if (!ch->items)
+            return POPKCEL_ERROR;
+    }
+    else
+        ch->items = NULL;
+    ch->capacity = capacity;
+    ch->head = 0;
+    ch->count = 0;
+    ch->senders.head = ch->senders.tail = NULL;
+    ch->receivers.head = ch->receivers.tail = NULL;
+    ch->closed = 0;
+    return POPKCEL_OK;
+}
+
+void popkcel_destroyChannel(struct Popkcel_Channel *ch)
+{
+    assert(!ch->senders.head && !ch->receivers.head && "Coroutines are still waiting on the Channel!");
+    free(ch->items);
+}
+
+int popkcel_channelTrySend(struct Popkcel_Channel *ch, void *value)
+{
+    if (ch->closed)
+        return POPKCEL_ERROR;
+    // 有协程在等待接收时，缓冲区一定是空的，直接把数据交给它
+    struct Popkcel_Waiter *w = wakeOne(&ch->receivers, POPKCEL_OK);
+    if (w) {
+        w->value = value;
+        return POPKCEL_OK;
+    }
+    if (ch->count >= ch->capacity)
+        return POPKCEL_WOULDBLOCK;
+    ch->items[(ch->head + ch->count) % ch->capacity] = value;
+    ch->count++;
+    return POPKCEL_OK;
+}
+
+int popkcel_channelSend(struct Popkcel_Channel *ch, void *value)
+{
+    int r = popkcel_channelTrySend(ch, value);
+    if (r != POPKCEL_WOULDBLOCK)
+        return r;
+    return waitOn(&ch->senders, &value);
+}
+
+int popkcel_channelTryRecv(struct Popkcel_Channel *ch, void **value)
+{
+    struct Popkcel_Waiter *w;
+    if (ch->count) {
+        *value = ch->items[ch->head];
+        ch->head = (ch->head + 1) % ch->capacity;
+        ch->count--;
+        // 缓冲区空出了位置，把第一个等待发送的数据放进去
+        if ((w = wakeOne(&ch->senders, POPKCEL_OK))) {
+            ch->items[(ch->head + ch->count) % ch->capacity] = w->value;
+            ch->count++;
+        }
+        return POPKCEL_OK;
+    }
+    if ((w = wakeOne(&ch->senders, POPKCEL_OK))) {
+        *value = w->value;
+        return POPKCEL_OK;
+    }
+    if (ch->closed)
+        return POPKCEL_ERROR;
+    return POPKCEL_WOULDBLOCK;
+}
+
+int popkcel_channelRecv(struct Popkcel_Channel *ch, void **value)
+{
+    int r = popkcel_channelTryRecv(ch, value);
+    if (r != POPKCEL_WOULDBLOCK)
+        return r;
+    *value = NULL;
+    return waitOn(&ch->receivers, value);
+}
+
+void popkcel_channelClose(struct Popkcel_Channel *ch)
+{
+    ch->closed = 1;
+    wakeAll(&ch->senders, POPKCEL_ERROR);
+    wakeAll(&ch->receivers, POPKCEL_ERROR);
+}
+
+void popkcel_initWaitGroup(struct Popkcel_WaitGroup *wg)
+{
+#    ifndef NDEBUG
+    if (popkcel_threadLoop && popkcel_threadLoop->running) {
+        ELCHECKIFONSTACK(popkcel_threadLoop, wg, "Do not allocate WaitGroup on stack!");
+    }
+#    endif
+    wg->waiters.head = wg->waiters.tail = NULL;
+    wg->count = 0;
+}
+
+void popkcel_waitGroupAdd(struct Popkcel_WaitGroup *wg, int delta)
+{
+    wg->count += delta;
+    assert(wg->count >= 0 && "WaitGroup count is negative!");
+    if (wg->count <= 0)
+        wakeAll(&wg->waiters, POPKCEL_OK);
+}
+
+void popkcel_waitGroupDone(struct Popkcel_WaitGroup *wg)
+{
+    popkcel_waitGroupAdd(wg, -1);
+}
+
+int popkcel_waitGroupWait(struct Popkcel_WaitGroup *wg)
+{
+    if (wg->count <= 0)
+        return POPKCEL_OK;
+    return waitOn(&wg->waiters, NULL);
+}
+
+void popkcel_initCoMutex(struct Popkcel_CoMutex *mutex)
+{
+#    ifndef NDEBUG
+    if (popkcel_threadLoop && popkcel_threadLoop->running) {
+        ELCHECKIFONSTACK(popkcel_threadLoop, mutex, "Do not allocate CoMutex on stack!");
+    }
+#    endif
+    mutex->waiters.head = mutex->waiters.tail = NULL;
+    mutex->locked = 0;
+}
+
+int popkcel_coMutexTryLock(struct Popkcel_CoMutex *mutex)
+{
+    if (mutex->locked)
+        return POPKCEL_WOULDBLOCK;
+    mutex->locked = 1;
+    return POPKCEL_OK;
+}
+
+int popkcel_coMutexLock(struct Popkcel_CoMutex *mutex)
+{
+    if (!mutex->locked) {
+        mutex->locked = 1;
+        return POPKCEL_OK;
+    }
+    return waitOn(&mutex->waiters, NULL);
+}
+
+void popkcel_coMutexUnlock(struct Popkcel_CoMutex *mutex)
+{
+    assert(mutex->locked && "CoMutex is not locked!");
+    // 有等待的协程时，锁直接交给它，locked保持为1，避免被其它协程抢先
+    if (!wakeOne(&mutex->waiters, POPKCEL_OK))
+        mutex->locked = 0;
+}
+
+static int deadlineTimerCb(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_Deadline *dl = data;
+    Popkcel_FuncCallback cb = dl->expireCb;
+    dl->expired = 1;
+    if (cb) {
+        dl->expireCb = NULL;
+        cb(dl->expireData, POPKCEL_WOULDBLOCK);
+    }
+    return 0;
+}
+
+void popkcel_setDeadline(struct Popkcel_Deadline *deadline, int64_t time)
+{
+    struct Popkcel_Loop *loop = popkcel_threadLoop;
+#    ifndef NDEBUG
+    ELCHECKIFONSTACK(loop, deadline, "Do not allocate Deadline on stack!");
+#    endif
+    deadline->prev = loop->curDeadline;
+    deadline->expireCb = NULL;
+    deadline->expired = 0;
+    popkcel_initTimer(&deadline->timer, loop);
+    if (deadline->prev) {
+        if (deadline->prev->time < time)
+            time = deadline->prev->time;
+        deadline->expired = deadline->prev->expired;
+    }
+    deadline->time = time;
+    loop->curDeadline = deadline;
+    if (!deadline->expired) {
+        int64_t ct = popkcel_getCurrentTime();
+        deadline->timer.funcCb = &deadlineTimerCb;
+        deadline->timer.cbData = deadline;
+        popkcel_setTimer(&deadline->timer, time > ct ? (unsigned int)(time - ct) : 0, 0);
+    }
+}
+
+void popkcel_clearDeadline(struct Popkcel_Deadline *deadline)
+{
+    assert(popkcel_threadLoop->curDeadline == deadline && "Deadlines must be cleared in reverse order!");
+    popkcel_stopTimer(&deadline->timer);
+    popkcel_threadLoop->curDeadline = deadline->prev;
+}
+
+/// popkcel_sleep使用的数据
+struct Popkcel_Sleeper
+{
+    struct Popkcel_Context context;
+    struct Popkcel_Timer timer;
+};
+
+static int sleeperWakeCb(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_Sleeper *sl = data;
+    popkcel_resumeLater(&sl->context);
+    return 0;
+}
+
+int popkcel_sleep(unsigned int ms)
+{
+    struct Popkcel_Deadline *dl = popkcel_threadLoop->curDeadline;
+    if (dl && dl->expired)
+        return POPKCEL_WOULDBLOCK;
+    struct Popkcel_Sleeper *sl = malloc(sizeof(struct Popkcel_Sleeper));
+    popkcel_initContext(&sl->context);
+    popkcel_initTimer(&sl->timer, popkcel_threadLoop);
+    int r;
+    // Deadline更早到期时，只用Deadline的timer来唤醒
+    if (dl && dl->time <= popkcel_getCurrentTime() + ms) {
+        dl->expireCb = &sleeperWakeCb;
+        dl->expireData = sl;
+        r = POPKCEL_WOULDBLOCK;
+    }
+    else {
+        sl->timer.funcCb = &sleeperWakeCb;
+        sl->timer.cbData = sl;
+        popkcel_setTimer(&sl->timer, ms, 0);
+        r = POPKCEL_OK;
+    }
+    popkcel_suspend(&sl->context);
+    popkcel_stopTimer(&sl->timer);
+    popkcel_destroyContext(&sl->context);
+    free(sl);
+    return r;
+}
 #endif
 
 #if (defined(_WIN32) || !defined(POPKCEL_SINGLETHREAD))
@@ -522,6 +1013,9 @@ void popkcel_initLoopPool(struct Popkcel_LoopPool *loopPool, size_t loopSize, si
     }
 #    endif // POPKCEL_SINGLETHREAD
     loopPool->loopSize = loopSize;
+#    ifndef POPKCEL_SINGLETHREAD
+    loopPool->workerPool = NULL;
+#    endif
     loopPool->loops = malloc((sizeof(struct Popkcel_Loop) + sizeof(Popkcel_ThreadType)) * loopSize);
     loopPool->threads = (Popkcel_ThreadType *)((char *)loopPool->loops + sizeof(struct Popkcel_Loop) * loopSize);
     for (size_t i = 0; i < loopSize; i++) {
@@ -531,6 +1025,12 @@ void popkcel_initLoopPool(struct Popkcel_LoopPool *loopPool, size_t loopSize, si
 
 void popkcel_destroyLoopPool(struct Popkcel_LoopPool *loopPool)
 {
+#    ifndef POPKCEL_SINGLETHREAD
+    if (loopPool->workerPool) {
+        popkcel_destroyWorkerPool(loopPool->workerPool);
+        free(loopPool->workerPool);
+    }
+#    endif
     for (size_t i = 0; i < loopPool->loopSize; i++) {
         popkcel_destroyLoop(&loopPool->loops[i]);
     }
@@ -574,6 +1074,541 @@ void popkcel_moveSocket(struct Popkcel_LoopPool *loopPool, size_t threadNum, str
 
 #endif
 
+#ifndef POPKCEL_SINGLETHREAD
+/// 线程池中的一项工作
+struct Popkcel_Work
+{
+    struct Popkcel_Work *next;
+    /// 提交工作的Loop，afterFn会在这个Loop中调用
+    struct Popkcel_Loop *loop;
+    Popkcel_FuncCallback workFn;
+    void *data;
+    Popkcel_FuncCallback afterFn;
+    void *afterData;
+    /// workFn的返回值
+    intptr_t rv;
+};
+
+/// popkcel_resolve缓存中的一个结果
+struct Popkcel_ResolveEntry
+{
+    struct Popkcel_ResolveEntry *next;
+    /// 由hints、host和service组成的键
+    char *key;
+    /// 过期的时间
+    int64_t expireTime;
+    struct addrinfo *ai;
+};
+
+static void clearResolveCache(struct Popkcel_WorkerPool *pool)
+{
+    struct Popkcel_ResolveEntry *e = pool->resolveCache;
+    while (e) {
+        struct Popkcel_ResolveEntry *next = e->next;
+        popkcel_freeAddrInfo(e->ai);
+        free(e->key);
+        free(e);
+        e = next;
+    }
+    pool->resolveCache = NULL;
+    pool->resolveCacheSize = 0;
+}
+
+static void *workerThread(void *arg)
+{
+    struct Popkcel_WorkerPool *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        struct Popkcel_Work *w = pool->head;
+        if (!w) {
+            if (pool->stopping)
+                break;
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        pool->head = w->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        w->rv = w->workFn(w->data, POPKCEL_OK);
+        struct Popkcel_Loop *loop = w->loop;
+        w->next = NULL;
+        pthread_mutex_lock(&loop->workMutex);
+        // 只有列表由空变为非空时才需要唤醒Loop，Loop会一次处理列表中所有的工作
+        char wasEmpty = !loop->doneHead;
+        if (loop->doneTail)
+            loop->doneTail->next = w;
+        else
+            loop->doneHead = w;
+        loop->doneTail = w;
+        pthread_mutex_unlock(&loop->workMutex);
+        if (wasEmpty)
+            popkcel_notifierNotify(loop->workNotifier);
+
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+int popkcel_initWorkerPool(struct Popkcel_WorkerPool *pool, size_t threadSize)
+{
+    if (threadSize == 0) {
+#    ifndef _SC_NPROCESSORS_ONLN
+        threadSize = 1;
+#    else
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threadSize = n > 0 ? (size_t)n : 1;
+#    endif
+    }
+    pool->head = pool->tail = NULL;
+    pool->resolveCache = NULL;
+    pool->resolveCacheSize = 0;
+    pool->resolveTtl = 60000;
+    pool->stopping = 0;
+    pool->threads = malloc(sizeof(pthread_t) * threadSize);
+    if (!pool->threads)
+        return POPKCEL_ERROR;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (pool->threadSize = 0; pool->threadSize < threadSize; pool->threadSize++) {
+        if (pthread_create(&pool->threads[pool->threadSize], NULL, &workerThread, pool))
+            break;
+    }
+    if (!pool->threadSize) {
+        popkcel_destroyWorkerPool(pool);
+        return POPKCEL_ERROR;
+    }
+    return POPKCEL_OK;
+}
+
+void popkcel_destroyWorkerPool(struct Popkcel_WorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->threadSize; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    clearResolveCache(pool);
+}
+
+void popkcel_loopSetWorkerPool(struct Popkcel_Loop *loop, struct Popkcel_WorkerPool *pool)
+{
+    loop->workerPool = pool;
+}
+
+int popkcel_loopPoolInitWorkers(struct Popkcel_LoopPool *loopPool, size_t threadSize)
+{
+    struct Popkcel_WorkerPool *pool = malloc(sizeof(struct Popkcel_WorkerPool));
+    if (popkcel_initWorkerPool(pool, threadSize) != POPKCEL_OK) {
+        free(pool);
+        return POPKCEL_ERROR;
+    }
+    loopPool->workerPool = pool;
+    for (size_t i = 0; i < loopPool->loopSize; i++)
+        loopPool->loops[i].workerPool = pool;
+    return POPKCEL_OK;
+}
+
+static int workDoneCb(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_Loop *loop = data;
+    pthread_mutex_lock(&loop->workMutex);
+    struct Popkcel_Work *w = loop->doneHead;
+    loop->doneHead = loop->doneTail = NULL;
+    pthread_mutex_unlock(&loop->workMutex);
+    while (w) {
+        struct Popkcel_Work *next = w->next;
+        if (w->afterFn)
+            w->afterFn(w->afterData, w->rv);
+        free(w);
+        w = next;
+    }
+    return 0;
+}
+
+// 把w加入线程池的队列，失败时w会被释放
+static int submitWork(struct Popkcel_Loop *loop, struct Popkcel_Work *w)
+{
+    struct Popkcel_WorkerPool *pool = loop->workerPool;
+    if (!pool)
+        goto labelError;
+    if (!loop->workNotifier) {
+        struct Popkcel_Notifier *nt = malloc(sizeof(struct Popkcel_Notifier));
+        if (popkcel_initNotifier(nt, loop) != POPKCEL_OK) {
+            free(nt);
+            goto labelError;
+        }
+        popkcel_notifierSetCb(nt, &workDoneCb, loop);
+        loop->workNotifier = nt;
+    }
+    w->loop = loop;
+    w->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail)
+        pool->tail->next = w;
+    else
+        pool->head = w;
+    pool->tail = w;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return POPKCEL_OK;
+
+labelError:
+    free(w);
+    return POPKCEL_ERROR;
+}
+
+int popkcel_queueWork(struct Popkcel_Loop *loop, Popkcel_FuncCallback workFn, Popkcel_FuncCallback afterFn, void *data)
+{
+    struct Popkcel_Work *w = malloc(sizeof(struct Popkcel_Work));
+    w->workFn = workFn;
+    w->data = data;
+    w->afterFn = afterFn;
+    w->afterData = data;
+    return submitWork(loop, w);
+}
+
+void popkcel_freeAddrInfo(struct addrinfo *ai)
+{
+    while (ai) {
+        struct addrinfo *next = ai->ai_next;
+        free(ai);
+        ai = next;
+    }
+}
+
+// 复制getaddrinfo的结果，每个节点的ai_addr和ai_canonname都和节点分配在一起，所以只需free节点
+static struct addrinfo *copyAddrInfo(const struct addrinfo *ai)
+{
+    struct addrinfo *head = NULL, **tail = &head;
+    for (; ai; ai = ai->ai_next) {
+        size_t nameLen = ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0;
+        struct addrinfo *n = malloc(sizeof(struct addrinfo) + ai->ai_addrlen + nameLen);
+        *n = *ai;
+        n->ai_addr = (struct sockaddr *)(n + 1);
+        memcpy(n->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        if (nameLen) {
+            n->ai_canonname = (char *)n->ai_addr + ai->ai_addrlen;
+            memcpy(n->ai_canonname, ai->ai_canonname, nameLen);
+        }
+        n->ai_next = NULL;
+        *tail = n;
+        tail = &n->ai_next;
+    }
+    return head;
+}
+
+static char *resolveKey(const char *host, const char *service, const struct addrinfo *hints)
+{
+    struct addrinfo h;
+    if (hints)
+        h = *hints;
+    else
+        memset(&h, 0, sizeof(struct addrinfo));
+    if (!host)
+        host = "";
+    if (!service)
+        service = "";
+    size_t len = strlen(host) + strlen(service) + 64;
+    char *key = malloc(len);
+    snprintf(key, len, "%d,%d,%d,%d|%s|%s", h.ai_flags, h.ai_family, h.ai_socktype, h.ai_protocol, host, service);
+    return key;
+}
+
+// 在缓存中查找，找到则返回结果的复制。调用者不能持有pool->mutex
+static struct addrinfo *resolveCacheFind(struct Popkcel_WorkerPool *pool, const char *key)
+{
+    struct addrinfo *r = NULL;
+    int64_t ct = popkcel_getCurrentTime();
+    pthread_mutex_lock(&pool->mutex);
+    for (struct Popkcel_ResolveEntry *e = pool->resolveCache; e; e = e->next) {
+        if (!strcmp(e->key, key)) {
+            if (e->expireTime > ct)
+                r = copyAddrInfo(e->ai);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return r;
+}
+
+// 把结果放进缓存，key的所有权会转移给缓存
+static void resolveCacheInsert(struct Popkcel_WorkerPool *pool, char *key, const struct addrinfo *ai)
+{
+    int64_t ct = popkcel_getCurrentTime();
+    struct Popkcel_ResolveEntry *ne = malloc(sizeof(struct Popkcel_ResolveEntry));
+    ne->key = key;
+    ne->ai = copyAddrInfo(ai);
+    pthread_mutex_lock(&pool->mutex);
+    ne->expireTime = ct + pool->resolveTtl;
+    // 去掉相同的键和已过期的结果。新结果插在表头，所以缓存满时表尾是最旧的
+    struct Popkcel_ResolveEntry **pe = &pool->resolveCache, *last = NULL, **plast = NULL;
+    while (*pe) {
+        struct Popkcel_ResolveEntry *e = *pe;
+        if (e->expireTime <= ct || !strcmp(e->key, key)) {
+            *pe = e->next;
+            popkcel_freeAddrInfo(e->ai);
+            free(e->key);
+            free(e);
+            pool->resolveCacheSize--;
+        }
+        else {
+            plast = pe;
+            last = e;
+            pe = &e->next;
+        }
+    }
+    if (pool->resolveCacheSize >= POPKCEL_RESOLVECACHESIZE) {
+        *plast = NULL;
+        popkcel_freeAddrInfo(last->ai);
+        free(last->key);
+        free(last);
+        pool->resolveCacheSize--;
+    }
+    ne->next = pool->resolveCache;
+    pool->resolveCache = ne;
+    pool->resolveCacheSize++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/// 一次域名解析
+struct Popkcel_ResolveJob
+{
+    struct Popkcel_WorkerPool *pool;
+    char *key;
+    char *host, *service;
+    struct addrinfo hints;
+    char hasHints;
+    struct addrinfo *result;
+    Popkcel_FuncCallback cb;
+    void *data;
+};
+
+static int resolveWorkFn(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_ResolveJob *job = data;
+    struct addrinfo *ai;
+    if (getaddrinfo(job->host, job->service, job->hasHints ? &job->hints : NULL, &ai))
+        return 0;
+    job->result = copyAddrInfo(ai);
+    if (job->pool->resolveTtl) {
+        resolveCacheInsert(job->pool, job->key, ai);
+        job->key = NULL;
+    }
+    freeaddrinfo(ai);
+    return 0;
+}
+
+static int resolveAfterFn(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_ResolveJob *job = data;
+    Popkcel_FuncCallback cb = job->cb;
+    void *cbData = job->data;
+    struct addrinfo *result = job->result;
+    free(job->key);
+    free(job->host);
+    free(job->service);
+    free(job);
+    return cb(cbData, (intptr_t)result);
+}
+
+static char *dupString(const char *str)
+{
+    if (!str)
+        return NULL;
+    size_t len = strlen(str) + 1;
+    char *r = malloc(len);
+    memcpy(r, str, len);
+    return r;
+}
+
+int popkcel_resolveCb(struct Popkcel_Loop *loop, const char *host, const char *service, const struct addrinfo *hints, Popkcel_FuncCallback cb, void *data)
+{
+    struct Popkcel_WorkerPool *pool = loop->workerPool;
+    if (!pool)
+        return POPKCEL_ERROR;
+    char *key = resolveKey(host, service, hints);
+    if (pool->resolveTtl) {
+        struct addrinfo *ai = resolveCacheFind(pool, key);
+        if (ai) {
+            free(key);
+            cb(data, (intptr_t)ai);
+            return POPKCEL_OK;
+        }
+    }
+    struct Popkcel_ResolveJob *job = malloc(sizeof(struct Popkcel_ResolveJob));
+    job->pool = pool;
+    job->key = key;
+    job->host = dupString(host);
+    job->service = dupString(service);
+    job->hasHints = hints != NULL;
+    if (hints)
+        job->hints = *hints;
+    job->result = NULL;
+    job->cb = cb;
+    job->data = data;
+    struct Popkcel_Work *w = malloc(sizeof(struct Popkcel_Work));
+    w->workFn = &resolveWorkFn;
+    w->data = job;
+    w->afterFn = &resolveAfterFn;
+    w->afterData = job;
+    if (submitWork(loop, w) != POPKCEL_OK) {
+        free(job->key);
+        free(job->host);
+        free(job->service);
+        free(job);
+        return POPKCEL_ERROR;
+    }
+    return POPKCEL_OK;
+}
+
+#    ifndef POPKCEL_NOFAKESYNC
+/// popkcel_awaitWork使用的数据。协程和afterFn都会引用它，两者都结束后才释放
+struct Popkcel_WorkAwaiter
+{
+    struct Popkcel_Context context;
+    struct Popkcel_Deadline *deadline;
+    intptr_t rv;
+    int refs;
+    char expired;
+};
+
+static void releaseAwaiter(struct Popkcel_WorkAwaiter *a)
+{
+    if (--a->refs == 0)
+        free(a);
+}
+
+static int awaitWorkDoneCb(void *data, intptr_t rv)
+{
+    struct Popkcel_WorkAwaiter *a = data;
+    a->rv = rv;
+    if (!a->expired) {
+        if (a->deadline)
+            a->deadline->expireCb = NULL;
+        popkcel_resumeLater(&a->context);
+    }
+    releaseAwaiter(a);
+    return 0;
+}
+
+static int awaitWorkExpireCb(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_WorkAwaiter *a = data;
+    a->expired = 1;
+    popkcel_resumeLater(&a->context);
+    return 0;
+}
+
+static struct Popkcel_WorkAwaiter *newAwaiter()
+{
+    struct Popkcel_WorkAwaiter *a = malloc(sizeof(struct Popkcel_WorkAwaiter));
+    popkcel_initContext(&a->context);
+    a->deadline = popkcel_threadLoop->curDeadline;
+    a->refs = 2;
+    a->expired = 0;
+    return a;
+}
+
+// 挂起协程，直到awaitWorkDoneCb被调用或到达Deadline。a会被释放
+static int waitAwaiter(struct Popkcel_WorkAwaiter *a, intptr_t *rv)
+{
+    if (a->deadline) {
+        a->deadline->expireCb = &awaitWorkExpireCb;
+        a->deadline->expireData = a;
+    }
+    popkcel_suspend(&a->context);
+    int r = a->expired ? POPKCEL_WOULDBLOCK : POPKCEL_OK;
+    if (rv && r == POPKCEL_OK)
+        *rv = a->rv;
+    popkcel_destroyContext(&a->context);
+    releaseAwaiter(a);
+    return r;
+}
+
+int popkcel_awaitWork(Popkcel_FuncCallback workFn, void *data, intptr_t *rv)
+{
+    struct Popkcel_Deadline *dl = popkcel_threadLoop->curDeadline;
+    if (dl && dl->expired)
+        return POPKCEL_WOULDBLOCK;
+    struct Popkcel_WorkAwaiter *a = newAwaiter();
+    struct Popkcel_Work *w = malloc(sizeof(struct Popkcel_Work));
+    w->workFn = workFn;
+    w->data = data;
+    w->afterFn = &awaitWorkDoneCb;
+    w->afterData = a;
+    if (submitWork(popkcel_threadLoop, w) != POPKCEL_OK) {
+        free(a);
+        return POPKCEL_ERROR;
+    }
+    return waitAwaiter(a, rv);
+}
+
+static int resolveAwaitDoneCb(void *data, intptr_t rv)
+{
+    struct Popkcel_WorkAwaiter *a = data;
+    // 协程已经因超时返回，结果没人要了
+    if (a->expired)
+        popkcel_freeAddrInfo((struct addrinfo *)rv);
+    return awaitWorkDoneCb(data, rv);
+}
+
+int popkcel_resolve(const char *host, const char *service, const struct addrinfo *hints, int timeout, struct addrinfo **result)
+{
+    struct Popkcel_Loop *loop = popkcel_threadLoop;
+    struct Popkcel_WorkerPool *pool = loop->workerPool;
+    *result = NULL;
+    if (!pool)
+        return POPKCEL_ERROR;
+    if (pool->resolveTtl) {
+        char *key = resolveKey(host, service, hints);
+        *result = resolveCacheFind(pool, key);
+        free(key);
+        if (*result)
+            return POPKCEL_OK;
+    }
+    if (loop->curDeadline && loop->curDeadline->expired)
+        return POPKCEL_WOULDBLOCK;
+    // 超时用一个临时的Deadline实现，它不会晚于外层的Deadline
+    struct Popkcel_Deadline *dl = NULL;
+    if (timeout > 0) {
+        dl = malloc(sizeof(struct Popkcel_Deadline));
+        popkcel_setDeadline(dl, popkcel_getCurrentTime() + timeout);
+    }
+    struct Popkcel_WorkAwaiter *a = newAwaiter();
+    intptr_t rv;
+    int r;
+    if (popkcel_resolveCb(loop, host, service, hints, &resolveAwaitDoneCb, a) != POPKCEL_OK) {
+        free(a);
+        r = POPKCEL_ERROR;
+    }
+    else {
+        r = waitAwaiter(a, &rv);
+        if (r == POPKCEL_OK) {
+            *result = (struct addrinfo *)rv;
+            if (!rv)
+                r = POPKCEL_ERROR;
+        }
+    }
+    if (dl) {
+        popkcel_clearDeadline(dl);
+        free(dl);
+    }
+    return r;
+}
+#    endif
+#endif
+
 int popkcel_bind(struct Popkcel_Socket *sock, uint16_t port)
 {
     struct sockaddr_in6 addr;
@@ -27,6 +27,7 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 typedef SSIZE_T ssize_t;
 #else
 #    include <arpa/inet.h>
+#    include <netdb.h>
 #    include <netinet/in.h>
 #    include <sys/socket.h>
 #    ifdef __linux__
@@ -166,6 +167,18 @@ enum Popkcel_SocketType {
 };
 
 #ifndef POPKCEL_NOFAKESYNC
+/// Context在Loop就绪队列中的状态
+enum Popkcel_ReadyState {
+    /// 不在就绪队列中
+    POPKCEL_RS_NONE,
+    /// 在就绪队列中，等待被恢复
+    POPKCEL_RS_RESUME,
+    /// 在就绪队列中，是popkcel_spawn创建的、还没开始运行的协程
+    POPKCEL_RS_SPAWN
+};
+
+struct Popkcel_Deadline;
+
 /// 用于记录切换协程所需信息的结构体
 struct Popkcel_Context
 {
@@ -175,6 +188,14 @@ struct Popkcel_Context
     char *stackPos;
     /// 保存协程切换时的stack内容
     char *savedStack;
+    /// savedStack分配的大小，再次挂起时stack不超过它就重复使用
+    size_t savedSize;
+    /// 就绪队列中的下一个Context
+    struct Popkcel_Context *nextReady;
+    /// 协程挂起时所在的Deadline作用域，恢复时会重新设为当前的Deadline
+    struct Popkcel_Deadline *deadline;
+    /// 在就绪队列中的状态，见Popkcel_ReadyState enum
+    char readyState;
 };
 
 /// 初始化Context结构体
@@ -182,6 +203,9 @@ struct Popkcel_Context
 static inline void popkcel_initContext(struct Popkcel_Context *context)
 {
     context->savedStack = NULL;
+    context->savedSize = 0;
+    context->deadline = NULL;
+    context->readyState = POPKCEL_RS_NONE;
 }
 
 /// 销毁Context结构体，这不会从内存中删除该Context
@@ -542,6 +566,8 @@ struct Popkcel_MultiOperation
     struct Popkcel_Loop *loop;
     /// 在多次回调模式中，与本次的回调相关的socket
     struct Popkcel_PSSocket *curSocket;
+    /// 如果等待时使用了当前协程的Deadline来代替timer，则指向该Deadline
+    struct Popkcel_Deadline *deadline;
     /// 仍未完成异步操作的Socket的数量
     int count;
     /// 是否为多次回调模式
@@ -566,6 +592,8 @@ LIBPOPKCEL_EXTERN void popkcel_destroyMultiOperation(struct Popkcel_MultiOperati
  */
 LIBPOPKCEL_EXTERN void popkcel_resetMultiOperation(struct Popkcel_MultiOperation *mo);
 /**挂起MultiOperation，等待所有操作结束或者超时。如果没有需要异步完成的操作，那么本函数会立即返回。
+ *
+ * 如果当前协程设置了Deadline，且Deadline比timeout更早到期（或timeout小于等于0），那么会使用Deadline的timer，不再单独设置timer。Deadline到期时的行为与超时相同。
  * @param mo 要挂起的MultiOperation
  * @param timeout 超时时长，单位为毫秒。小于等于0表示无限等待。
  * @param multiCallback 非0表示是多次回调模式。
@@ -721,6 +749,165 @@ LIBPOPKCEL_EXTERN void popkcel_multiRecvfrom(struct Popkcel_PSSocket *sock, char
  * @return 结果为正数表示读取成功，且该值为读取的字节数。为POPKCEL_ERROR表示显式地失败。为POPKCEL_WOULDBLOCK表示超时。若为0表示读取结束，通常表明连接已断开。
  */
 LIBPOPKCEL_EXTERN ssize_t popkcel_recvfrom(struct Popkcel_PSSocket *sock, char *buf, size_t len, struct sockaddr *addr, socklen_t *addrLen, int timeout);
+
+struct Popkcel_Waiter;
+
+/// 等待队列，存放在Channel、WaitGroup、CoMutex上挂起的协程。等待和唤醒都不需要Notifier和Timer。
+struct Popkcel_WaitQueue
+{
+    struct Popkcel_Waiter *head, *tail;
+};
+
+/// 有界的Channel，用于同一个Loop中的协程之间传递数据。注意，Channel一定要分配在heap上，不能分配在stack上。
+struct Popkcel_Channel
+{
+    /// 环形缓冲区
+    void **items;
+    /// 缓冲区能存放的数据个数，为0表示发送方要等到接收方取走数据才返回
+    size_t capacity;
+    /// 缓冲区中第一个数据的索引
+    size_t head;
+    /// 缓冲区中的数据个数
+    size_t count;
+    /// 等待发送的协程
+    struct Popkcel_WaitQueue senders;
+    /// 等待接收的协程
+    struct Popkcel_WaitQueue receivers;
+    /// 是否已关闭
+    char closed;
+};
+
+/**初始化Channel
+ * @param ch 要初始化的Channel
+ * @param capacity 缓冲区能存放的数据个数，可以为0
+ * @return 初始化成功则返回POPKCEL_OK，否则返回POPKCEL_ERROR
+ */
+LIBPOPKCEL_EXTERN int popkcel_initChannel(struct Popkcel_Channel *ch, size_t capacity);
+/**销毁Channel，这不会将Channel从内存中删除。销毁前应确保没有协程在等待这个Channel，可以先调用popkcel_channelClose。
+ * @param ch 要销毁的Channel
+ */
+LIBPOPKCEL_EXTERN void popkcel_destroyChannel(struct Popkcel_Channel *ch);
+/**向Channel发送数据。如果缓冲区已满，则挂起协程，直到有空位或Channel被关闭。
+ * @param ch 相关的Channel
+ * @param value 要发送的数据
+ * @return 返回POPKCEL_OK表示发送成功，返回POPKCEL_ERROR表示Channel已关闭，返回POPKCEL_WOULDBLOCK表示等待时到达了Deadline，数据没有发送
+ */
+LIBPOPKCEL_EXTERN int popkcel_channelSend(struct Popkcel_Channel *ch, void *value);
+/**从Channel接收数据。如果没有数据，则挂起协程，直到有数据或Channel被关闭。
+ * @param ch 相关的Channel
+ * @param value [out]接收到的数据
+ * @return 返回POPKCEL_OK表示接收成功，返回POPKCEL_ERROR表示Channel已关闭且没有剩余的数据，返回POPKCEL_WOULDBLOCK表示等待时到达了Deadline
+ */
+LIBPOPKCEL_EXTERN int popkcel_channelRecv(struct Popkcel_Channel *ch, void **value);
+/**尝试向Channel发送数据，此函数不会挂起协程，可以在普通的回调函数中使用。
+ * @param ch 相关的Channel
+ * @param value 要发送的数据
+ * @return 返回POPKCEL_OK表示发送成功，返回POPKCEL_WOULDBLOCK表示缓冲区已满，返回POPKCEL_ERROR表示Channel已关闭
+ */
+LIBPOPKCEL_EXTERN int popkcel_channelTrySend(struct Popkcel_Channel *ch, void *value);
+/**尝试从Channel接收数据，此函数不会挂起协程，可以在普通的回调函数中使用。
+ * @param ch 相关的Channel
+ * @param value [out]接收到的数据
+ * @return 返回POPKCEL_OK表示接收成功，返回POPKCEL_WOULDBLOCK表示没有数据，返回POPKCEL_ERROR表示Channel已关闭且没有剩余的数据
+ */
+LIBPOPKCEL_EXTERN int popkcel_channelTryRecv(struct Popkcel_Channel *ch, void **value);
+/**关闭Channel。所有等待发送的协程都会返回POPKCEL_ERROR，等待接收的协程也会返回POPKCEL_ERROR。缓冲区中剩余的数据仍然可以被接收。
+ * @param ch 要关闭的Channel
+ */
+LIBPOPKCEL_EXTERN void popkcel_channelClose(struct Popkcel_Channel *ch);
+
+/// 用于等待一组协程完成。注意，WaitGroup一定要分配在heap上，不能分配在stack上。
+struct Popkcel_WaitGroup
+{
+    /// 等待中的协程
+    struct Popkcel_WaitQueue waiters;
+    /// 未完成的数量
+    int count;
+};
+
+/**初始化WaitGroup
+ * @param wg 要初始化的WaitGroup
+ */
+LIBPOPKCEL_EXTERN void popkcel_initWaitGroup(struct Popkcel_WaitGroup *wg);
+/**增加或减少未完成的数量。当数量变为0时，所有等待中的协程都会被恢复。
+ * @param wg 相关的WaitGroup
+ * @param delta 要增加的数量，可以为负数
+ */
+LIBPOPKCEL_EXTERN void popkcel_waitGroupAdd(struct Popkcel_WaitGroup *wg, int delta);
+/**将未完成的数量减1，等于popkcel_waitGroupAdd(wg, -1)
+ * @param wg 相关的WaitGroup
+ */
+LIBPOPKCEL_EXTERN void popkcel_waitGroupDone(struct Popkcel_WaitGroup *wg);
+/**挂起协程，直到未完成的数量变为0。如果数量已经是0，则立即返回。
+ * @param wg 相关的WaitGroup
+ * @return 返回POPKCEL_OK，返回POPKCEL_WOULDBLOCK表示等待时到达了Deadline
+ */
+LIBPOPKCEL_EXTERN int popkcel_waitGroupWait(struct Popkcel_WaitGroup *wg);
+
+/// 协程互斥锁，用于同一个Loop中的协程之间互斥。注意，它不能用于线程间的互斥，而且一定要分配在heap上，不能分配在stack上。
+struct Popkcel_CoMutex
+{
+    /// 等待加锁的协程
+    struct Popkcel_WaitQueue waiters;
+    /// 是否已加锁
+    char locked;
+};
+
+/**初始化CoMutex
+ * @param mutex 要初始化的CoMutex
+ */
+LIBPOPKCEL_EXTERN void popkcel_initCoMutex(struct Popkcel_CoMutex *mutex);
+/**加锁。如果已经被其它协程锁住，则挂起协程，直到获得锁。等待的协程按先来后到的顺序获得锁。
+ * @param mutex 相关的CoMutex
+ * @return 返回POPKCEL_OK，返回POPKCEL_WOULDBLOCK表示等待时到达了Deadline，没有获得锁
+ */
+LIBPOPKCEL_EXTERN int popkcel_coMutexLock(struct Popkcel_CoMutex *mutex);
+/**尝试加锁，此函数不会挂起协程。
+ * @param mutex 相关的CoMutex
+ * @return 返回POPKCEL_OK表示加锁成功，返回POPKCEL_WOULDBLOCK表示已被锁住
+ */
+LIBPOPKCEL_EXTERN int popkcel_coMutexTryLock(struct Popkcel_CoMutex *mutex);
+/**解锁。如果有等待中的协程，锁会直接交给第一个等待的协程。
+ * @param mutex 相关的CoMutex
+ */
+LIBPOPKCEL_EXTERN void popkcel_coMutexUnlock(struct Popkcel_CoMutex *mutex);
+
+/**
+ * 协程的截止时间。在popkcel_setDeadline和popkcel_clearDeadline之间，当前协程的所有伪同步调用（包括popkcel_sleep、Channel、WaitGroup、CoMutex）都会在截止时间到达时返回超时。
+ *
+ * 同一个Deadline作用域中的所有调用共享同一个timer，不会每次调用都设置新的timer。注意，Deadline一定要分配在heap上，不能分配在stack上。
+ */
+struct Popkcel_Deadline
+{
+    struct Popkcel_Timer timer;
+    /// 外层的Deadline，嵌套使用时有效
+    struct Popkcel_Deadline *prev;
+    /// 截止时间，与popkcel_getCurrentTime的返回值比较
+    int64_t time;
+    /// 到期时要调用的函数，由正在等待的伪同步调用设置，调用一次后会被清除
+    Popkcel_FuncCallback expireCb;
+    void *expireData;
+    /// 是否已到期
+    char expired;
+};
+
+/**
+ * 为当前协程设置截止时间，直到调用popkcel_clearDeadline为止。可以嵌套使用，内层的截止时间不会晚于外层的截止时间。
+ * @param deadline 未使用的Deadline，必须分配在heap上
+ * @param time 截止时间，为绝对时间，即popkcel_getCurrentTime() + 毫秒数
+ */
+LIBPOPKCEL_EXTERN void popkcel_setDeadline(struct Popkcel_Deadline *deadline, int64_t time);
+/**
+ * 结束Deadline作用域，恢复外层的Deadline。必须按与popkcel_setDeadline相反的顺序调用，协程结束前必须调用。
+ * @param deadline 当前协程最内层的Deadline，调用后可以释放
+ */
+LIBPOPKCEL_EXTERN void popkcel_clearDeadline(struct Popkcel_Deadline *deadline);
+/**
+ * 挂起当前协程指定的时间。
+ * @param ms 要挂起的毫秒数
+ * @return 返回POPKCEL_OK表示已经过了指定的时间，返回POPKCEL_WOULDBLOCK表示先到达了Deadline
+ */
+LIBPOPKCEL_EXTERN int popkcel_sleep(unsigned int ms);
 #endif
 
 /// 有新连接出现时会执行的回调函数的类型. data是用户指定的数据. fd是新连接的文件描述符. addr是新连接的来源地址. addrLen是addr所占的字节数
@@ -807,6 +994,23 @@ struct Popkcel_Loop
     char *stackPos;
     /// 当前的Context，用于在协程resume后，可以用threadLoop->curContext来获得当前的Context，以进行stack的恢复
     struct Popkcel_Context *curContext;
+    /// 就绪队列的头和尾。加入就绪队列的协程会在本轮或下一轮事件循环的末尾被恢复，而不是在回调函数中直接恢复
+    struct Popkcel_Context *readyHead, *readyTail;
+    /// 本轮事件循环正在处理的一批就绪协程。处理期间新加入就绪队列的协程要等到下一轮才处理，以保证公平
+    struct Popkcel_Context *runningReady;
+    /// popkcel_yield用过的Context，用nextReady连接，下次yield时直接取用
+    struct Popkcel_Context *freeContexts;
+    /// 当前运行中的协程的Deadline，协程切换时会随之切换
+    struct Popkcel_Deadline *curDeadline;
+#endif
+#ifndef POPKCEL_SINGLETHREAD
+    /// 执行popkcel_queueWork所用的线程池，为NULL表示不能使用popkcel_queueWork
+    struct Popkcel_WorkerPool *workerPool;
+    /// 工作线程完成工作后，用它来唤醒Loop。第一次调用popkcel_queueWork时创建
+    struct Popkcel_Notifier *workNotifier;
+    /// 已完成，等待在Loop中调用afterFn的工作。由workMutex保护
+    struct Popkcel_Work *doneHead, *doneTail;
+    pthread_mutex_t workMutex;
 #endif
     // struct Popkcel_HashInfo** moHash;
     // size_t hashSize;
@@ -818,6 +1022,10 @@ struct Popkcel_Loop
     int curIndex;
     /// 事件循环函数中使用，记录是否已初始化。因为事件循环函数的局部变量容易在stack恢复时被修改，所以用局部变量记录这个不安全。
     char inited;
+#ifndef POPKCEL_NOFAKESYNC
+    /// 事件循环函数中使用，记录本轮循环是否已经取出了一批就绪协程。
+    char readyTaken;
+#endif
     /// Loop是否在运行中
     char running;
 };
@@ -883,6 +1091,10 @@ struct Popkcel_LoopPool
     Popkcel_ThreadType *threads;
     /// Loop的数量
     size_t loopSize;
+#    ifndef POPKCEL_SINGLETHREAD
+    /// 所有Loop共享的线程池，见popkcel_loopPoolInitWorkers
+    struct Popkcel_WorkerPool *workerPool;
+#    endif
     /// 如果执行了popkcel_loopPoolRun，则为1。如果执行了popkcel_loopPoolDetach，则为0。
     char isRun;
 };
@@ -919,6 +1131,111 @@ LIBPOPKCEL_EXTERN int popkcel_loopPoolRun(struct Popkcel_LoopPool *loopPool);
 LIBPOPKCEL_EXTERN void popkcel_moveSocket(struct Popkcel_LoopPool *loopPool, size_t threadNum, struct Popkcel_Socket *sock);
 #endif
 
+#ifndef POPKCEL_SINGLETHREAD
+struct Popkcel_Work;
+struct Popkcel_ResolveEntry;
+
+/// popkcel_resolve的缓存最多保存的结果数
+#    define POPKCEL_RESOLVECACHESIZE 64
+
+/// 工作线程池，用于执行会阻塞Loop的工作，比如读磁盘、压缩等。线程数是固定的，多余的工作会排队等待。可以被多个Loop共享
+struct Popkcel_WorkerPool
+{
+    pthread_mutex_t mutex;
+    /// 有新工作或要停止时，用于唤醒工作线程
+    pthread_cond_t cond;
+    /// 排队中的工作
+    struct Popkcel_Work *head, *tail;
+    /// 线程数组
+    pthread_t *threads;
+    /// 线程的数量
+    size_t threadSize;
+    /// popkcel_resolve的缓存，由mutex保护。共享同一个线程池的Loop也共享这个缓存
+    struct Popkcel_ResolveEntry *resolveCache;
+    /// 缓存中的结果数
+    size_t resolveCacheSize;
+    /// 缓存的有效时间，单位为毫秒，默认为60000。为0表示不使用缓存
+    unsigned int resolveTtl;
+    /// 是否正在销毁
+    char stopping;
+};
+
+/**
+ * 初始化线程池，并启动所有的工作线程
+ * @param pool 要初始化的线程池
+ * @param threadSize 线程数，为0表示取CPU核数
+ * @return 初始化成功则返回POPKCEL_OK，否则返回POPKCEL_ERROR
+ */
+LIBPOPKCEL_EXTERN int popkcel_initWorkerPool(struct Popkcel_WorkerPool *pool, size_t threadSize);
+/**
+ * 销毁线程池，这不会将线程池从内存中删除。此函数会等待已排队的工作都执行完毕，但它们的afterFn不一定会被调用。
+ * @param pool 要销毁的线程池
+ */
+LIBPOPKCEL_EXTERN void popkcel_destroyWorkerPool(struct Popkcel_WorkerPool *pool);
+/**
+ * 设置Loop所使用的线程池。只能在Loop运行之前或Loop所在的线程中调用。
+ * @param loop 相关的Loop
+ * @param pool 要使用的线程池
+ */
+LIBPOPKCEL_EXTERN void popkcel_loopSetWorkerPool(struct Popkcel_Loop *loop, struct Popkcel_WorkerPool *pool);
+/**
+ * 为LoopPool创建一个所有Loop共享的线程池，线程池会在popkcel_destroyLoopPool中销毁
+ * @param loopPool 相关的LoopPool
+ * @param threadSize 线程数，为0表示取CPU核数
+ * @return 成功则返回POPKCEL_OK，否则返回POPKCEL_ERROR
+ */
+LIBPOPKCEL_EXTERN int popkcel_loopPoolInitWorkers(struct Popkcel_LoopPool *loopPool, size_t threadSize);
+/**
+ * 把工作放到Loop的线程池中执行，此函数会立即返回。只能在Loop所在的线程中调用，或者在Loop运行之前调用。
+ *
+ * 工作完成后，afterFn会在Loop所在的线程中调用。同一轮中完成的多个工作只会唤醒Loop一次。
+ * @param loop 相关的Loop，必须已设置线程池
+ * @param workFn 在工作线程中执行的函数，第二个参数为POPKCEL_OK。注意它不能使用Loop相关的函数
+ * @param afterFn 在Loop中执行的函数，第二个参数为workFn的返回值，可以为NULL
+ * @param data 传入workFn和afterFn的用户数据
+ * @return 返回POPKCEL_OK表示已加入队列，返回POPKCEL_ERROR表示Loop没有设置线程池或创建Notifier失败
+ */
+LIBPOPKCEL_EXTERN int popkcel_queueWork(struct Popkcel_Loop *loop, Popkcel_FuncCallback workFn, Popkcel_FuncCallback afterFn, void *data);
+#    ifndef POPKCEL_NOFAKESYNC
+/**
+ * 伪同步版本的popkcel_queueWork。把工作放到当前Loop的线程池中执行，并挂起协程，直到工作完成。
+ *
+ * 如果到达了当前协程的Deadline，本函数会返回POPKCEL_WOULDBLOCK，但工作仍会继续执行，所以data要保持有效，直到工作完成。
+ * @param workFn 在工作线程中执行的函数，第二个参数为POPKCEL_OK
+ * @param data 传入workFn的用户数据
+ * @param rv [out]workFn的返回值，可以为NULL
+ * @return 返回POPKCEL_OK表示工作已完成，返回POPKCEL_WOULDBLOCK表示到达了Deadline，返回POPKCEL_ERROR表示没有设置线程池
+ */
+LIBPOPKCEL_EXTERN int popkcel_awaitWork(Popkcel_FuncCallback workFn, void *data, intptr_t *rv);
+/**
+ * 伪同步地解析域名，getaddrinfo会在当前Loop的线程池中执行，不会阻塞Loop。结果会在线程池的缓存中保存resolveTtl毫秒。
+ * @param host 要解析的域名或ip，参见getaddrinfo
+ * @param service 服务名或端口，可以为NULL
+ * @param hints 参见getaddrinfo，可以为NULL
+ * @param timeout 超时的毫秒数，小于等于0表示不设超时。当前协程的Deadline也同样有效
+ * @param result [out]解析的结果，用完后要用popkcel_freeAddrInfo释放，不能用freeaddrinfo
+ * @return 返回POPKCEL_OK表示解析成功，返回POPKCEL_WOULDBLOCK表示超时，返回POPKCEL_ERROR表示解析失败或没有设置线程池
+ */
+LIBPOPKCEL_EXTERN int popkcel_resolve(const char *host, const char *service, const struct addrinfo *hints, int timeout, struct addrinfo **result);
+#    endif
+/**
+ * 回调版本的popkcel_resolve。只能在Loop所在的线程中调用，或者在Loop运行之前调用。
+ * @param loop 相关的Loop，必须已设置线程池
+ * @param host 要解析的域名或ip，参见getaddrinfo
+ * @param service 服务名或端口，可以为NULL
+ * @param hints 参见getaddrinfo，可以为NULL
+ * @param cb 解析完成后在Loop中调用的函数。第二个参数为struct addrinfo *类型的结果，用完后要用popkcel_freeAddrInfo释放。为0表示解析失败。缓存命中时，cb会在本函数返回前被调用
+ * @param data 传入回调函数的用户数据
+ * @return 返回POPKCEL_OK表示cb一定会被调用，返回POPKCEL_ERROR表示没有设置线程池，cb不会被调用
+ */
+LIBPOPKCEL_EXTERN int popkcel_resolveCb(struct Popkcel_Loop *loop, const char *host, const char *service, const struct addrinfo *hints, Popkcel_FuncCallback cb, void *data);
+/**
+ * 释放popkcel_resolve或popkcel_resolveCb返回的结果
+ * @param ai 要释放的结果
+ */
+LIBPOPKCEL_EXTERN void popkcel_freeAddrInfo(struct addrinfo *ai);
+#endif
+
 /// 当前线程正在运行中的Loop
 extern POPKCEL_THREADLOCAL struct Popkcel_Loop *popkcel_threadLoop;
 
@@ -972,6 +1289,30 @@ LIBPOPKCEL_EXTERN void popkcel_resume(struct Popkcel_Context *context);
  * @param context [out]存储协程相关数据的结构体
  */
 LIBPOPKCEL_EXTERN void popkcel_suspend(struct Popkcel_Context *context);
+/**
+ * 把已挂起的协程加入当前线程Loop的就绪队列，此函数会立即返回。协程会在事件循环处理完本轮的事件后被恢复。
+ *
+ * 与popkcel_resume不同，调用此函数的回调函数可以正常执行完毕并返回，协程不会嵌套在回调函数中恢复。如果该协程已在就绪队列中，则此函数不做任何事。
+ * @param context 要恢复的协程的关联数据，必须分配在heap上
+ */
+LIBPOPKCEL_EXTERN void popkcel_resumeLater(struct Popkcel_Context *context);
+/**
+ * 创建一个新的协程，它会在事件循环处理完本轮的事件后开始运行。与popkcel_oneShotCallback相比，它不需要创建Notifier。
+ *
+ * 只能在loop所在的线程中调用，或者在loop运行之前调用。
+ * @param loop 协程所在的Loop
+ * @param cb 协程执行的函数，第二个参数为POPKCEL_OK，返回值会被忽略
+ * @param data 传入函数的用户数据
+ */
+LIBPOPKCEL_EXTERN void popkcel_spawn(struct Popkcel_Loop *loop, Popkcel_FuncCallback cb, void *data);
+/**
+ * 挂起当前协程，并把它放到就绪队列的末尾，让其它就绪的协程和事件先执行。当前协程会在下一轮事件循环中恢复。
+ */
+LIBPOPKCEL_EXTERN void popkcel_yield();
+/// 内部使用，在事件循环中恢复一批就绪的协程
+void popkcel__runReady(struct Popkcel_Loop *loop);
+/// 内部使用，在popkcel_destroyLoop中释放popkcel_yield留下的Context
+void popkcel__freeContexts(struct Popkcel_Loop *loop);
 #endif
 
 LIBPOPKCEL_EXTERN void *popkcel_dlopen(const char *fileName);
@@ -12,7 +12,40 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 
 #include "popkcel.h"
 
-#define POPKCEL_PSRVERSION 0
+/// SYN中的协议版本号，双方取较低的那个。版本1开始使用CRC32C校验，版本2开始支持popkcel_psrSetPeerAckFrequency，版本3开始支持多个流和数据报，版本4开始支持SYN中带数据
+#define POPKCEL_PSRVERSION 4
+/// 还没有RTT采样时使用的重传超时，单位为毫秒
+#define POPKCEL_PSRINITRTO 1000
+/// 默认的重传超时下限，单位为毫秒
+#define POPKCEL_PSRMINRTO 20
+/// 默认的重传超时上限，单位为毫秒
+#define POPKCEL_PSRMAXRTO 5000
+/// 默认的最大发送次数，一个包发送了这么多次仍未被确认，则视为连接出错
+#define POPKCEL_PSRMAXSENDCOUNT 10
+/// 拥塞窗口的初始值，单位为包
+#define POPKCEL_PSRINITCWND 10
+/// 默认的快速重传阈值，一个包之后发送的包被确认了这么多次，就认为这个包丢失了
+#define POPKCEL_PSRDUPTHRESH 3
+/// 默认收到这么多个数据包后立即回复确认
+#define POPKCEL_PSRACKEVERY 2
+/// 默认的最大确认延迟，单位为毫秒
+#define POPKCEL_PSRACKDELAY 10
+/// 默认的发送缓存时间，单位为毫秒
+#define POPKCEL_PSRSENDDELAY 10
+/// 默认的令牌桶容量，单位为包
+#define POPKCEL_PSRPACEBURST 4
+/// sendmmsg和recvmmsg一次最多处理的包数
+#define POPKCEL_PSRBATCH 32
+/// 默认的有序流的数量，流编号从1到maxStreams - 1
+#define POPKCEL_PSRMAXSTREAMS 16
+/// 可靠但不保证顺序的流的编号，数据收到后立即交给用户
+#define POPKCEL_PSRSTREAM_UNORDERED 0xffff
+/// 用popkcel_psrSendDatagram发送的不可靠数据报在recvStream中的编号
+#define POPKCEL_PSRSTREAM_DATAGRAM 0xfffe
+/// 消息模式下默认的最大消息长度
+#define POPKCEL_PSRMAXMESSAGE (1 << 20)
+/// 连接空闲这么多毫秒后释放空的发送环、接收重排和确认位图
+#define POPKCEL_PSRIDLEFREE 5000
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,25 +69,115 @@ enum Popkcel_PsrFlag {
     POPKCEL_PF_APT = 1 << 7
 };
 
+/// 数据包的校验方式，在握手时协商
+enum Popkcel_PsrChecksum {
+    /// 旧版本使用的按4字节异或，只能防止伪造
+    POPKCEL_PSRCHECKSUM_XOR,
+    /// CRC32C，CPU支持时使用硬件指令
+    POPKCEL_PSRCHECKSUM_CRC32C
+};
+
+/// 发送新数据包时的限速方式
+enum Popkcel_PsrPacing {
+    /// 窗口允许时立即发送
+    POPKCEL_PSRPACING_NONE,
+    /// 每个连接一个令牌桶，令牌不足时由timer延后发送
+    POPKCEL_PSRPACING_TIMER,
+    /// 把速率通过SO_MAX_PACING_RATE交给内核，需要fq队列规则，且socket上只有这一个连接。不支持时退回POPKCEL_PSRPACING_TIMER
+    POPKCEL_PSRPACING_KERNEL
+};
+
 struct Popkcel_PsrSocket;
 struct Popkcel_PsrField;
 
-struct Popkcel_RbtnodePsrSend
+#define POPKCEL_MAXUDPSIZE 1472
+
+/// 一个要发送的PSR数据包。包从PsrSocket的包池中分配，发送后按序号存放在psrField的sendRing中，直到被确认
+struct Popkcel_PsrPacket
 {
-    POPKCEL_RBTFIELD
-    struct Popkcel_Timer timer;
+    /// 在包池的空闲链表或psrField的延后队列中的下一个包
+    struct Popkcel_PsrPacket *next;
+    /// 在psrField的发送顺序链表中的前后两个包
+    struct Popkcel_PsrPacket *sentPrev, *sentNext;
+    struct Popkcel_PsrSocket *sock;
     struct Popkcel_PsrField *psr;
     Popkcel_FuncCallback callback;
     void *userData;
     size_t bufLen;
+    /// 第一次发送的时间，用于RTT采样
+    int64_t sendTime;
+    /// 到这个时间还没被确认就重传
+    int64_t resendTime;
+    uint32_t id;
+    /// 最后一次发送时的psr->sendSeq
+    uint32_t sendSeq;
+    /// 最后一次发送之后，收到了多少次对更晚发送的包的确认
+    uint32_t ackSkip;
     int sendCount;
+    /// 为1表示包在等待发送，为2表示等待发送时已被释放，发送后再还回包池
     char pending;
-    char buffer[];
+    /// 直接在这里构造要发送的包，发送、重传和排队等待发送都用这个buffer
+    char buffer[POPKCEL_MAXUDPSIZE];
 };
 
-#define POPKCEL_MAXUDPSIZE 1472
+/// 按序号暂存提前到达的包，bits中对应的位为1表示该位置有记录。第一次使用时分配，连接空闲时释放，大小是不小于window + 1的2的幂
+struct Popkcel_PsrReorder
+{
+    struct Popkcel_PsrPacket **ring;
+    uint64_t *bits;
+    uint32_t mask;
+    /// 记录的数量
+    uint32_t count;
+};
 
-struct Popkcel_PsrField;
+/// 消息模式下正在重组的跨多个包的消息
+struct Popkcel_PsrMessage
+{
+    /// 为NULL表示没有正在重组的消息
+    char *buf;
+    uint32_t len;
+    /// 已经收到的字节数
+    uint32_t pos;
+};
+
+/// 连接中的一个有序流，有自己的序号，一个流中的丢包不会阻塞其它流
+struct Popkcel_PsrStream
+{
+    /// 下一个发送的包在流内的序号
+    uint32_t sendSeq;
+    /// 下一个要交给用户的包在流内的序号
+    uint32_t recvSeq;
+    /// 流内序号不连续的包
+    struct Popkcel_PsrReorder reorder;
+    struct Popkcel_PsrMessage message;
+};
+
+/// 等待批量发送或等待socket可写的包
+struct Popkcel_PsrSendEntry
+{
+    /// psr为NULL的包不需要重传，发送后还回包池
+    struct Popkcel_PsrPacket *rps;
+    struct sockaddr_in6 addr;
+    socklen_t addrLen;
+};
+
+/** 拥塞控制算法。算法通过修改psr->cwnd来限制已发送但未被确认的包的数量（psr->inflight），
+ *  私有的数据可以放在psr->congestionData中。除onAck和onLoss外的回调可以为NULL。
+ */
+struct Popkcel_PsrCongestion
+{
+    /// 设置算法时调用，用于初始化cwnd等数据
+    void (*init)(struct Popkcel_PsrField *psr);
+    /// 更换算法或destroyPsrField时调用
+    void (*destroy)(struct Popkcel_PsrField *psr);
+    /// rps被确认时调用，此时psr->srtt已经用rps更新过了
+    void (*onAck)(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps);
+    /// 检测到丢包时调用，timeout为1表示rps重传超时。同一个窗口中的包丢失只会调用一次
+    void (*onLoss)(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps, int timeout);
+};
+
+/// 默认的拥塞控制算法，即慢启动加AIMD
+LIBPOPKCEL_EXTERN extern const struct Popkcel_PsrCongestion popkcel_psrReno;
 
 /// return 0表示继续，非0表示不要继续
 typedef int (*Popkcel_PsrRecvCb)(struct Popkcel_PsrSocket *sock, intptr_t rv);
@@ -68,18 +191,35 @@ typedef int (*Popkcel_PsrFuncCallback)(struct Popkcel_PsrField *psr, intptr_t rv
 /// UDP Socket的PSRUDP协议（Popkc's Simple Reliable UDP）部分，可以把udp当成类似tcp来用，主要用于为内网IP之间提供连通能力和可靠传输
 struct Popkcel_PsrField
 {
+    /// 合并发送、延迟确认、重传、尾包探测、限速和空闲释放共用的timer，每个连接只有一个
     struct Popkcel_Timer timer;
     struct Popkcel_PsrSocket *sock;
-    /// rbtree 发送了但还没收到回复确认的数据
-    struct Popkcel_Rbtnode *nodePieceSend;
-    /// rbtree 接收了的数据，但之前一些序号的数据还没收到
-    struct Popkcel_Rbtnode *nodePieceReceive;
-    struct Popkcel_Rbtnode *nodeReply;
+    /** 按序号存放已发送但还没被确认的数据包，下标为序号 & sendRingMask，从sendBase到unsentId。
+     *  大小是不小于window + 1的2的幂，第一次发送数据时分配，连接空闲且没有未确认的包时释放
+     */
+    struct Popkcel_PsrPacket **sendRing;
+    /// 因为窗口已满而还没发送的包，序号从unsentId到mySendId，窗口打开后按顺序发送
+    struct Popkcel_PsrPacket *deferHead, *deferTail;
+    /// sendRing中的包按最后一次发送的先后串成的链表，快速重传只需要从头检查到sendSeq不比ackedSeq小的包
+    struct Popkcel_PsrPacket *sentHead, *sentTail;
+    /// 握手包，握手完成前由timer重传
+    struct Popkcel_PsrPacket *synPacket;
+    /** 接收了的数据，但之前一些序号的数据还没收到，包从PsrSocket的包池中分配。
+     *  流0的包要等前面的包到齐才交给用户，其它流的包到达时已经交给了用户，这里只记录序号，包为NULL
+     */
+    struct Popkcel_PsrReorder recvOrder;
+    /// 有序流，下标为流编号，第一次使用流时分配maxStreams个
+    struct Popkcel_PsrStream *streams;
+    /// 流0中正在重组的消息
+    struct Popkcel_PsrMessage message;
+    /// 需要回复确认的序号的位图，从ackBase到ackEnd，下标为序号 & ackMask。第一次收到数据时分配，连接空闲时释放
+    uint64_t *ackBits;
     /// 对方的IP、端口信息
     struct sockaddr_in6 remoteAddr;
-    char buffer[POPKCEL_MAXUDPSIZE];
+    /// 正在填充的数据包，从PsrSocket的包池中分配，bufferPos为0时为NULL。填满或超时后直接放进发送队列，不再复制
+    struct Popkcel_PsrPacket *bufferPacket;
     char *recvBuf;
-    /** 回调函数，rv传正值表示收到的字节数，此时recvBuf指向收到的数据。rv传负值表示对应的POPKCEL_CONNECTED、POPKCEL_ERROR等事件。
+    /** 回调函数，rv传正值表示收到的字节数，此时recvBuf指向收到的数据，recvStream为数据所属的流。rv传负值表示对应的POPKCEL_CONNECTED、POPKCEL_ERROR等事件。
      * 此函数返回非0值表示此psrField已删除，不要再进行后续操作。
      */
     Popkcel_PsrFuncCallback callback;
@@ -95,32 +235,174 @@ struct Popkcel_PsrField
     /// 对方当前的发送序号
     uint32_t oppositeSendId;
     uint32_t lastMyConfirmedSendId;
+    /// 最小的还没被确认的序号
+    uint32_t sendBase;
+    /// 第一个还没发送过的序号
+    uint32_t unsentId;
+    uint32_t sendRingMask;
+    uint32_t ackMask, ackBase, ackEnd;
+    /// ackBits中为1的位数
+    uint32_t ackCount;
+    /// timer的到期时间，为0表示没有启动
+    int64_t timerAt;
+    /// buffer中的数据和延迟的确认在这个时间发送，为0表示不需要
+    int64_t flushAt;
+    /// 到这个时间还没有别的事情要做，就释放空的sendRing、接收重排和确认位图，为0表示没有在计时
+    int64_t idleAt;
+    /// 尾包探测的时间，为0表示不需要探测
+    int64_t probeAt;
+    /// 令牌够发送延后的包的时间，为0表示没有在等待令牌
+    int64_t paceAt;
+    /// 令牌桶中的字节数和上次补充令牌的时间
+    int64_t paceTokens, paceTime;
     /// 防止传输被除中间方外的第三方伪造的id
     char tranId[4];
     char tranIdNew[4];
+    /// 平滑后的RTT，单位为微秒，hasRtt为0时无意义
+    uint32_t srtt;
+    /// RTT的平均偏差，单位为微秒
+    uint32_t rttVar;
+    /// 当前的重传超时，单位为毫秒。包每重传一次，它的超时就在此基础上加倍，但不超过maxRto
+    uint32_t rto;
+    /// 重传超时的下限和上限，单位为毫秒，可以在popkcel_initPsrField之后修改
+    uint32_t minRto, maxRto;
+    /// 一个包最多发送的次数，可以在popkcel_initPsrField之后修改
+    int maxSendCount;
+    /// 拥塞控制算法，用popkcel_psrSetCongestion修改
+    const struct Popkcel_PsrCongestion *congestion;
+    void *congestionData;
+    /// 拥塞窗口，单位为包
+    uint32_t cwnd;
+    /// 慢启动阈值
+    uint32_t ssthresh;
+    /// 拥塞避免阶段累计的确认数，满一个cwnd时cwnd加1
+    uint32_t cwndCount;
+    /// 已发送但还没被确认的包的数量
+    uint32_t inflight;
+    /// 最后一次通过SO_MAX_PACING_RATE设置的速率，单位为字节每秒
+    uint32_t kernelRate;
+    /// 此序号之前的包丢失不再触发onLoss
+    uint32_t recoverSendId;
+    /// 每发送一次（包括重传）加1
+    uint32_t sendSeq;
+    /// 已被确认的包中最大的sendSeq
+    uint32_t ackedSeq;
+    /// 最后一个第一次发送的包的序号
+    uint32_t lastSentId;
+    /// 快速重传阈值，为0表示不使用快速重传，可以在popkcel_initPsrField之后修改
+    uint32_t dupThresh;
+    /** 确认策略，可以在popkcel_initPsrField之后修改，ackEvery和ackDelay也会被对方的popkcel_psrSetPeerAckFrequency修改。
+     *  收到ackEvery个数据包后立即回复确认，为0表示不按包数；否则最多等待ackDelay毫秒，为0表示总是立即回复
+     */
+    uint16_t ackEvery, ackDelay;
+    /// 还没回复确认的数据包数
+    uint16_t ackRecvCount;
+    /// popkcel_psrTrySend缓存的不满一个包的数据最多等待这么多毫秒再发送，为0表示处理完本轮事件后就发送。可以在popkcel_initPsrField之后修改
+    uint16_t sendDelay;
+    /// 要通过popkcel_psrSetPeerAckFrequency发给对方的设置
+    uint16_t peerAckEvery, peerAckDelay;
+    /// 最后一次采用的对方的确认频率设置所在的数据包序号
+    uint32_t ackFreqId;
+    /// 消息模式下允许的最大消息长度，可以在popkcel_initPsrField之后修改
+    uint32_t maxMessage;
+    /// 令牌桶的容量，单位为包，可以在popkcel_initPsrField之后修改。桶至少能装下2毫秒的发送量
+    uint16_t pacingBurst;
     /// 此连接的窗口数
     uint16_t window;
+    /// 有序流的数量，双方应相同，最大为POPKCEL_PSRSTREAM_DATAGRAM。可以在popkcel_initPsrField之后、第一次使用流之前修改
+    uint16_t maxStreams;
+    /// 收到的数据所属的流，0为默认的流，还可能是POPKCEL_PSRSTREAM_UNORDERED和POPKCEL_PSRSTREAM_DATAGRAM
+    uint16_t recvStream;
+    /// buffer中的数据所属的流
+    uint16_t bufferStream;
     /// psrudp连接状态
     char state;
     char needSend;
-    char timerStarted;
     char synConfirm;
+    /// 是否已有RTT采样
+    char hasRtt;
+    /// 此连接使用的校验方式，Popkcel_PsrChecksum中的值
+    char checksumMode;
+    /// 双方协商出的协议版本
+    char version;
+    /// 是否启用尾包探测，默认为1
+    char tailProbe;
+    /// 收到不连续或重复的包时立即回复确认，默认为1
+    char ackOnGap;
+    char ackNow;
+    char peerAckPending;
+    /// 是否被popkcel_psrCork暂停了发送
+    char corked;
+    /** 新数据包的限速方式，Popkcel_PsrPacing中的值，默认为POPKCEL_PSRPACING_TIMER，可以在popkcel_initPsrField之后修改。
+     *  速率为cwnd / srtt，慢启动时乘以2，之后乘以1.25。srtt不到1毫秒时不限速，重传的包也不限速
+     */
+    char pacing;
+    /** 是否为消息模式，双方应相同，可以在popkcel_initPsrField之后、发送数据之前修改。
+     *  消息模式下每次popkcel_psrTrySend的数据是一个消息，对方的callback每次收到一个完整的消息。
+     *  放得下一个包的消息不会被拆开，recvBuf直接指向收到的包，不会复制；更长的消息由库重组
+     */
+    char messageMode;
+    /** 为1时popkcel_psrTryConnect推迟到本轮事件结束时才发送SYN，之前popkcel_psrTrySend的第一个包放在SYN中一起发出，对方可以在握手完成前收到。
+     *  需要对方的版本不低于4，对方不接受时这个包在握手完成后照常发送。SYN可能被重放，所以第一个包中只应放重复收到也没关系的数据。
+     *  默认为0，可以在popkcel_initPsrField之后、popkcel_psrTryConnect之前修改
+     */
+    char zeroRtt;
+    /// 为1表示发出的SYN中带了第一个包，为2表示接受了对方SYN中带的包，SYN|REPLY中要告诉对方
+    char earlyData;
 };
 
-#define POPKCEL_PSRSOCKETFIELD           \
-    char psrBuffer[POPKCEL_MAXUDPSIZE];  \
-    struct Popkcel_Timer timerKeepAlive; \
-    int64_t lastSendTime;                \
-    Popkcel_PsrListenCb listenCb;        \
-    Popkcel_PsrRecvCb recvCb;            \
-    struct sockaddr_in6 remoteAddr;      \
-    struct Popkcel_Rbtnode *nodePf;      \
-    void *userData;                      \
-    socklen_t remoteAddrLen;             \
-    char tranId[4];                      \
-    uint32_t recvLen;                    \
-    uint16_t maxWindow;                  \
-    uint16_t psrWindow;
+struct Popkcel_PsrSlot
+{
+    struct Popkcel_PsrField *psr;
+    uint32_t hash;
+};
+
+/// 按对方的地址和端口查找psrField的开放寻址哈希表。扩容时不会一次搬完，而是每次操作时搬一部分
+struct Popkcel_PsrTable
+{
+    struct Popkcel_PsrSlot *slots;
+    /// 扩容过程中的旧表，搬完后为NULL
+    struct Popkcel_PsrSlot *oldSlots;
+    /// 最近一次查找到的psrField，连续收到同一个对方的包时不需要查表
+    struct Popkcel_PsrField *last;
+    size_t mask, oldMask;
+    /// 旧表中下一个要搬的位置
+    size_t movePos;
+    /// 新表中的psrField数和删除标记数
+    size_t count, deleted;
+    uint32_t seed;
+};
+
+#define POPKCEL_PSRSOCKETFIELD              \
+    char psrBuffer[POPKCEL_MAXUDPSIZE];     \
+    struct Popkcel_Timer timerKeepAlive;    \
+    struct Popkcel_Timer timerBatch;        \
+    int64_t lastSendTime;                   \
+    Popkcel_PsrListenCb listenCb;           \
+    Popkcel_PsrRecvCb recvCb;               \
+    struct sockaddr_in6 remoteAddr;         \
+    struct Popkcel_PsrTable pfTable;        \
+    struct Popkcel_PsrPacket *freePackets;  \
+    void *packetSlabs;                      \
+    struct Popkcel_PsrSendEntry *sendBatch; \
+    struct Popkcel_PsrSendEntry *sendQueue; \
+    void *recvBatch;                        \
+    void *userData;                         \
+    uint64_t cookieKey[2];                  \
+    socklen_t remoteAddrLen;                \
+    char tranId[4];                         \
+    uint32_t recvLen;                       \
+    uint16_t maxWindow;                     \
+    uint16_t psrWindow;                     \
+    uint16_t sendBatchCount;                \
+    uint16_t recvBatchPos, recvBatchCount;  \
+    uint32_t sendQueueHead, sendQueueCount; \
+    uint32_t sendQueueMask;                 \
+    char checksumMode;                      \
+    char psrVersion;                        \
+    char psrBatch;                          \
+    char synCookies;                        \
+    char gsoOff;
 
 struct Popkcel_PsrSocket
 {
@@ -131,6 +413,11 @@ struct Popkcel_PsrSocket
 };
 
 /**
+ * 发送缓冲区满时，包按顺序排在sock->sendQueue中等待socket可写，不会再复制一次。
+ * sock->psrBatch为1时（默认值），Linux下本轮事件中所有连接要发送的包会在处理完本轮事件后用一次sendmmsg发出，发往同一个地址的连续的包用UDP_SEGMENT合并，接收时用recvmmsg一次读取多个包。
+ * sock->synCookies为1时，收到新地址的SYN不调用listenCb，而是回复一个由地址、tranId、时间和cookieKey算出的cookie，对方带着cookie回复SYN|CONFIRM后才创建连接，
+ * 这样伪造源地址的SYN不会占用内存。会让建立连接多一个来回，默认为0。旧版本的客户端也能完成这个握手。
+ * sock->checksumMode是发起和接受连接时最高使用的校验方式，默认为POPKCEL_PSRCHECKSUM_CRC32C，需要连接旧版本的服务器时，应在连接前改为POPKCEL_PSRCHECKSUM_XOR，此时握手中的版本号为0。
  * @param maxWindow 最大允许的不连续的包的数量.网络传输过程中可能会掉包,导致包的到达顺序不同,maxWindow就是这些非连续的包所允许的最大数量,超过这个数量的话,新包将被丢弃,直到缺失的包传到为止.
  */
 LIBPOPKCEL_EXTERN int popkcel_initPsrSocket(struct Popkcel_PsrSocket *sock, struct Popkcel_Loop *loop, Popkcel_HandleType fd, char ipv6, uint16_t port, Popkcel_PsrListenCb listenCb, Popkcel_PsrRecvCb recvCb, uint16_t maxWindow);
@@ -141,20 +428,94 @@ LIBPOPKCEL_EXTERN void popkcel_initPsrField(struct Popkcel_PsrSocket *sock, stru
 
 LIBPOPKCEL_EXTERN void popkcel_destroyPsrField(struct Popkcel_PsrField *psr);
 
+/// 发起连接。连接建立前psrTrySend的数据（只能是流0）会先缓存起来，返回POPKCEL_WOULDBLOCK，连接建立后按顺序发出
 LIBPOPKCEL_EXTERN int popkcel_psrTryConnect(struct Popkcel_PsrField *psr);
 
 LIBPOPKCEL_EXTERN int popkcel_psrTrySend(struct Popkcel_PsrField *psr, const char *data, size_t len, Popkcel_FuncCallback callback, void *userData);
 
+/** 在流stream中发送数据，stream为0时与popkcel_psrTrySend相同。消息模式下，POPKCEL_PSRSTREAM_UNORDERED中的消息不能超过一个包。
+ *  流0按连接的序号交给对方，前面任何一个包丢失都会阻塞它；1到maxStreams - 1的流各自有序，互不阻塞；
+ *  POPKCEL_PSRSTREAM_UNORDERED可靠但不保证顺序。除流0外都需要双方协商的版本不低于3，否则返回POPKCEL_ERROR
+ */
+LIBPOPKCEL_EXTERN int popkcel_psrTrySendStream(struct Popkcel_PsrField *psr, uint16_t stream, const char *data, size_t len, Popkcel_FuncCallback callback, void *userData);
+
+/// 立即发送一个不可靠的数据报，不重传也不保证顺序，对方收到时recvStream为POPKCEL_PSRSTREAM_DATAGRAM。len最大为POPKCEL_MAXUDPSIZE - 7，需要双方协商的版本不低于3
+LIBPOPKCEL_EXTERN int popkcel_psrSendDatagram(struct Popkcel_PsrField *psr, const char *data, size_t len);
+
 /// 函数中会调用initPsrField，accept完之后如果要删除需要自行调用destroyPsrField
 LIBPOPKCEL_EXTERN void popkcel_psrAcceptOne(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrField *psr, Popkcel_PsrFuncCallback cbFunc);
 
-/// @brief psr默认情况下会对要发送的数据进行缓存，等过了一个很短的时间后再把数据发出去，这和TCP协议是类似的。如果你希望不要缓存，要立即把数据发出去，那么就调用这个函数。
+/// @brief psr默认情况下会对要发送的数据进行缓存，等过了一个很短的时间（psr->sendDelay）后再把数据发出去，这和TCP协议是类似的。如果你希望不要缓存，要立即把数据发出去，那么就调用这个函数。
 /// @param psr 要立即发送的psrField。
 /// @return 返回正整数表示成功发送的字节数，返回POPKCEL_ERROR表示出错，返回POPKCEL_WOULDBLOCK表示该操作需要异步等待。
 LIBPOPKCEL_EXTERN int popkcel_psrSendCache(struct Popkcel_PsrField *psr);
 
+/// 暂停发送不满一个包的数据，之后多次popkcel_psrTrySend的数据会合并在一起，直到popkcel_psrUncork。满一个包的数据和确认仍会正常发送
+LIBPOPKCEL_EXTERN void popkcel_psrCork(struct Popkcel_PsrField *psr);
+
+/// 取消popkcel_psrCork，并立即发送缓存的数据。返回POPKCEL_ERROR表示psr已出错
+LIBPOPKCEL_EXTERN int popkcel_psrUncork(struct Popkcel_PsrField *psr);
+
+/// 要求对方收到ackEvery个数据包后立即回复确认，最多延迟ackDelay毫秒。设置随下一个数据包发送，双方协商的版本低于2时返回POPKCEL_ERROR
+LIBPOPKCEL_EXTERN int popkcel_psrSetPeerAckFrequency(struct Popkcel_PsrField *psr, uint16_t ackEvery, uint16_t ackDelay);
+
+/// 更换psr的拥塞控制算法，cc为NULL时使用popkcel_psrReno。应在连接建立前调用
+LIBPOPKCEL_EXTERN void popkcel_psrSetCongestion(struct Popkcel_PsrField *psr, const struct Popkcel_PsrCongestion *cc);
+
+#ifndef POPKCEL_SINGLETHREAD
+/// 发给某个分片的消息
+struct Popkcel_PsrShardMsg
+{
+    struct Popkcel_PsrShardMsg *next;
+    Popkcel_FuncCallback cb;
+    void *data;
+    struct sockaddr_in6 addr;
+};
+
+/// 分片服务器中的一个分片，运行在LoopPool中的一个Loop上
+struct Popkcel_PsrShard
+{
+    struct Popkcel_PsrSocket sock;
+    /// 有消息时唤醒分片所在的Loop
+    struct Popkcel_Notifier notifier;
+    /// 保护消息队列
+    pthread_mutex_t mutex;
+    struct Popkcel_PsrShardMsg *head, *tail;
+};
+
+/** 分片的PSR服务器。LoopPool中的每个Loop一个用SO_REUSEPORT绑定同一端口的PsrSocket，各自有自己的连接表。
+ *  内核按对方地址选择分片，算法与popkcel_psrShardOf相同，所以主动发起的连接也要在popkcel_psrShardOf返回的分片中创建
+ */
+struct Popkcel_PsrShards
+{
+    struct Popkcel_PsrShard *shards;
+    /// 分片的数量，等于loopPool->loopSize
+    size_t count;
+};
+
+/// 只支持Linux，且只能在LoopPool运行之前调用。listenCb和recvCb在各个分片的Loop中调用
+LIBPOPKCEL_EXTERN int popkcel_initPsrShards(struct Popkcel_PsrShards *shards, struct Popkcel_LoopPool *loopPool, char ipv6, uint16_t port, Popkcel_PsrListenCb listenCb, Popkcel_PsrRecvCb recvCb, uint16_t maxWindow);
+
+/// 在所有Loop都停止后调用
+LIBPOPKCEL_EXTERN void popkcel_destroyPsrShards(struct Popkcel_PsrShards *shards);
+
+/// 对方地址为addr的连接所在的分片的下标
+LIBPOPKCEL_EXTERN size_t popkcel_psrShardOf(struct Popkcel_PsrShards *shards, const struct sockaddr *addr);
+
+/** 可以在任何线程中调用。cb会在addr所在的分片的Loop中调用，第二个参数为该分片中对方地址为addr的psrField，没有时为0。
+ *  返回POPKCEL_ERROR表示唤醒Loop失败
+ */
+LIBPOPKCEL_EXTERN int popkcel_psrShardPost(struct Popkcel_PsrShards *shards, const struct sockaddr *addr, Popkcel_FuncCallback cb, void *data);
+#endif
+
+/// 用SO_MAX_PACING_RATE限制sock的发送速率，单位为字节每秒，UINT32_MAX表示不限制。系统不支持时返回POPKCEL_ERROR
+LIBPOPKCEL_EXTERN int popkcel_psrSetMaxPacingRate(struct Popkcel_PsrSocket *sock, uint32_t bytesPerSecond);
+
 LIBPOPKCEL_EXTERN struct Popkcel_PsrField *popkcel_psrFind(struct Popkcel_PsrSocket *sock, struct sockaddr *addr);
 
+/// 内部使用，供测试比较CRC32C的实现。soft为1时用软件实现，否则用运行时选择的实现，crc为之前的结果，第一次为0xffffffff，最后要取反
+LIBPOPKCEL_EXTERN uint32_t popkcel__psrCrc32c(char soft, uint32_t crc, const char *buf, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
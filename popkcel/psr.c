@@ -6,6 +6,10 @@ The above copyright notice and this permission notice shall be included in all c
 
 THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// sendmmsg和recvmmsg
+#    define _GNU_SOURCE
+#endif
 #include "popkcel.h"
 #include "popkcel_private.h"
 #include "popkcelpsr.h"
@@ -15,25 +19,536 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#    include <errno.h>
+#endif
+
+#ifdef __linux__
+#    include <linux/filter.h>
+#    include <netinet/udp.h>
+#    include <sys/uio.h>
+#    include <unistd.h>
+#    define POPKCEL_PSRMMSG
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    include <nmmintrin.h>
+#    define POPKCEL_CRCSSE42 __attribute__((target("sse4.2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#    include <intrin.h>
+#    include <nmmintrin.h>
+#    define POPKCEL_CRCSSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#    include <arm_acle.h>
+#endif
+
+// CRC32C（Castagnoli），软件实现用slicing-by-8，CPU支持时用SSE4.2或ARMv8的crc32c指令
+static uint32_t crcTable[8][256];
+static uint32_t (*crc32cFunc)(uint32_t crc, const char *buf, size_t len);
+#ifndef POPKCEL_SINGLETHREAD
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static uint32_t crc32cSoft(uint32_t crc, const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    while (len >= 8) {
+        uint32_t a, b;
+        memcpy(&a, p, 4);
+        memcpy(&b, p + 4, 4);
+        a = le32toh(a) ^ crc;
+        b = le32toh(b);
+        crc = crcTable[7][a & 0xff] ^ crcTable[6][(a >> 8) & 0xff] ^ crcTable[5][(a >> 16) & 0xff] ^ crcTable[4][a >> 24]
+            ^ crcTable[3][b & 0xff] ^ crcTable[2][(b >> 8) & 0xff] ^ crcTable[1][(b >> 16) & 0xff] ^ crcTable[0][b >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef POPKCEL_CRCSSE42
+static POPKCEL_CRCSSE42 uint32_t crc32cSse42(uint32_t crc, const char *buf, size_t len)
+{
+#    if defined(__x86_64__) || defined(_M_X64)
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        c = _mm_crc32_u64(c, v);
+        buf += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#    endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, buf, 4);
+        crc = _mm_crc32_u32(crc, v);
+        buf += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, (unsigned char)*buf++);
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cArm(uint32_t crc, const char *buf, size_t len)
+{
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        crc = __crc32cd(crc, le64toh(v));
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, (unsigned char)*buf++);
+    return crc;
+}
+#endif
+
+static void crcInit(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crcTable[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++)
+            crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xff];
+    }
+
+    crc32cFunc = &crc32cSoft;
+#if defined(POPKCEL_CRCSSE42) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cFunc = &crc32cSse42;
+#elif defined(POPKCEL_CRCSSE42)
+    int info[4];
+    __cpuid(info, 1);
+    if (info[2] & (1 << 20))
+        crc32cFunc = &crc32cSse42;
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32cFunc = &crc32cArm;
+#endif
+}
+
+static void crcInitOnce(void)
+{
+#ifdef POPKCEL_SINGLETHREAD
+    if (!crc32cFunc)
+        crcInit();
+#else
+    pthread_once(&crcOnce, &crcInit);
+#endif
+}
+
+static int rpsSend(struct Popkcel_PsrPacket *rps);
+static int psrFlush(struct Popkcel_PsrField *psr);
+
+// 保证timer在t之前到期。有事情要做说明连接不空闲，重新开始空闲计时
+static void psrArmTimer(struct Popkcel_PsrField *psr, int64_t t)
+{
+    psr->idleAt = 0;
+    if (psr->timerAt && psr->timerAt <= t)
+        return;
+    psr->timerAt = t;
+    int64_t d = t - popkcel_getCurrentTime();
+    popkcel_setTimer(&psr->timer, d > 0 ? (unsigned int)d : 0, 0);
+}
+
+// 保证buffer和确认在delay毫秒内发送，delay为0时在处理完本轮事件后发送
+static void psrArmFlush(struct Popkcel_PsrField *psr, unsigned int delay)
+{
+    int64_t t = popkcel_getCurrentTime() + delay;
+    if (!psr->flushAt || psr->flushAt > t) {
+        psr->flushAt = t;
+        psrArmTimer(psr, t);
+    }
+}
+
+// 每次分配的包的数量
+#define PSRSLABSIZE 32
+
+struct PsrSlab
+{
+    struct PsrSlab *next;
+    struct Popkcel_PsrPacket packets[PSRSLABSIZE];
+};
+
+// 包池中的包只在destroyPsrSocket时才释放
+static struct Popkcel_PsrPacket *psrPacketAlloc(struct Popkcel_PsrSocket *sock)
+{
+    struct Popkcel_PsrPacket *rps = sock->freePackets;
+    if (!rps) {
+        struct PsrSlab *slab = malloc(sizeof(struct PsrSlab));
+        slab->next = sock->packetSlabs;
+        sock->packetSlabs = slab;
+        for (int i = PSRSLABSIZE - 1; i > 0; i--) {
+            slab->packets[i].next = sock->freePackets;
+            sock->freePackets = &slab->packets[i];
+        }
+        rps = &slab->packets[0];
+    }
+    else
+        sock->freePackets = rps->next;
+    rps->sock = sock;
+    rps->pending = 0;
+    rps->sentPrev = rps->sentNext = NULL;
+    return rps;
+}
+
+static void psrPacketFree(struct Popkcel_PsrPacket *rps)
+{
+    rps->next = rps->sock->freePackets;
+    rps->sock->freePackets = rps;
+}
+
+// 不再需要rps，正在等待发送的话发送后再归还
+static void psrPacketRelease(struct Popkcel_PsrPacket *rps)
+{
+    if (rps->pending == 0)
+        psrPacketFree(rps);
+    else
+        rps->pending = 2;
+}
+
+#ifdef POPKCEL_PSRMMSG
+struct PsrRecvBatch
+{
+    struct mmsghdr msgs[POPKCEL_PSRBATCH];
+    struct iovec iovs[POPKCEL_PSRBATCH];
+    struct sockaddr_in6 addrs[POPKCEL_PSRBATCH];
+    char bufs[POPKCEL_PSRBATCH][POPKCEL_MAXUDPSIZE];
+};
+
+static void psrQueuePush(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrSendEntry *e);
+
+/** 用sendmmsg发送sock->sendBatch中的包，发往同一地址的连续的包用UDP_SEGMENT合并成一个。
+ *  发送缓冲区满时剩下的包放进sock->sendQueue等待socket可写，出错的包当作丢失，由重传处理
+ */
+static void psrBatchFlush(struct Popkcel_PsrSocket *sock)
+{
+    struct Popkcel_PsrSendEntry *es = sock->sendBatch;
+    struct mmsghdr msgs[POPKCEL_PSRBATCH];
+    struct iovec iovs[POPKCEL_PSRBATCH];
+    char ctrl[POPKCEL_PSRBATCH][CMSG_SPACE(sizeof(uint16_t))];
+    // 每个msg中的第一个包
+    uint32_t first[POPKCEL_PSRBATCH + 1];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < sock->sendBatchCount; i++) {
+        // 排队时就被确认了的包不用再发
+        if (es[i].rps->pending == 2)
+            psrPacketFree(es[i].rps);
+        else
+            es[n++] = es[i];
+    }
+    sock->sendBatchCount = 0;
+
+    uint32_t done = 0;
+    // 已经有包在等待socket可写时，直接排在它们后面
+    while (done < n && !sock->sendQueueCount) {
+        uint32_t k = 0;
+        for (uint32_t i = done; i < n; k++) {
+            uint32_t j = i + 1;
+            size_t seg = es[i].rps->bufLen;
+#    ifdef UDP_SEGMENT
+            size_t total = seg;
+            // 除最后一段外每段都要是seg长，总长不能超过一个UDP包
+            while (!sock->gsoOff && j < n && j - i < 64 && es[j].addrLen == es[i].addrLen && !memcmp(&es[j].addr, &es[i].addr, es[i].addrLen)
+                && es[j].rps->bufLen <= seg && total + es[j].rps->bufLen <= 65000) {
+                total += es[j].rps->bufLen;
+                j++;
+                if (es[j - 1].rps->bufLen < seg)
+                    break;
+            }
+#    endif
+            struct msghdr *h = &msgs[k].msg_hdr;
+            memset(h, 0, sizeof(*h));
+            h->msg_name = &es[i].addr;
+            h->msg_namelen = es[i].addrLen;
+            for (uint32_t l = i; l < j; l++) {
+                iovs[l].iov_base = es[l].rps->buffer;
+                iovs[l].iov_len = es[l].rps->bufLen;
+            }
+            h->msg_iov = &iovs[i];
+            h->msg_iovlen = j - i;
+#    ifdef UDP_SEGMENT
+            if (j - i > 1) {
+                h->msg_control = ctrl[k];
+                h->msg_controllen = sizeof(ctrl[k]);
+                struct cmsghdr *c = CMSG_FIRSTHDR(h);
+                c->cmsg_level = SOL_UDP;
+                c->cmsg_type = UDP_SEGMENT;
+                c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t us = (uint16_t)seg;
+                memcpy(CMSG_DATA(c), &us, sizeof(us));
+            }
+#    endif
+            first[k] = i;
+            i = j;
+        }
+        first[k] = n;
+        int r = sendmmsg(sock->fd, msgs, k, 0);
+        if (r > 0)
+            done = first[r];
+        else if (r < 0 && errno == EINTR)
+            continue;
+        else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && !sock->gsoOff && msgs[0].msg_hdr.msg_iovlen > 1)
+            sock->gsoOff = 1; // 网卡或内核不支持UDP_SEGMENT
+        else
+            break;
+    }
+
+    sock->lastSendTime = popkcel_getCurrentTime();
+    for (uint32_t i = 0; i < n; i++) {
+        struct Popkcel_PsrPacket *rps = es[i].rps;
+        if (i >= done)
+            psrQueuePush(sock, &es[i]);
+        else if (!rps->psr || rps->pending == 2)
+            psrPacketFree(rps);
+        else
+            rps->pending = 0;
+    }
+}
+
+static int psrBatchTimerCb(void *data, intptr_t rv)
+{
+    psrBatchFlush(data);
+    return 1;
+}
+
+// 从recvmmsg读到的包中取出下一个放进psrBuffer，没有时返回POPKCEL_WOULDBLOCK
+static ssize_t psrBatchRecv(struct Popkcel_PsrSocket *sock)
+{
+    struct PsrRecvBatch *rb = sock->recvBatch;
+    if (!rb) {
+        rb = sock->recvBatch = malloc(sizeof(struct PsrRecvBatch));
+        for (int i = 0; i < POPKCEL_PSRBATCH; i++) {
+            rb->iovs[i].iov_base = rb->bufs[i];
+            rb->iovs[i].iov_len = POPKCEL_MAXUDPSIZE;
+            memset(&rb->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            rb->msgs[i].msg_hdr.msg_name = &rb->addrs[i];
+            rb->msgs[i].msg_hdr.msg_iov = &rb->iovs[i];
+            rb->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+    if (sock->recvBatchPos >= sock->recvBatchCount) {
+        for (int i = 0; i < POPKCEL_PSRBATCH; i++)
+            rb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        int r = recvmmsg(sock->fd, rb->msgs, POPKCEL_PSRBATCH, MSG_DONTWAIT, NULL);
+        if (r <= 0)
+            return POPKCEL_WOULDBLOCK;
+        sock->recvBatchCount = (uint16_t)r;
+        sock->recvBatchPos = 0;
+    }
+    struct mmsghdr *m = &rb->msgs[sock->recvBatchPos];
+    memcpy(sock->psrBuffer, rb->bufs[sock->recvBatchPos], m->msg_len);
+    memcpy(&sock->remoteAddr, &rb->addrs[sock->recvBatchPos], m->msg_hdr.msg_namelen);
+    sock->remoteAddrLen = m->msg_hdr.msg_namelen;
+    sock->recvBatchPos++;
+    return (ssize_t)m->msg_len;
+}
+#endif
+
+// 批量发送时把rps放进sock的队列，本轮事件处理完后再发送，返回0表示需要立即发送
+static int psrBatchPush(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrPacket *rps, const struct sockaddr *addr, socklen_t addrLen)
+{
+#ifdef POPKCEL_PSRMMSG
+    if (!sock->psrBatch)
+        return 0;
+    if (!sock->sendBatch)
+        sock->sendBatch = malloc(POPKCEL_PSRBATCH * sizeof(struct Popkcel_PsrSendEntry));
+    else if (sock->sendBatchCount == POPKCEL_PSRBATCH)
+        psrBatchFlush(sock);
+    struct Popkcel_PsrSendEntry *e = &sock->sendBatch[sock->sendBatchCount++];
+    e->rps = rps;
+    memcpy(&e->addr, addr, addrLen);
+    e->addrLen = addrLen;
+    // 发出之前包不能被释放
+    rps->pending = 1;
+    if (sock->sendBatchCount == 1)
+        popkcel_setTimer(&sock->timerBatch, 0, 0);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifndef _WIN32
+static int psrOutRedo(void *data, intptr_t ev);
+
+// 把e放进sock->sendQueue，包保持在等待发送的状态，socket可写时由psrOutRedo按顺序发送
+static void psrQueuePush(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrSendEntry *e)
+{
+    if (sock->sendQueueCount == (sock->sendQueue ? sock->sendQueueMask + 1 : 0)) {
+        uint32_t size = sock->sendQueue ? 2 * (sock->sendQueueMask + 1) : 64;
+        struct Popkcel_PsrSendEntry *q = malloc(size * sizeof(struct Popkcel_PsrSendEntry));
+        for (uint32_t i = 0; i < sock->sendQueueCount; i++)
+            q[i] = sock->sendQueue[(sock->sendQueueHead + i) & sock->sendQueueMask];
+        free(sock->sendQueue);
+        sock->sendQueue = q;
+        sock->sendQueueHead = 0;
+        sock->sendQueueMask = size - 1;
+    }
+    sock->sendQueue[(sock->sendQueueHead + sock->sendQueueCount) & sock->sendQueueMask] = *e;
+    sock->sendQueueCount++;
+    e->rps->pending = 1;
+    if (!sock->so.outRedo) {
+        sock->so.outRedo = &psrOutRedo;
+        sock->so.outRedoData = sock;
+    }
+}
+
+// socket可写时发送sendQueue中的包，出错的包当作丢失，由重传处理
+static int psrOutRedo(void *data, intptr_t ev)
+{
+    (void)ev;
+    struct Popkcel_PsrSocket *sock = data;
+    sock->so.outRedo = NULL;
+    while (sock->sendQueueCount) {
+        struct Popkcel_PsrSendEntry *e = &sock->sendQueue[sock->sendQueueHead];
+        struct Popkcel_PsrPacket *rps = e->rps;
+        if (rps->pending != 2) {
+            ssize_t r = sendto(sock->fd, rps->buffer, rps->bufLen, 0, (struct sockaddr *)&e->addr, e->addrLen);
+            if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                sock->so.outRedo = &psrOutRedo;
+                sock->so.outRedoData = sock;
+                break;
+            }
+        }
+        sock->sendQueueHead = (sock->sendQueueHead + 1) & sock->sendQueueMask;
+        sock->sendQueueCount--;
+        if (!rps->psr || rps->pending == 2)
+            psrPacketFree(rps);
+        else
+            rps->pending = 0;
+    }
+    sock->lastSendTime = popkcel_getCurrentTime();
+    return 0;
+}
+#endif
+
+/** 发送rps，不复制。批量发送时放进sock->sendBatch，发送缓冲区满时放进sock->sendQueue，之后再发送。
+ *  rps->psr为NULL时发送后还回包池。返回POPKCEL_ERROR表示出错，此时包还没有被归还
+ */
+static int psrSockSend(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrPacket *rps, const struct sockaddr *addr, socklen_t addrLen)
+{
+    if (psrBatchPush(sock, rps, addr, addrLen))
+        return POPKCEL_OK;
+#ifndef _WIN32
+    if (!sock->sendQueueCount) {
+        ssize_t r = sendto(sock->fd, rps->buffer, rps->bufLen, 0, addr, addrLen);
+        if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return POPKCEL_ERROR;
+        if (r != -1) {
+            if (!rps->psr)
+                psrPacketFree(rps);
+            return POPKCEL_OK;
+        }
+    }
+    struct Popkcel_PsrSendEntry e;
+    e.rps = rps;
+    memcpy(&e.addr, addr, addrLen);
+    e.addrLen = addrLen;
+    psrQueuePush(sock, &e);
+    return POPKCEL_OK;
+#else
+    // IOCP下由popkcel_trySendto复制下来等待发送
+    ssize_t r = popkcel_trySendto((struct Popkcel_Socket *)sock, rps->buffer, rps->bufLen, (struct sockaddr *)addr, addrLen, NULL, NULL);
+    if (r == POPKCEL_ERROR)
+        return POPKCEL_ERROR;
+    if (!rps->psr)
+        psrPacketFree(rps);
+    return POPKCEL_OK;
+#endif
+}
 
-static int sendCb(void *data, intptr_t rv);
-static int rpsSend(struct Popkcel_RbtnodePsrSend *rps);
-static int psrTimerCb(void *data, intptr_t rv);
+// 发送不需要重传的包，如确认、握手回复和数据报，发送后rps还回包池
+static int psrSendOnce(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    rps->psr = NULL;
+    int r = psrSockSend(psr->sock, rps, (struct sockaddr *)&psr->remoteAddr, psr->addrLen);
+    if (r == POPKCEL_ERROR)
+        psrPacketFree(rps);
+    psr->sock->lastSendTime = popkcel_getCurrentTime();
+    return r;
+}
 
-static int rpsInit(struct Popkcel_RbtnodePsrSend *rps, struct Popkcel_PsrField *psr)
+// 序号为id的包，不在sendRing中时返回NULL
+static struct Popkcel_PsrPacket *psrPacketAt(struct Popkcel_PsrField *psr, uint32_t id)
+{
+    uint32_t d = id - psr->sendBase;
+    if (d >= psr->unsentId - psr->sendBase)
+        return NULL;
+    return psr->sendRing[id & psr->sendRingMask];
+}
+
+// sendRing中从sendBase开始的位置数
+static uint32_t psrRingCount(struct Popkcel_PsrField *psr)
+{
+    return psr->unsentId - psr->sendBase;
+}
+
+// 把要第一次发送的包放入sendRing
+static void psrRingPut(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    if (!psr->sendRing) {
+        uint32_t size = 4;
+        while (size < (uint32_t)psr->window + 1)
+            size *= 2;
+        psr->sendRing = calloc(size, sizeof(struct Popkcel_PsrPacket *));
+        psr->sendRingMask = size - 1;
+    }
+    assert(rps->id == psr->unsentId);
+    psr->sendRing[rps->id & psr->sendRingMask] = rps;
+    psr->unsentId++;
+}
+
+static void psrDeferPush(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    rps->sendCount = -1;
+    rps->next = NULL;
+    if (psr->deferTail)
+        psr->deferTail->next = rps;
+    else
+        psr->deferHead = rps;
+    psr->deferTail = rps;
+}
+
+// 跳过sendRing开头已确认的位置
+static void psrRingAdvance(struct Popkcel_PsrField *psr)
+{
+    while (psr->sendBase != psr->unsentId && !psr->sendRing[psr->sendBase & psr->sendRingMask])
+        psr->sendBase++;
+}
+
+// 包的重传超时，每重传一次加倍
+static unsigned int rpsTimeout(struct Popkcel_PsrPacket *rps)
+{
+    uint32_t t = rps->psr->rto;
+    for (int i = 1; i < rps->sendCount && t < rps->psr->maxRto; i++)
+        t *= 2;
+    if (t > rps->psr->maxRto)
+        t = rps->psr->maxRto;
+    return t;
+}
+
+// 发送握手包，握手完成前由timer重传
+static int psrSendSyn(struct Popkcel_PsrPacket *rps, struct Popkcel_PsrField *psr)
 {
     rps->sendCount = 0;
     rps->psr = psr;
     rps->callback = NULL;
-    popkcel_initTimer(&rps->timer, psr->sock->loop);
-    rps->timer.funcCb = &psrTimerCb;
-    rps->timer.cbData = rps;
+    rps->id = 0;
     int r = rpsSend(rps);
     if (r == POPKCEL_ERROR)
         return POPKCEL_ERROR;
-    else if (r >= 0)
-        popkcel_setTimer(&rps->timer, 5000, 5000);
-    popkcel_rbtMultiInsert(&psr->nodePieceSend, (struct Popkcel_Rbtnode *)rps);
+    psr->synPacket = rps;
     return r;
 }
 
@@ -45,45 +560,342 @@ static void psrError(struct Popkcel_PsrField *psr)
     }
 }
 
+// 按RFC 6298的方法更新srtt、rttVar和rto。根据Karn算法，只有只发送过一次的包才能用来采样
+static void psrRttSample(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    if (rps->sendCount != 1)
+        return;
+    int64_t d = popkcel_getCurrentTime() - rps->sendTime;
+    uint32_t sample = d > 0 ? (uint32_t)d * 1000 : 0;
+    if (!psr->hasRtt) {
+        psr->srtt = sample;
+        psr->rttVar = sample / 2;
+        psr->hasRtt = 1;
+    }
+    else {
+        uint32_t diff = psr->srtt > sample ? psr->srtt - sample : sample - psr->srtt;
+        psr->rttVar = (3 * psr->rttVar + diff) / 4;
+        psr->srtt = (7 * psr->srtt + sample) / 8;
+    }
+    // 时钟的精度是1毫秒，所以偏差项至少取1毫秒
+    uint32_t v = 4 * psr->rttVar;
+    if (v < 1000)
+        v = 1000;
+    uint32_t rto = (psr->srtt + v + 999) / 1000;
+    if (rto < psr->minRto)
+        rto = psr->minRto;
+    else if (rto > psr->maxRto)
+        rto = psr->maxRto;
+    psr->rto = rto;
+}
+
+static void renoInit(struct Popkcel_PsrField *psr)
+{
+    psr->cwnd = POPKCEL_PSRINITCWND;
+    psr->ssthresh = UINT32_MAX;
+    psr->cwndCount = 0;
+}
+
+static void renoOnAck(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    if (psr->cwnd >= psr->window)
+        return;
+    if (psr->cwnd < psr->ssthresh)
+        psr->cwnd++;
+    else if (++psr->cwndCount >= psr->cwnd) {
+        psr->cwndCount = 0;
+        psr->cwnd++;
+    }
+}
+
+static void renoOnLoss(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps, int timeout)
+{
+    uint32_t half = psr->inflight / 2;
+    if (half < 2)
+        half = 2;
+    psr->ssthresh = half;
+    psr->cwnd = timeout ? 1 : half;
+    psr->cwndCount = 0;
+}
+
+const struct Popkcel_PsrCongestion popkcel_psrReno = { &renoInit, NULL, &renoOnAck, &renoOnLoss };
+
+// 从发送顺序链表中移除，不在链表中时什么也不做
+static void psrSentUnlink(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    if (rps->sentPrev)
+        rps->sentPrev->sentNext = rps->sentNext;
+    else if (psr->sentHead == rps)
+        psr->sentHead = rps->sentNext;
+    else
+        return;
+    if (rps->sentNext)
+        rps->sentNext->sentPrev = rps->sentPrev;
+    else
+        psr->sentTail = rps->sentPrev;
+    rps->sentPrev = rps->sentNext = NULL;
+}
+
+// 包已被对方确认
+static void psrAcked(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    if ((int32_t)(rps->id - psr->lastMyConfirmedSendId) > 0)
+        psr->lastMyConfirmedSendId = rps->id;
+    psrRttSample(psr, rps);
+    if (rps->sendCount != -1) {
+        if (psr->inflight)
+            psr->inflight--;
+        if ((int32_t)(rps->sendSeq - psr->ackedSeq) > 0)
+            psr->ackedSeq = rps->sendSeq;
+        psr->congestion->onAck(psr, rps);
+    }
+    psrSentUnlink(psr, rps);
+    psr->sendRing[rps->id & psr->sendRingMask] = NULL;
+    if (rps->id == psr->sendBase)
+        psrRingAdvance(psr);
+    psrPacketRelease(rps);
+}
+
+static struct Popkcel_PsrPacket *psrPacketCopy(struct Popkcel_PsrSocket *sock, const char *buf, uint16_t len)
+{
+    struct Popkcel_PsrPacket *rp = psrPacketAlloc(sock);
+    rp->bufLen = len;
+    memcpy(rp->buffer, buf, len);
+    return rp;
+}
+
+// 记录序号为id的包，调用前要先用reorderHas确认没有记录
+static void reorderPut(struct Popkcel_PsrField *psr, struct Popkcel_PsrReorder *ro, uint32_t id, struct Popkcel_PsrPacket *rp)
+{
+    if (!ro->ring) {
+        uint32_t size = 64;
+        while (size < (uint32_t)psr->window + 1)
+            size *= 2;
+        ro->ring = malloc(size * sizeof(struct Popkcel_PsrPacket *));
+        ro->bits = calloc(size / 64, sizeof(uint64_t));
+        ro->mask = size - 1;
+    }
+    uint32_t i = id & ro->mask;
+    ro->ring[i] = rp;
+    ro->bits[i >> 6] |= (uint64_t)1 << (i & 63);
+    ro->count++;
+}
+
+static int reorderHas(struct Popkcel_PsrReorder *ro, uint32_t id)
+{
+    uint32_t i = id & ro->mask;
+    return ro->count && (ro->bits[i >> 6] & ((uint64_t)1 << (i & 63)));
+}
+
+// 取出序号为id的记录，没有时返回0
+static int reorderTake(struct Popkcel_PsrReorder *ro, uint32_t id, struct Popkcel_PsrPacket **rp)
+{
+    if (!reorderHas(ro, id))
+        return 0;
+    uint32_t i = id & ro->mask;
+    ro->bits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    ro->count--;
+    *rp = ro->ring[i];
+    return 1;
+}
+
+static void reorderFree(struct Popkcel_PsrReorder *ro)
+{
+    for (uint32_t i = 0; ro->count && i <= ro->mask; i++) {
+        if (ro->bits[i >> 6] & ((uint64_t)1 << (i & 63))) {
+            if (ro->ring[i])
+                psrPacketFree(ro->ring[i]);
+            ro->count--;
+        }
+    }
+    free(ro->ring);
+    free(ro->bits);
+    ro->ring = NULL;
+    ro->bits = NULL;
+    ro->mask = 0;
+}
+
+// 取得编号为stream的有序流，编号不合法时返回NULL
+static struct Popkcel_PsrStream *psrGetStream(struct Popkcel_PsrField *psr, uint16_t stream)
+{
+    if (stream == 0 || stream >= psr->maxStreams || stream >= POPKCEL_PSRSTREAM_DATAGRAM)
+        return NULL;
+    if (!psr->streams)
+        psr->streams = calloc(psr->maxStreams, sizeof(struct Popkcel_PsrStream));
+    return &psr->streams[stream];
+}
+
+// 按cwnd和srtt算出的发送速率，单位为字节每毫秒，为0表示不限速
+static uint32_t psrPacingRate(struct Popkcel_PsrField *psr)
+{
+    uint32_t srtt = psr->srtt / 1000;
+    if (!psr->hasRtt || !srtt)
+        return 0;
+    uint64_t rate = (uint64_t)psr->cwnd * POPKCEL_MAXUDPSIZE / srtt;
+    // 比cwnd / srtt稍快，让cwnd能继续增长
+    rate = psr->cwnd < psr->ssthresh ? rate * 2 : rate * 5 / 4;
+    return rate > UINT32_MAX / 1000 ? UINT32_MAX / 1000 : (uint32_t)rate;
+}
+
+// 令牌不足时设置paceAt，由timer在令牌够时调用psrCheckUnsent
+static int psrPaceOk(struct Popkcel_PsrField *psr)
+{
+    if (psr->pacing == POPKCEL_PSRPACING_NONE)
+        return 1;
+    uint32_t rate = psrPacingRate(psr);
+    if (psr->pacing == POPKCEL_PSRPACING_KERNEL) {
+        uint32_t kr = rate ? rate * 1000 : UINT32_MAX;
+        // 速率变化超过1/8时才更新，避免每个包都调用setsockopt
+        uint32_t d = kr > psr->kernelRate ? kr - psr->kernelRate : psr->kernelRate - kr;
+        if (d <= psr->kernelRate / 8)
+            return 1;
+        if (popkcel_psrSetMaxPacingRate(psr->sock, kr) == POPKCEL_OK) {
+            psr->kernelRate = kr;
+            return 1;
+        }
+        psr->pacing = POPKCEL_PSRPACING_TIMER;
+    }
+    if (!rate)
+        return 1;
+    int64_t now = popkcel_getCurrentTime();
+    // 时钟的精度是1毫秒，桶至少要装得下2毫秒的量，否则达不到rate
+    int64_t cap = (int64_t)psr->pacingBurst * POPKCEL_MAXUDPSIZE;
+    if (cap < 2 * (int64_t)rate)
+        cap = 2 * (int64_t)rate;
+    psr->paceTokens += (now - psr->paceTime) * rate;
+    psr->paceTime = now;
+    if (psr->paceTokens > cap)
+        psr->paceTokens = cap;
+    if (psr->paceTokens > 0)
+        return 1;
+    if (!psr->paceAt) {
+        psr->paceAt = now + (-psr->paceTokens) / rate + 1;
+        psrArmTimer(psr, psr->paceAt);
+    }
+    return 0;
+}
+
 static int canSend(struct Popkcel_PsrField *psr, uint32_t sid)
 {
-    uint32_t rlid = psr->lastMyConfirmedSendId;
-    struct Popkcel_Rbtnode *it = popkcel_rbtBegin(psr->nodePieceSend);
-    if (it && it->key < rlid)
-        rlid = (uint32_t)it->key - 1;
-    uint32_t e = rlid + psr->window + 1;
-    return sid >= rlid && sid <= e;
+    return psr->inflight < psr->cwnd && sid - psr->sendBase <= psr->window && psrPaceOk(psr);
+}
+
+// 新的包能否立即发送，延后队列中还有包时要先发它们，连接建立前的包也要等着
+static int canSendNew(struct Popkcel_PsrField *psr)
+{
+    return psr->state == POPKCEL_PS_TRANSFER && !psr->deferHead && canSend(psr, psr->mySendId);
+}
+
+static void psrArmProbe(struct Popkcel_PsrField *psr)
+{
+    // 尾包探测的超时为2倍srtt，不比rto短的话就没有意义了
+    uint32_t pto = (2 * psr->srtt + 999) / 1000;
+    if (psr->tailProbe && psr->hasRtt && psr->inflight && pto < psr->rto) {
+        psr->probeAt = popkcel_getCurrentTime() + pto;
+        psrArmTimer(psr, psr->probeAt);
+    }
+    else
+        psr->probeAt = 0;
+}
+
+// 第一次发送rps
+static int psrSendNew(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    psrRingPut(psr, rps);
+    rps->sendCount = 0;
+    psr->inflight++;
+    psr->paceTokens -= rps->bufLen;
+    psr->lastSentId = rps->id;
+    if (!psr->probeAt)
+        psrArmProbe(psr);
+    return rpsSend(rps);
 }
 
-static void psrCheckUnsent(struct Popkcel_PsrField *psr) // 效率有点低，可优化
+/* 对方确认了比rps更晚发送的包，每收到一个这样的确认包ackSkip加1，到达dupThresh时认为rps丢失，立即重传。
+ * 只检查发送顺序链表的开头，重传的包移到链表末尾，所以每次发送最多被检查dupThresh次。
+ * 比lastMyConfirmedSendId大的包还不能判断：重传过的包的确认可能是对原来那次发送的确认，ackedSeq因此会超过
+ * 之后发送的新包，不加这个限制这些包会被全部误判为丢失。遇到这样的包就停止，后面的包等lastMyConfirmedSendId增大后再检查。
+ * 还在发送队列中(pending)的包实际还没发出去，也不计数。
+ */
+static void psrDetectLoss(struct Popkcel_PsrField *psr)
 {
-    struct Popkcel_Rbtnode *it = popkcel_rbtBegin(psr->nodePieceSend);
-    if (!it)
+    if (!psr->dupThresh)
         return;
+    struct Popkcel_PsrPacket *rps = psr->sentHead;
+    while (rps && (int32_t)(psr->ackedSeq - rps->sendSeq) > 0) {
+        if ((int32_t)(rps->id - psr->lastMyConfirmedSendId) >= 0)
+            break;
+        struct Popkcel_PsrPacket *next = rps->sentNext;
+        if (rps->pending) {
+            rps = next;
+            continue;
+        }
+        if (++rps->ackSkip < psr->dupThresh) {
+            rps = next;
+            continue;
+        }
+        // 不能再重传了，交给timer处理
+        if (rps->sendCount >= psr->maxSendCount) {
+            psrSentUnlink(psr, rps);
+            rps = next;
+            continue;
+        }
+        if ((int32_t)(rps->id - psr->recoverSendId) >= 0) {
+            psr->recoverSendId = psr->mySendId;
+            psr->congestion->onLoss(psr, rps, 0);
+        }
+        if (rpsSend(rps) < 0)
+            return;
+        rps = next;
+    }
+}
 
-    uint32_t rlid = psr->lastMyConfirmedSendId;
-    if (it->key < rlid && (rlid < UINT32_MAX - psr->window || it->key > psr->window))
-        rlid = (uint32_t)it->key - 1;
-    uint32_t e = rlid + psr->window + 1;
+static void psrCheckUnsent(struct Popkcel_PsrField *psr);
 
-    do {
-        struct Popkcel_RbtnodePsrSend *rps = (struct Popkcel_RbtnodePsrSend *)it;
-        if (rps->sendCount == -1) {
-            if (rps->key >= rlid && rps->key <= e) {
-                rps->sendCount = 0;
-                if (rpsSend(rps) < 0)
-                    return;
-            }
+// 处理完一个带确认的包
+static void psrAckReceived(struct Popkcel_PsrField *psr)
+{
+    psrDetectLoss(psr);
+    if (psr->state != POPKCEL_PS_TRANSFER)
+        return;
+    psrCheckUnsent(psr);
+    if (psr->state == POPKCEL_PS_TRANSFER)
+        psrArmProbe(psr);
+}
+
+// 窗口打开后，按顺序发送延后队列中进入窗口的包
+static void psrCheckUnsent(struct Popkcel_PsrField *psr)
+{
+    while (psr->deferHead && canSend(psr, psr->deferHead->id)) {
+        struct Popkcel_PsrPacket *rps = psr->deferHead;
+        psr->deferHead = rps->next;
+        if (!psr->deferHead)
+            psr->deferTail = NULL;
+        int r = psrSendNew(psr, rps);
+        if (r == POPKCEL_ERROR)
+            return;
+        if (r >= 0 && rps->callback) {
+            rps->callback(rps->userData, POPKCEL_OK);
+            if (psr->state != POPKCEL_PS_TRANSFER)
+                return;
         }
-        it = popkcel_rbtNext(it);
-    } while (it);
+    }
+    // 窗口满时留在buffer中的数据不会启动timer，窗口打开后要补上
+    if (psr->bufferPos && !psr->corked && canSendNew(psr))
+        psrArmFlush(psr, psr->sendDelay);
     psr->needSend = 0;
 }
 
-static uint32_t bufChecksum(const char *tranId, const char *buf, int bufLen)
+static uint32_t bufChecksum(struct Popkcel_PsrField *psr, const char *buf, int bufLen)
 {
+    if (psr->checksumMode == POPKCEL_PSRCHECKSUM_CRC32C) {
+        // 先算tranId，第三方不知道tranId就无法伪造
+        uint32_t crc = crc32cFunc(0xffffffff, psr->tranId, 4);
+        return htole32(~crc32cFunc(crc, buf, bufLen));
+    }
+
     uint32_t ul;
-    memcpy(&ul, tranId, 4);
+    memcpy(&ul, psr->tranId, 4);
     for (int i = 0; i < bufLen; i += 4) {
         uint32_t ul2;
         if (bufLen - i < 4) {
@@ -97,38 +909,355 @@ static uint32_t bufChecksum(const char *tranId, const char *buf, int bufLen)
     return ul;
 }
 
-static int64_t ipPortHash(struct sockaddr *addr)
+// 哈希表中被删除的位置
+static char pfDeletedMark;
+#define PFDELETED ((struct Popkcel_PsrField *)&pfDeletedMark)
+// 每次操作哈希表时，从旧表搬到新表的位置数
+#define PFMOVESTEP 8
+
+static uint32_t addrHash(const struct sockaddr *addr, uint32_t seed)
+{
+    const unsigned char *p;
+    size_t len;
+    uint16_t port;
+    if (addr->sa_family == AF_INET) {
+        p = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+        len = 4;
+        port = ((const struct sockaddr_in *)addr)->sin_port;
+    }
+    else {
+        p = (const unsigned char *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+        len = 16;
+        port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+    }
+    uint32_t h = seed ^ port;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619u;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int addrEqual(const struct sockaddr *a, const struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family)
+        return 0;
+    if (a->sa_family == AF_INET) {
+        const struct sockaddr_in *a4 = (const struct sockaddr_in *)a, *b4 = (const struct sockaddr_in *)b;
+        return a4->sin_port == b4->sin_port && !memcmp(&a4->sin_addr, &b4->sin_addr, sizeof(a4->sin_addr));
+    }
+    else {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a, *b6 = (const struct sockaddr_in6 *)b;
+        return a6->sin6_port == b6->sin6_port && !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+    }
+}
+
+// cookie按这个长度的时间分段，收到的cookie可以是当前段或上一段的
+#define PSRCOOKIEPERIOD 60000
+
+static void sipRound(uint64_t *v)
+{
+    v[0] += v[1];
+    v[1] = (v[1] << 13) | (v[1] >> 51);
+    v[1] ^= v[0];
+    v[0] = (v[0] << 32) | (v[0] >> 32);
+    v[2] += v[3];
+    v[3] = (v[3] << 16) | (v[3] >> 48);
+    v[3] ^= v[2];
+    v[0] += v[3];
+    v[3] = (v[3] << 21) | (v[3] >> 43);
+    v[3] ^= v[0];
+    v[2] += v[1];
+    v[1] = (v[1] << 17) | (v[1] >> 47);
+    v[1] ^= v[2];
+    v[2] = (v[2] << 32) | (v[2] >> 32);
+}
+
+// SipHash-2-4，m为n个8字节的块
+static uint64_t sipHash(const uint64_t *key, const uint64_t *m, int n)
+{
+    uint64_t v[4] = { key[0] ^ 0x736f6d6570736575ULL, key[1] ^ 0x646f72616e646f6dULL,
+        key[0] ^ 0x6c7967656e657261ULL, key[1] ^ 0x7465646279746573ULL };
+    for (int i = 0; i <= n; i++) {
+        uint64_t w = i < n ? m[i] : (uint64_t)(n * 8) << 56;
+        v[3] ^= w;
+        sipRound(v);
+        sipRound(v);
+        v[0] ^= w;
+    }
+    v[2] ^= 0xff;
+    for (int i = 0; i < 4; i++)
+        sipRound(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* SYN cookie，由对方的地址、端口、tranId和时间段算出。cookieKey只有本机知道，所以cookie不能伪造，
+ * 对方能带着cookie回复，就说明它确实在这个地址上。用的是keyed hash而不是crc32c，因为crc是线性的，拿到一个cookie就能算出别的地址的cookie
+ */
+static uint32_t psrCookie(struct Popkcel_PsrSocket *sock, const struct sockaddr *addr, const char *tranId, int64_t slot)
 {
-    uint64_t r = 0;
+    uint64_t m[4] = { 0, 0, 0, 0 };
+    uint16_t port;
     if (addr->sa_family == AF_INET) {
-        struct sockaddr_in *a4 = (struct sockaddr_in *)addr;
-        memcpy((char *)&r + 2, &a4->sin_addr, 4);
-        memcpy(&r, &a4->sin_port, 2);
+        memcpy(m, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        port = ((const struct sockaddr_in *)addr)->sin_port;
     }
     else {
-        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)addr;
-        char *i6 = (char *)&a6->sin6_addr;
-        for (size_t i = 0; i < 16; i++) {
-            r = i6[i] + (r << 6) + (r << 16) - r;
+        memcpy(m, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+    }
+    uint32_t t;
+    memcpy(&t, tranId, 4);
+    m[2] = ((uint64_t)t << 16) | port;
+    m[3] = (uint64_t)slot;
+    return (uint32_t)sipHash(sock->cookieKey, m, 4);
+}
+
+/* 用SYN|REPLY|CONFIRM回复cookie，格式和对方重启时的确认包一样：[flag][对方的tranId][cookie]，不分配任何状态。
+ * 对方用SYN|CONFIRM回复[tranId][cookie][window][版本号]
+ */
+static void psrSendCookie(struct Popkcel_PsrSocket *sock)
+{
+    struct Popkcel_PsrPacket *rps = psrPacketAlloc(sock);
+    rps->buffer[0] = (unsigned char)(POPKCEL_PF_APT | POPKCEL_PF_SYN | POPKCEL_PF_REPLY | POPKCEL_PF_CONFIRM);
+    memcpy(rps->buffer + 1, sock->psrBuffer + 2, 4);
+    uint32_t c = psrCookie(sock, (struct sockaddr *)&sock->remoteAddr, sock->psrBuffer + 2, popkcel_getCurrentTime() / PSRCOOKIEPERIOD);
+    memcpy(rps->buffer + 5, &c, 4);
+    rps->bufLen = 9;
+    rps->psr = NULL;
+    if (psrSockSend(sock, rps, (struct sockaddr *)&sock->remoteAddr, sock->remoteAddrLen) == POPKCEL_ERROR)
+        psrPacketFree(rps);
+}
+
+// 检查SYN|CONFIRM中的cookie
+static int psrCheckCookie(struct Popkcel_PsrSocket *sock)
+{
+    int64_t slot = popkcel_getCurrentTime() / PSRCOOKIEPERIOD;
+    for (int i = 0; i < 2; i++) {
+        uint32_t c = psrCookie(sock, (struct sockaddr *)&sock->remoteAddr, sock->psrBuffer + 1, slot - i);
+        if (!memcmp(&c, sock->psrBuffer + 5, 4))
+            return 1;
+    }
+    return 0;
+}
+
+static void pfSlotPut(struct Popkcel_PsrSlot *slots, size_t mask, struct Popkcel_PsrField *psr, uint32_t hash)
+{
+    size_t i = hash & mask;
+    while (slots[i].psr && slots[i].psr != PFDELETED)
+        i = (i + 1) & mask;
+    slots[i].psr = psr;
+    slots[i].hash = hash;
+}
+
+// 把旧表中的一部分数据搬到新表，n为0表示全部搬完
+static void pfTableMove(struct Popkcel_PsrTable *t, size_t n)
+{
+    while (t->oldSlots) {
+        struct Popkcel_PsrSlot *s = t->oldSlots + t->movePos;
+        if (s->psr && s->psr != PFDELETED) {
+            pfSlotPut(t->slots, t->mask, s->psr, s->hash);
+            t->count++;
+            s->psr = PFDELETED; // 不能置为NULL，否则旧表中后面的数据会找不到
         }
-        memcpy(&r, &a6->sin6_port, 2);
-        r |= 1;
+        if (t->movePos++ == t->oldMask) {
+            free(t->oldSlots);
+            t->oldSlots = NULL;
+        }
+        else if (n && !--n)
+            break;
     }
-    return r;
 }
 
-static void psrAddReply(struct Popkcel_PsrField *psr, uint32_t rid)
+static struct Popkcel_PsrSlot *pfSlotFind(struct Popkcel_PsrSlot *slots, size_t mask, const struct sockaddr *addr, uint32_t hash)
+{
+    size_t i = hash & mask;
+    while (slots[i].psr) {
+        if (slots[i].hash == hash && slots[i].psr != PFDELETED && addrEqual((struct sockaddr *)&slots[i].psr->remoteAddr, addr))
+            return slots + i;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static struct Popkcel_PsrSlot *pfTableFind(struct Popkcel_PsrTable *t, const struct sockaddr *addr)
 {
-    struct Popkcel_RbtInsertPos ipos = popkcel_rbtInsertPos(&psr->nodeReply, rid);
-    if (ipos.ipos) {
-        struct Popkcel_Rbtnode *it = malloc(sizeof(struct Popkcel_Rbtnode));
-        it->key = rid;
-        popkcel_rbtInsertAtPos(&psr->nodeReply, ipos, it);
-        if (!psr->timerStarted) {
-            popkcel_setTimer(&psr->timer, 10, 0);
-            psr->timerStarted = 1;
+    if (!t->slots)
+        return NULL;
+    pfTableMove(t, PFMOVESTEP);
+    uint32_t hash = addrHash(addr, t->seed);
+    struct Popkcel_PsrSlot *s = pfSlotFind(t->slots, t->mask, addr, hash);
+    if (!s && t->oldSlots)
+        s = pfSlotFind(t->oldSlots, t->oldMask, addr, hash);
+    return s;
+}
+
+static void pfTableInsert(struct Popkcel_PsrTable *t, struct Popkcel_PsrField *psr)
+{
+    if (!t->slots) {
+        t->mask = 15;
+        t->slots = calloc(t->mask + 1, sizeof(struct Popkcel_PsrSlot));
+    }
+    else {
+        pfTableMove(t, PFMOVESTEP);
+        if ((t->count + t->deleted + 1) * 2 > t->mask + 1) { // 负载超过1/2时换新表，删除标记多时新表大小不变
+            pfTableMove(t, 0);
+            t->oldSlots = t->slots;
+            t->oldMask = t->mask;
+            t->movePos = 0;
+            if ((t->count + 1) * 4 > t->mask + 1)
+                t->mask = t->mask * 2 + 1;
+            t->slots = calloc(t->mask + 1, sizeof(struct Popkcel_PsrSlot));
+            t->count = t->deleted = 0;
         }
     }
+    pfSlotPut(t->slots, t->mask, psr, addrHash((struct sockaddr *)&psr->remoteAddr, t->seed));
+    t->count++;
+}
+
+static void pfTableRemove(struct Popkcel_PsrTable *t, struct Popkcel_PsrField *psr)
+{
+    if (t->last == psr)
+        t->last = NULL;
+    if (!t->slots)
+        return;
+    pfTableMove(t, PFMOVESTEP);
+    uint32_t hash = addrHash((struct sockaddr *)&psr->remoteAddr, t->seed);
+    struct Popkcel_PsrSlot *s = pfSlotFind(t->slots, t->mask, (struct sockaddr *)&psr->remoteAddr, hash);
+    if (s && s->psr == psr) {
+        s->psr = PFDELETED;
+        t->count--;
+        t->deleted++;
+    }
+    else if (t->oldSlots) {
+        s = pfSlotFind(t->oldSlots, t->oldMask, (struct sockaddr *)&psr->remoteAddr, hash);
+        if (s && s->psr == psr)
+            s->psr = PFDELETED;
+    }
+}
+
+/* 收到一个数据包后决定什么时候回复确认：收到ackEvery个包、包不连续或重复（ackOnGap）时，
+ * 处理完这个udp包就立即回复，否则最多等待ackDelay毫秒
+ */
+static void psrAckPolicy(struct Popkcel_PsrField *psr, int gap)
+{
+    if (psr->ackRecvCount < UINT16_MAX)
+        psr->ackRecvCount++;
+    if ((gap && psr->ackOnGap) || (psr->ackEvery && psr->ackRecvCount >= psr->ackEvery) || !psr->ackDelay) {
+        psr->ackNow = 1;
+        return;
+    }
+    psrArmFlush(psr, psr->ackDelay);
+}
+
+// 立即发送确认和buffer中的数据
+static void psrFlushNow(struct Popkcel_PsrField *psr)
+{
+    psr->ackNow = 0;
+    psr->flushAt = 0;
+    psrFlush(psr);
+}
+
+static int ctz64(uint64_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long r;
+    _BitScanForward64(&r, v);
+    return (int)r;
+#else
+    int n = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// [id, end)中第一个确认位为bit的序号，没有时返回end
+static uint32_t ackScan(struct Popkcel_PsrField *psr, uint32_t id, uint32_t end, int bit)
+{
+    while (id != end) {
+        uint32_t i = id & psr->ackMask;
+        uint64_t w = psr->ackBits[i >> 6];
+        if (!bit)
+            w = ~w;
+        w >>= i & 63;
+        if (w) {
+            uint32_t n = (uint32_t)ctz64(w);
+            return n < end - id ? id + n : end;
+        }
+        uint32_t step = 64 - (i & 63);
+        if (end - id <= step)
+            return end;
+        id += step;
+    }
+    return end;
+}
+
+/* 记下需要确认的序号。ackBits是以ackBase为起点的位图，下标为序号 & ackMask。
+ * 需要确认的序号不会比oppositeSendId小window + 1以上，也不会比它大window以上，所以位图大小取不小于2 * window + 2
+ */
+static void psrAddReply(struct Popkcel_PsrField *psr, uint32_t rid, int gap)
+{
+    if (!psr->ackBits) {
+        uint32_t size = 64;
+        while (size < 2 * (uint32_t)psr->window + 2)
+            size *= 2;
+        psr->ackBits = calloc(size / 64, sizeof(uint64_t));
+        psr->ackMask = size - 1;
+    }
+    if (!psr->ackCount) {
+        psr->ackBase = rid;
+        psr->ackEnd = rid + 1;
+    }
+    else {
+        uint32_t lo = (int32_t)(rid - psr->ackBase) < 0 ? rid : psr->ackBase;
+        uint32_t hi = (int32_t)(rid + 1 - psr->ackEnd) > 0 ? rid + 1 : psr->ackEnd;
+        if (hi - lo > psr->ackMask + 1)
+            return; // 很旧的重复包，对方早就收到确认了
+        psr->ackBase = lo;
+        psr->ackEnd = hi;
+    }
+    uint32_t i = rid & psr->ackMask;
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    if (psr->ackBits[i >> 6] & bit)
+        return;
+    psr->ackBits[i >> 6] |= bit;
+    psr->ackCount++;
+    psrAckPolicy(psr, gap);
+}
+
+static void ackClear(struct Popkcel_PsrField *psr, uint32_t st, uint32_t e)
+{
+    psr->ackCount -= e - st;
+    for (; st != e; st++) {
+        uint32_t i = st & psr->ackMask;
+        psr->ackBits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    }
+}
+
+// 回复SYN|REPLY，接受了SYN中的包时在最后多带一个1
+static void psrSendConnReply(struct Popkcel_PsrField *psr)
+{
+    struct Popkcel_PsrPacket *rps = psrPacketAlloc(psr->sock);
+    rps->buffer[0] = (unsigned char)(POPKCEL_PF_APT | POPKCEL_PF_SYN | POPKCEL_PF_REPLY);
+    memcpy(rps->buffer + 1, psr->tranId, 4);
+    uint16_t us = htole16(psr->window);
+    memcpy(rps->buffer + 5, &us, 2);
+    // 版本0时不带版本号，以兼容旧版本
+    rps->buffer[7] = psr->version;
+    rps->bufLen = psr->version ? 8 : 7;
+    if (psr->earlyData == 2) {
+        rps->buffer[8] = 1;
+        rps->bufLen = 9;
+    }
+    psrSendOnce(psr, rps);
 }
 
 static void sendConnConfirm(struct Popkcel_PsrField *psr)
@@ -138,27 +1267,85 @@ static void sendConnConfirm(struct Popkcel_PsrField *psr)
         psrError(psr);
         return;
     }
-    unsigned char buf[7];
-    buf[0] = POPKCEL_PF_APT | POPKCEL_PF_SYN | POPKCEL_PF_REPLY;
-    memcpy(buf + 1, psr->tranId, 4);
-    uint16_t us = htole16(psr->window);
-    memcpy(buf + 5, &us, 2);
-    popkcel_trySendto((struct Popkcel_Socket *)psr->sock, (char *)buf, 7, (struct sockaddr *)&psr->remoteAddr, psr->addrLen, NULL, NULL);
+    psrSendConnReply(psr);
 }
 
 static void sendSynConfirmReply(struct Popkcel_PsrField *psr)
 {
     psr->synConfirm = 1;
     memcpy(psr->tranIdNew, psr->sock->psrBuffer + 2, 4);
-    unsigned char buf[9];
-    buf[0] = POPKCEL_PF_APT | POPKCEL_PF_SYN | POPKCEL_PF_REPLY | POPKCEL_PF_CONFIRM;
-    memcpy(buf + 1, psr->tranIdNew, 4);
-    memcpy(buf + 5, psr->tranId, 4);
-    popkcel_trySendto((struct Popkcel_Socket *)psr->sock, (char *)buf, 9, (struct sockaddr *)&psr->remoteAddr, psr->addrLen, NULL, NULL);
+    struct Popkcel_PsrPacket *rps = psrPacketAlloc(psr->sock);
+    rps->buffer[0] = (unsigned char)(POPKCEL_PF_APT | POPKCEL_PF_SYN | POPKCEL_PF_REPLY | POPKCEL_PF_CONFIRM);
+    memcpy(rps->buffer + 1, psr->tranIdNew, 4);
+    memcpy(rps->buffer + 5, psr->tranId, 4);
+    rps->bufLen = 9;
+    psrSendOnce(psr, rps);
+}
+
+// 本机在握手中发送的版本号，checksumMode为XOR时只能用版本0，以兼容旧版本
+static char sockVersion(struct Popkcel_PsrSocket *sock)
+{
+    return sock->checksumMode == POPKCEL_PSRCHECKSUM_XOR ? 0 : POPKCEL_PSRVERSION;
+}
+
+static char lowerVersion(struct Popkcel_PsrSocket *sock, char v)
+{
+    char mv = sockVersion(sock);
+    return (unsigned char)v < (unsigned char)mv ? v : mv;
 }
 
-static void createNewConnection(struct Popkcel_PsrSocket *sock, uint16_t us, int64_t h)
+static void psrSetVersion(struct Popkcel_PsrField *psr, char v)
 {
+    psr->version = v;
+    psr->checksumMode = v >= 1 ? POPKCEL_PSRCHECKSUM_CRC32C : POPKCEL_PSRCHECKSUM_XOR;
+}
+
+/* 连接建立前psrTrySend的包在延后队列中。握手时mySendId被用来计数，tranId和校验方式也可能改变，所以连接建立后重新编号并计算校验和。
+ * accepted为1表示对方已经收到了SYN中带的第一个包，不用再发
+ */
+static void psrEarlyReady(struct Popkcel_PsrField *psr, int accepted)
+{
+    uint32_t id = 0, ul;
+    struct Popkcel_PsrPacket *rps = psr->deferHead;
+    if (accepted && rps) {
+        psr->deferHead = rps->next;
+        if (!psr->deferHead)
+            psr->deferTail = NULL;
+        psrPacketFree(rps);
+        id = 1;
+        psr->sendBase = psr->unsentId = 1;
+    }
+    for (rps = psr->deferHead; rps; rps = rps->next) {
+        rps->id = id++;
+        ul = htole32(rps->id);
+        memcpy(rps->buffer + 5, &ul, 4);
+        ul = bufChecksum(psr, rps->buffer + 5, rps->bufLen - 5);
+        memcpy(rps->buffer + 1, &ul, 4);
+    }
+    if (psr->bufferPos) {
+        ul = htole32(id);
+        memcpy(psr->bufferPacket->buffer + 5, &ul, 4);
+    }
+    psr->mySendId = id;
+}
+
+// SYN中带的包只能是流0中序号为0的包，版本不低于4时按CRC32C校验
+static int psrEarlyOk(struct Popkcel_PsrField *psr, const char *buf, uint32_t len)
+{
+    if (psr->version < 4 || len < 11 || (unsigned char)buf[0] != (POPKCEL_PF_TRANSFORM | POPKCEL_PF_APT))
+        return 0;
+    uint32_t ul;
+    memcpy(&ul, buf + 5, 4);
+    if (ul)
+        return 0;
+    ul = bufChecksum(psr, buf + 5, (int)len - 5);
+    return !memcmp(&ul, buf + 1, 4);
+}
+
+// early为SYN中带的包，没有时为NULL。返回1表示接受了这个包，调用者要把它当作收到的数据包处理
+static int createNewConnection(struct Popkcel_PsrSocket *sock, uint16_t us, char version, const char *early, uint32_t earlyLen)
+{
+    sock->psrVersion = version;
     us = le16toh(us);
     if (us <= sock->maxWindow)
         sock->psrWindow = us;
@@ -166,13 +1353,152 @@ static void createNewConnection(struct Popkcel_PsrSocket *sock, uint16_t us, int
         sock->psrWindow = sock->maxWindow;
     struct Popkcel_PsrField *psr = sock->listenCb(sock, NULL);
     if (psr) {
+        if (early && psrEarlyOk(psr, early, earlyLen))
+            psr->earlyData = 2;
         sendConnConfirm(psr);
-        struct Popkcel_RbtnodeData *it = malloc(sizeof(struct Popkcel_RbtnodeData));
-        it->key = h;
-        it->value = psr;
-        popkcel_rbtMultiInsert(&sock->nodePf, (struct Popkcel_Rbtnode *)it);
+        pfTableInsert(&sock->pfTable, psr);
         sock->listenCb(sock, psr);
+        return psr->earlyData == 2;
+    }
+    return 0;
+}
+
+static int psrCallback(struct Popkcel_PsrField *psr, uint16_t stream, char *buf, uint32_t len)
+{
+    psr->recvStream = stream;
+    psr->recvBuf = buf;
+    return psr->callback ? psr->callback(psr, len) : 0;
+}
+
+/** 消息模式下包中的数据是一个个[长度4][消息]，长消息的后续部分在之后的包的开头。
+ *  m为NULL表示此流不能重组消息。返回非0表示psr已删除
+ */
+static int psrDeliverMessages(struct Popkcel_PsrField *psr, struct Popkcel_PsrMessage *m, uint16_t stream, char *buf, uint32_t len)
+{
+    while (len) {
+        if (m && m->buf) {
+            uint32_t n = m->len - m->pos;
+            if (n > len)
+                n = len;
+            memcpy(m->buf + m->pos, buf, n);
+            m->pos += n;
+            buf += n;
+            len -= n;
+            if (m->pos == m->len) {
+                char *mb = m->buf;
+                m->buf = NULL;
+                int r = psrCallback(psr, stream, mb, m->len);
+                free(mb);
+                if (r)
+                    return 1;
+            }
+            continue;
+        }
+        uint32_t ml;
+        if (len < 4)
+            goto bad;
+        memcpy(&ml, buf, 4);
+        ml = le32toh(ml);
+        buf += 4;
+        len -= 4;
+        if (ml <= len) {
+            if (ml && psrCallback(psr, stream, buf, ml))
+                return 1;
+            buf += ml;
+            len -= ml;
+        }
+        else {
+            if (!m || ml > psr->maxMessage)
+                goto bad;
+            m->buf = malloc(ml);
+            m->len = ml;
+            m->pos = len;
+            memcpy(m->buf, buf, len);
+            len = 0;
+        }
+    }
+    return 0;
+bad:
+    // 对方没有按消息模式发送，或者超过了maxMessage
+    psrError(psr);
+    return 1;
+}
+
+static int psrDeliver(struct Popkcel_PsrField *psr, uint16_t stream, char *buf, uint16_t len)
+{
+    if (!psr->messageMode)
+        return psrCallback(psr, stream, buf, len);
+    struct Popkcel_PsrMessage *m = NULL;
+    if (stream == 0)
+        m = &psr->message;
+    else if (stream != POPKCEL_PSRSTREAM_UNORDERED)
+        m = &psr->streams[stream].message;
+    return psrDeliverMessages(psr, m, stream, buf, len);
+}
+
+// 把流中的包按流内的序号交给用户，返回非0表示psr已删除
+static int psrStreamRecv(struct Popkcel_PsrField *psr, uint16_t stream, uint32_t sseq, char *buf, uint16_t len)
+{
+    if (stream == 0 || stream == POPKCEL_PSRSTREAM_UNORDERED)
+        return psrDeliver(psr, stream, buf, len);
+    struct Popkcel_PsrStream *st = &psr->streams[stream];
+    if (sseq != st->recvSeq) {
+        if (sseq - st->recvSeq <= psr->window && !reorderHas(&st->reorder, sseq))
+            reorderPut(psr, &st->reorder, sseq, psrPacketCopy(psr->sock, buf, len));
+        return 0;
+    }
+    st->recvSeq++;
+    if (psrDeliver(psr, stream, buf, len))
+        return 1;
+    struct Popkcel_PsrPacket *rp;
+    while (st->reorder.count && reorderTake(&st->reorder, st->recvSeq, &rp)) {
+        st->recvSeq++;
+        int r = psrDeliver(psr, stream, rp->buffer, (uint16_t)rp->bufLen);
+        psrPacketFree(rp);
+        if (r)
+            return 1;
+    }
+    return 0;
+}
+
+/** 收到序号为id的数据包。流0的包按连接的序号交给用户，其它流的包只要不重复就交给psrStreamRecv，不用等前面的包。
+ *  返回非0表示psr已删除
+ */
+static int psrRecvData(struct Popkcel_PsrField *psr, uint32_t id, uint16_t stream, uint32_t sseq, char *buf, uint16_t len)
+{
+    if (id == psr->oppositeSendId) {
+        psrAddReply(psr, id, 0);
+        psr->oppositeSendId++;
+        if (psrStreamRecv(psr, stream, sseq, buf, len))
+            return 1;
+        struct Popkcel_PsrPacket *rp;
+        while (psr->recvOrder.count && reorderTake(&psr->recvOrder, psr->oppositeSendId, &rp)) {
+            psr->oppositeSendId++;
+            if (rp) {
+                int r = psrDeliver(psr, 0, rp->buffer, (uint16_t)rp->bufLen);
+                psrPacketFree(rp);
+                if (r)
+                    return 1;
+            }
+        }
+        return 0;
     }
+    // 只确认已经收下的包，窗口外被丢弃的包不能确认，否则对方不会重传
+    uint32_t d = id - psr->oppositeSendId;
+    if (d > UINT32_MAX / 2)
+        psrAddReply(psr, id, 1); // 已经收到过的重复包，之前的确认可能丢了
+    else if (d <= psr->window) {
+        psrAddReply(psr, id, 1);
+        if (reorderHas(&psr->recvOrder, id))
+            return 0;
+        if (stream == 0)
+            reorderPut(psr, &psr->recvOrder, id, psrPacketCopy(psr->sock, buf, len));
+        else {
+            reorderPut(psr, &psr->recvOrder, id, NULL);
+            return psrStreamRecv(psr, stream, sseq, buf, len);
+        }
+    }
+    return 0;
 }
 
 #ifdef NDEBUG
@@ -185,7 +1511,6 @@ static int psrRecvFromCb(void *data, intptr_t rv)
 {
     struct Popkcel_PsrSocket *sock = data;
     struct Popkcel_PsrField *psr;
-    int64_t h;
     uint32_t ul, ul2;
     uint16_t us;
     unsigned char flag;
@@ -215,6 +1540,7 @@ restart:;
             return 0;
     }
 
+reparse:
     if (rv < 5)
         GOTOEND;
     flag = sock->psrBuffer[0];
@@ -223,35 +1549,25 @@ restart:;
     flag &= 0x7f;
     if (flag == POPKCEL_PF_SYN) {
         if (sock->listenCb) {
-            if (rv != 8)
-                GOTOEND;
-            if (sock->psrBuffer[1] != POPKCEL_PSRVERSION)
+            // 8个字节之后是zeroRtt时带的第一个包
+            if (rv != 8 && rv < 8 + 11)
                 GOTOEND;
+            // 双方取较低的版本号
+            char cm = lowerVersion(sock, sock->psrBuffer[1]);
 
-            h = ipPortHash((struct sockaddr *)&sock->remoteAddr);
-            struct Popkcel_RbtnodeData *it = (struct Popkcel_RbtnodeData *)popkcel_rbtFind(sock->nodePf, h);
-            if (it) {
-                psr = it->value;
-                if (sock->ipv6) {
-                    while (memcmp(&psr->remoteAddr.sin6_addr, &sock->remoteAddr.sin6_addr, sizeof(sock->remoteAddr.sin6_addr))) {
-                        it = (struct Popkcel_RbtnodeData *)popkcel_rbtNext((struct Popkcel_Rbtnode *)it);
-                        if (!it || it->key != h)
-                            goto passCheck;
-                        psr = it->value;
-                    }
-                }
-
+            psr = popkcel_psrFind(sock, (struct sockaddr *)&sock->remoteAddr);
+            if (psr) {
                 if (psr->state == POPKCEL_PS_CONNECTING) { // 互相连接对方的情况，视为连接已完成，保留两者中更“小”的tranId，不调用新连接回调，但仍会发送连接成功的通知
                     if (memcmp(psr->tranId, sock->psrBuffer + 2, 4) > 0) {
                         memcpy(psr->tranId, sock->psrBuffer + 2, 4);
-                        if (psr->nodePieceSend && psr->nodePieceSend->key == 0) {
-                            memcpy(((struct Popkcel_RbtnodePsrSend *)(psr->nodePieceSend))->buffer + 2, sock->psrBuffer + 2, 4);
-                        }
+                        if (psr->synPacket)
+                            memcpy(psr->synPacket->buffer + 2, sock->psrBuffer + 2, 4);
                     }
                     memcpy(&us, sock->psrBuffer + 6, 2);
                     us = le16toh(us);
                     if (us < psr->window)
                         psr->window = us;
+                    psrSetVersion(psr, cm);
                     psr->mySendId = 0;
                     sendConnConfirm(psr);
                 }
@@ -263,40 +1579,45 @@ restart:;
                         psr->window = us;
                     else
                         psr->window = sock->maxWindow;
+                    psrSetVersion(psr, cm);
                     sendConnConfirm(psr);
                 }
                 else if (psr->state == POPKCEL_PS_TRANSFER) {
-                    sendSynConfirmReply(psr);
+                    // tranId相同是SYN重传了，说明对方没收到SYN|REPLY。不同则是对方重启了
+                    if (!memcmp(psr->tranId, sock->psrBuffer + 2, 4))
+                        psrSendConnReply(psr);
+                    else
+                        sendSynConfirmReply(psr);
                 }
                 goto end;
             }
-        passCheck:;
+            if (sock->synCookies) {
+                psrSendCookie(sock);
+                goto end;
+            }
             memcpy(sock->tranId, sock->psrBuffer + 2, 4);
             memcpy(&us, sock->psrBuffer + 6, 2);
-            createNewConnection(sock, us, h);
+            if (createNewConnection(sock, us, cm, rv > 8 ? sock->psrBuffer + 8 : NULL, (uint32_t)rv - 8)) {
+                // 接受了SYN中的包，当作刚收到的数据包处理
+                rv -= 8;
+                memmove(sock->psrBuffer, sock->psrBuffer + 8, rv);
+                goto reparse;
+            }
         }
     }
     else {
         psr = popkcel_psrFind(sock, (struct sockaddr *)&sock->remoteAddr);
-        // h = ipPortHash((struct sockaddr *)&sock->remoteAddr);
-        // struct Popkcel_RbtnodeData *it = (struct Popkcel_RbtnodeData *)popkcel_rbtFind(sock->nodePf, h);
         if (psr) {
-            /*psr = it->value;
-            if (sock->ipv6) {
-                while (memcmp(&psr->remoteAddr.sin6_addr, &sock->remoteAddr.sin6_addr, sizeof(sock->remoteAddr.sin6_addr))) {
-                    it = (struct Popkcel_RbtnodeData *)popkcel_rbtNext((struct Popkcel_Rbtnode *)it);
-                    if (!it || it->key != h)
-                        GOTOEND;
-                    psr = it->value;
-                }
-            }*/
-
             if (flag & POPKCEL_PF_SYN) {
                 switch (flag) {
                 case POPKCEL_PF_SYN | POPKCEL_PF_REPLY: {
                     if (psr->state != POPKCEL_PS_CONNECTING)
                         GOTOEND;
-                    if (rv != 7)
+                    if (rv == 7)
+                        psrSetVersion(psr, 0);
+                    else if ((rv == 8 || rv == 9) && sock->psrBuffer[7] > 0 && lowerVersion(sock, sock->psrBuffer[7]) == sock->psrBuffer[7])
+                        psrSetVersion(psr, sock->psrBuffer[7]);
+                    else
                         GOTOEND;
                     if (memcmp(psr->tranId, sock->psrBuffer + 1, 4))
                         GOTOEND;
@@ -304,31 +1625,34 @@ restart:;
                     us = le16toh(us);
                     if (us > psr->window)
                         GOTOEND;
-                    psr->mySendId = 0;
                     psr->synConfirm = 0;
                     psr->state = POPKCEL_PS_TRANSFER;
                     psr->window = us;
-                    if (psr->nodePieceSend) {
-                        struct Popkcel_RbtnodePsrSend *it = (struct Popkcel_RbtnodePsrSend *)psr->nodePieceSend;
-                        popkcel_stopTimer(&it->timer);
-                        psr->nodePieceSend = NULL;
-                        if (it->pending == 0)
-                            free(it);
-                        else
-                            it->pending = 2;
-                    }
-                    if (psr->callback) {
-                        psr->callback(psr, POPKCEL_CONNECTED);
+                    psrEarlyReady(psr, rv == 9 && sock->psrBuffer[8] == 1 && psr->earlyData == 1);
+                    if (psr->synPacket) {
+                        psrRttSample(psr, psr->synPacket);
+                        psrPacketRelease(psr->synPacket);
+                        psr->synPacket = NULL;
                     }
+                    if (psr->callback && psr->callback(psr, POPKCEL_CONNECTED))
+                        GOTOEND;
+                    if (psr->state == POPKCEL_PS_TRANSFER)
+                        psrCheckUnsent(psr);
                 } break;
                 case POPKCEL_PF_SYN | POPKCEL_PF_CONFIRM: {
                     if (!sock->listenCb)
                         GOTOEND;
+                    if (psr->state == POPKCEL_PS_CONNECTED) {
+                        // 带cookie的SYN|CONFIRM重传了，说明回复的SYN|REPLY丢了
+                        if ((rv == 11 || rv == 12) && !memcmp(psr->tranId, sock->psrBuffer + 1, 4))
+                            sendConnConfirm(psr);
+                        GOTOEND;
+                    }
                     if (psr->state != POPKCEL_PS_TRANSFER)
                         GOTOEND;
                     if (!psr->synConfirm)
                         GOTOEND;
-                    if (rv != 11)
+                    if (rv != 11 && rv != 12)
                         GOTOEND;
                     if (memcmp(psr->tranId, sock->psrBuffer + 5, 4))
                         GOTOEND;
@@ -337,7 +1661,7 @@ restart:;
                     psrError(psr);
                     memcpy(sock->tranId, sock->psrBuffer + 1, 4);
                     memcpy(&us, sock->psrBuffer + 9, 2);
-                    createNewConnection(sock, us, h);
+                    createNewConnection(sock, us, rv == 12 ? lowerVersion(sock, sock->psrBuffer[11]) : 0, NULL, 0);
                 } break;
                 case POPKCEL_PF_SYN | POPKCEL_PF_REPLY | POPKCEL_PF_CONFIRM: {
                     if (psr->state != POPKCEL_PS_CONNECTING)
@@ -349,25 +1673,20 @@ restart:;
                     if (memcmp(sock->psrBuffer + 1, psr->tranId, 4))
                         GOTOEND;
                     psr->synConfirm = 1;
-                    if (psr->nodePieceSend) {
-                        struct Popkcel_RbtnodePsrSend *it = (struct Popkcel_RbtnodePsrSend *)psr->nodePieceSend;
-                        popkcel_stopTimer(&it->timer);
-                        psr->nodePieceSend = NULL;
-                        if (it->pending == 0)
-                            free(it);
-                        else
-                            it->pending = 2;
+                    if (psr->synPacket) {
+                        psrPacketRelease(psr->synPacket);
+                        psr->synPacket = NULL;
                     }
-                    struct Popkcel_RbtnodePsrSend *rps = malloc(sizeof(struct Popkcel_RbtnodePsrSend) + 11);
-                    rps->key = 0;
-                    rps->bufLen = 11;
+                    struct Popkcel_PsrPacket *rps = psrPacketAlloc(sock);
+                    rps->bufLen = 12;
                     rps->buffer[0] = (unsigned char)(POPKCEL_PF_APT | POPKCEL_PF_SYN | POPKCEL_PF_CONFIRM);
                     memcpy(rps->buffer + 1, psr->tranId, 4);
                     memcpy(rps->buffer + 5, sock->psrBuffer + 5, 4);
                     us = htole16(psr->window);
                     memcpy(rps->buffer + 9, &us, 2);
-                    if (rpsInit(rps, psr) == POPKCEL_ERROR) {
-                        free(rps);
+                    rps->buffer[11] = sockVersion(sock);
+                    if (psrSendSyn(rps, psr) == POPKCEL_ERROR) {
+                        psrPacketFree(rps);
                         GOTOEND;
                     }
                 } break;
@@ -376,23 +1695,39 @@ restart:;
                 }
             }
             else if (flag & POPKCEL_PF_TRANSFORM) {
-                if (flag & 0x78)
+                if ((flag & 0x78) && flag != (POPKCEL_PF_TRANSFORM | POPKCEL_PF_CONFIRM) && flag != (POPKCEL_PF_TRANSFORM | POPKCEL_PF_CONFIRM | POPKCEL_PF_SINGLE))
                     GOTOEND;
                 if (psr->state == POPKCEL_PS_CONNECTED) {
                     psr->mySendId = 0;
                     psr->state = POPKCEL_PS_TRANSFER;
                 }
+                else if (psr->state == POPKCEL_PS_CONNECTING && psr->earlyData == 1) {
+                    /* 对方接受了SYN中的包后可能马上开始发送，说明SYN|REPLY丢了或者还没到。数据包中没有协商的窗口和版本，不能当作连接完成，
+                     * 丢弃它，并把SYN的第一次重传提前到现在，让对方重发SYN|REPLY
+                     */
+                    struct Popkcel_PsrPacket *rps = psr->synPacket;
+                    if (rps && rps->sendCount == 1) {
+                        rps->resendTime = popkcel_getCurrentTime();
+                        psrArmTimer(psr, rps->resendTime);
+                    }
+                    goto end;
+                }
                 else if (psr->state != POPKCEL_PS_TRANSFER)
                     GOTOEND;
 
-                ul = bufChecksum(psr->tranId, sock->psrBuffer + 5, (int)rv - 5);
+                ul = bufChecksum(psr, sock->psrBuffer + 5, (int)rv - 5);
                 if (memcmp(&ul, sock->psrBuffer + 1, 4))
                     GOTOEND; // checksum fail
 
                 ul = 5;
+                int acked = 0;
+                // 这个udp包中最后一个数据的序号，确认频率设置以它为准
+                uint32_t dataId = 0;
+                int hasData = 0;
                 do {
                     switch (flag) {
                     case POPKCEL_PF_TRANSFORM:
+                    case POPKCEL_PF_TRANSFORM | POPKCEL_PF_SINGLE: {
                         if ((uintptr_t)rv < ul + 6)
                             GOTOEND;
                         memcpy(&ul2, sock->psrBuffer + ul, 4);
@@ -403,56 +1738,30 @@ restart:;
                         ul += 2;
                         if (!us || ul + us > (uintptr_t)rv)
                             GOTOEND;
-                        psrAddReply(psr, ul2);
-                        if (ul2 == psr->oppositeSendId) {
-                            psr->recvBuf = sock->psrBuffer + ul;
-                            psr->oppositeSendId++;
-                            if (psr->callback) {
-                                if (psr->callback(psr, us))
-                                    goto end;
-                            }
-                            struct Popkcel_Rbtnode *it = popkcel_rbtFind(psr->nodePieceReceive, psr->oppositeSendId);
-                            if (it) {
-                                // assert(0);
-                                do {
-                                    struct Popkcel_RbtnodeBuf *rit = (struct Popkcel_RbtnodeBuf *)it;
-                                    psr->recvBuf = rit->buffer;
-                                    if (psr->callback) {
-                                        if (psr->callback(psr, rit->bufLen))
-                                            goto end;
-                                    }
-                                    psr->oppositeSendId++;
-                                    if (psr->oppositeSendId == 0) {
-                                        assert(0);
-                                        popkcel_rbtDelete(&psr->nodePieceReceive, (struct Popkcel_Rbtnode *)rit);
-                                        free(rit);
-                                        it = popkcel_rbtBegin(psr->nodePieceReceive);
-                                    }
-                                    else {
-                                        it = popkcel_rbtNext(it);
-                                        popkcel_rbtDelete(&psr->nodePieceReceive, (struct Popkcel_Rbtnode *)rit);
-                                        free(rit);
-                                    }
-                                } while (it && it->key == psr->oppositeSendId);
-                            }
-                        }
-                        else {
-                            // assert(0);
-                            uint32_t m = psr->oppositeSendId + psr->window;
-                            if (ul2 <= m || (m < psr->oppositeSendId && ul2 > psr->oppositeSendId)) {
-                                assert(m > psr->oppositeSendId);
-                                struct Popkcel_RbtInsertPos ipos = popkcel_rbtInsertPos(&psr->nodePieceReceive, ul2);
-                                if (ipos.ipos) {
-                                    struct Popkcel_RbtnodeBuf *rb = malloc(sizeof(struct Popkcel_RbtnodeBuf) + us);
-                                    rb->bufLen = us;
-                                    rb->key = ul2;
-                                    memcpy(rb->buffer, sock->psrBuffer + ul, us);
-                                    popkcel_rbtInsertAtPos(&psr->nodePieceReceive, ipos, (struct Popkcel_Rbtnode *)rb);
-                                }
-                            }
+                        char *data = sock->psrBuffer + ul;
+                        uint16_t dataLen = us;
+                        uint16_t stream = 0;
+                        uint32_t sseq = 0;
+                        if (flag & POPKCEL_PF_SINGLE) {
+                            // 流中的数据，前面是[流编号2][流内序号4]
+                            if (psr->version < 3 || us <= 6)
+                                GOTOEND;
+                            memcpy(&stream, data, 2);
+                            stream = le16toh(stream);
+                            memcpy(&sseq, data + 2, 4);
+                            sseq = le32toh(sseq);
+                            // 双方的maxStreams不同，丢弃且不确认
+                            if (stream == 0 || (stream != POPKCEL_PSRSTREAM_UNORDERED && !psrGetStream(psr, stream)))
+                                goto end;
+                            data += 6;
+                            dataLen -= 6;
                         }
+                        dataId = ul2;
+                        hasData = 1;
                         ul += us;
-                        break;
+                        if (psrRecvData(psr, ul2, stream, sseq, data, dataLen))
+                            goto end;
+                    } break;
                     case POPKCEL_PF_TRANSFORM | POPKCEL_PF_REPLY: {
                         if ((uintptr_t)rv < ul + 8)
                             GOTOEND;
@@ -468,30 +1777,12 @@ restart:;
                         if (len > psr->window)
                             GOTOEND;
 
-                        struct Popkcel_Rbtnode *it = popkcel_rbtLowerBound(psr->nodePieceSend, st);
-                        // assert(it->key == st);
-                        int restarted = 0;
-                        while (it && it->key - st <= len) {
-                            if (psr->lastMyConfirmedSendId < it->key
-                                || (psr->lastMyConfirmedSendId >= UINT32_MAX - psr->window && it->key <= psr->window)) {
-                                assert(psr->lastMyConfirmedSendId < UINT32_MAX - psr->window);
-                                psr->lastMyConfirmedSendId = (uint32_t)it->key;
-                            }
-                            struct Popkcel_RbtnodePsrSend *sit = (struct Popkcel_RbtnodePsrSend *)it;
-                            it = popkcel_rbtNext(it);
-                            popkcel_stopTimer(&sit->timer);
-                            popkcel_rbtDelete(&psr->nodePieceSend, (struct Popkcel_Rbtnode *)sit);
-                            if (sit->pending == 0)
-                                free(sit);
-                            else
-                                sit->pending = 2;
-                            if (!it && e < st && !restarted) {
-                                assert(0);
-                                it = popkcel_rbtBegin(psr->nodePieceSend);
-                                restarted = 1;
-                            }
+                        for (uint32_t i = 0; i <= len; i++) {
+                            struct Popkcel_PsrPacket *rps = psrPacketAt(psr, st + i);
+                            if (rps)
+                                psrAcked(psr, rps);
                         }
-                        psrCheckUnsent(psr);
+                        acked = 1;
                     } break;
                     case POPKCEL_PF_TRANSFORM | POPKCEL_PF_REPLY | POPKCEL_PF_SINGLE: {
                         if ((uintptr_t)rv < ul + 5)
@@ -503,24 +1794,39 @@ restart:;
                         do {
                             memcpy(&ul2, sock->psrBuffer + ul, 4);
                             ul2 = le32toh(ul2);
-                            struct Popkcel_RbtnodePsrSend *it = (struct Popkcel_RbtnodePsrSend *)popkcel_rbtFind(psr->nodePieceSend, ul2);
-                            if (it) {
-                                if (psr->lastMyConfirmedSendId < it->key
-                                    || (psr->lastMyConfirmedSendId >= UINT32_MAX - psr->window && it->key <= psr->window)) {
-                                    assert(psr->lastMyConfirmedSendId < UINT32_MAX - psr->window);
-                                    psr->lastMyConfirmedSendId = (uint32_t)it->key;
-                                }
-                                popkcel_stopTimer(&it->timer);
-                                popkcel_rbtDelete(&psr->nodePieceSend, (struct Popkcel_Rbtnode *)it);
-                                if (it->pending == 0)
-                                    free(it);
-                                else
-                                    it->pending = 2;
-                            }
+                            struct Popkcel_PsrPacket *rps = psrPacketAt(psr, ul2);
+                            if (rps)
+                                psrAcked(psr, rps);
                             count--;
                             ul += 4;
                         } while (count);
-                        psrCheckUnsent(psr);
+                        acked = 1;
+                    } break;
+                    case POPKCEL_PF_TRANSFORM | POPKCEL_PF_CONFIRM: {
+                        if (psr->version < 2 || (uintptr_t)rv < ul + 4)
+                            GOTOEND;
+                        // 重传的旧包不能覆盖更新的设置
+                        if (hasData && (int32_t)(dataId - psr->ackFreqId) > 0) {
+                            psr->ackFreqId = dataId;
+                            memcpy(&us, sock->psrBuffer + ul, 2);
+                            psr->ackEvery = le16toh(us);
+                            memcpy(&us, sock->psrBuffer + ul + 2, 2);
+                            psr->ackDelay = le16toh(us);
+                        }
+                        ul += 4;
+                    } break;
+                    case POPKCEL_PF_TRANSFORM | POPKCEL_PF_CONFIRM | POPKCEL_PF_SINGLE: {
+                        // 不可靠的数据报：[长度2][数据]，没有序号，不需要确认
+                        if (psr->version < 3 || (uintptr_t)rv < ul + 2)
+                            GOTOEND;
+                        memcpy(&us, sock->psrBuffer + ul, 2);
+                        us = le16toh(us);
+                        ul += 2;
+                        if (!us || ul + us > (uintptr_t)rv)
+                            GOTOEND;
+                        ul += us;
+                        if (psrCallback(psr, POPKCEL_PSRSTREAM_DATAGRAM, sock->psrBuffer + ul - us, us))
+                            goto end;
                     } break;
                     case POPKCEL_PF_CLOSED:
                         psrError(psr);
@@ -534,6 +1840,10 @@ restart:;
                     flag = sock->psrBuffer[ul];
                     ul++;
                 } while (ul < (uintptr_t)rv);
+                if (acked)
+                    psrAckReceived(psr);
+                if (psr->ackNow && psr->state == POPKCEL_PS_TRANSFER)
+                    psrFlushNow(psr);
             }
             else if (flag == POPKCEL_PF_CLOSED) {
                 if (rv != 5)
@@ -543,8 +1853,21 @@ restart:;
                 psrError(psr);
             }
         }
+        else if (flag == (POPKCEL_PF_SYN | POPKCEL_PF_CONFIRM) && sock->listenCb && (rv == 11 || rv == 12) && psrCheckCookie(sock)) {
+            // 对方带回了sock->synCookies时发出的cookie，到这里才创建连接
+            memcpy(sock->tranId, sock->psrBuffer + 1, 4);
+            memcpy(&us, sock->psrBuffer + 9, 2);
+            createNewConnection(sock, us, rv == 12 ? lowerVersion(sock, sock->psrBuffer[11]) : 0, NULL, 0);
+        }
     }
 end:;
+#ifdef POPKCEL_PSRMMSG
+    if (sock->psrBatch) {
+        rv = psrBatchRecv(sock);
+        if (rv != POPKCEL_WOULDBLOCK)
+            goto restart;
+    }
+#endif
     rv = popkcel_tryRecvfrom((struct Popkcel_Socket *)sock, sock->psrBuffer, POPKCEL_MAXUDPSIZE, (struct sockaddr *)&sock->remoteAddr, &sock->remoteAddrLen, &psrRecvFromCb, sock);
     if (rv != POPKCEL_WOULDBLOCK)
         goto restart;
@@ -558,42 +1881,22 @@ static int psrKlTimerCb(void *data, intptr_t rv)
         int64_t nt = popkcel_getCurrentTime();
         if (nt - sock->lastSendTime > 15000) {
             sock->lastSendTime = nt;
-            if (!sock->ipv6) {
-                popkcel_trySendto((struct Popkcel_Socket *)sock, (char *)sock, 1, (struct sockaddr *)&popkcel_globalVar.tempAddr, sizeof(struct sockaddr_in), NULL, NULL);
-            }
-            else {
-                popkcel_trySendto((struct Popkcel_Socket *)sock, (char *)sock, 1, (struct sockaddr *)&popkcel_globalVar.tempAddr6, sizeof(struct sockaddr_in6), NULL, NULL);
-            }
+            struct Popkcel_PsrPacket *rps = psrPacketAlloc(sock);
+            rps->psr = NULL;
+            rps->buffer[0] = 0;
+            rps->bufLen = 1;
+            int r;
+            if (!sock->ipv6)
+                r = psrSockSend(sock, rps, (struct sockaddr *)&popkcel_globalVar.tempAddr, sizeof(struct sockaddr_in));
+            else
+                r = psrSockSend(sock, rps, (struct sockaddr *)&popkcel_globalVar.tempAddr6, sizeof(struct sockaddr_in6));
+            if (r == POPKCEL_ERROR)
+                psrPacketFree(rps);
         }
     }
     return 0;
 }
 
-struct LbSingle
-{
-    uint32_t ids[255];
-    uint32_t pos;
-};
-
-static int addSingle(struct LbSingle **ids, int *pbufLen, size_t pos, uint32_t id)
-{
-    if (!*ids) {
-        *ids = malloc(sizeof(struct LbSingle));
-        (*ids)->pos = 0;
-        *pbufLen -= 2;
-    }
-
-    if (*pbufLen - pos >= 4) {
-        (*ids)->ids[(*ids)->pos] = htole32(id);
-        (*ids)->pos++;
-        *pbufLen -= 4;
-        if ((*ids)->pos < 255)
-            return 0;
-    }
-
-    return 1;
-}
-
 static void addRange(uint32_t sid, uint32_t lid, char *buf, int *pos)
 {
     buf[*pos] = (POPKCEL_PF_REPLY | POPKCEL_PF_TRANSFORM);
@@ -604,344 +1907,482 @@ static void addRange(uint32_t sid, uint32_t lid, char *buf, int *pos)
     ul = htole32(lid);
     memcpy(buf + *pos, &ul, 4);
     *pos += 4;
-}
-
-static int makeReplyBuffer(struct Popkcel_PsrField *psr, char *buf, int bufLen)
-{
-    int pos = 0;
-    struct LbSingle *ids = NULL;
-    int64_t sid = -1, lid;
-    struct Popkcel_Rbtnode *it = popkcel_rbtBegin(psr->nodeReply);
-    while (it) {
-        if (sid >= 0) {
-            if (it->key == lid + 1) {
-                lid++;
-                struct Popkcel_Rbtnode *oit = it;
-                it = popkcel_rbtNext(it);
-                popkcel_rbtDelete(&psr->nodeReply, oit);
-                free(oit);
-                continue;
-            }
-            else if (sid == lid) {
-                if (addSingle(&ids, &bufLen, pos, (uint32_t)sid))
-                    break;
-            }
-            else {
-                addRange((uint32_t)sid, (uint32_t)lid, buf, &pos);
-            }
-        }
-
-        int remain = bufLen - pos;
-        if (remain < 4)
-            break;
-        else if (remain < 9) {
-            if (remain < 6 && !ids)
-                break;
-            addSingle(&ids, &bufLen, pos, (uint32_t)it->key);
-            popkcel_rbtDelete(&psr->nodeReply, it);
-            free(it);
-            break;
-        }
-        else {
-            sid = lid = it->key;
-            struct Popkcel_Rbtnode *oit = it;
-            it = popkcel_rbtNext(it);
-            popkcel_rbtDelete(&psr->nodeReply, oit);
-            free(oit);
-        }
-    }
+}
 
-    if (sid >= 0 && !it) { // 遍历完成
-        if (sid == lid) {
-            if (!ids) { // 最常见的情况，所以单独写一下
-                buf[pos] = (POPKCEL_PF_REPLY | POPKCEL_PF_TRANSFORM | POPKCEL_PF_SINGLE);
-                pos++;
-                buf[pos] = 1;
-                pos++;
-                uint32_t ul = htole32((uint32_t)sid);
-                memcpy(buf + pos, &ul, 4);
-                pos += 4;
-            }
-            else
-                addSingle(&ids, &bufLen, pos, (uint32_t)sid);
+// 从ackBase开始把连续的序号写成区间确认，单独的序号合并成一个单个确认，buf放不下的留到下次
+static int makeReplyBuffer(struct Popkcel_PsrField *psr, char *buf, int bufLen)
+{
+    int pos = 0;
+    uint32_t ids[255];
+    int count = 0;
+    // 单个确认占用的长度，包括2字节的头
+    int singleLen = 0;
+    while (psr->ackCount) {
+        uint32_t sid = ackScan(psr, psr->ackBase, psr->ackEnd, 1);
+        uint32_t e = ackScan(psr, sid, psr->ackEnd, 0);
+        int remain = bufLen - pos - singleLen;
+        int need = count ? 4 : 6;
+        if (e - sid > 1 && remain >= 9) {
+            addRange(sid, e - 1, buf, &pos);
+            ackClear(psr, sid, e);
+        }
+        else if (remain >= need && count < 255) {
+            // 区间放不下时，也尽量把第一个序号放进单个确认
+            ids[count++] = htole32(sid);
+            singleLen += need;
+            e = sid + 1;
+            ackClear(psr, sid, e);
         }
         else
-            addRange((uint32_t)sid, (uint32_t)lid, buf, &pos);
+            break;
+        psr->ackBase = e;
     }
+    if (!psr->ackCount)
+        psr->ackRecvCount = 0;
 
-    if (ids) {
+    if (count) {
         buf[pos] = (POPKCEL_PF_REPLY | POPKCEL_PF_TRANSFORM | POPKCEL_PF_SINGLE);
         pos++;
-        buf[pos] = (unsigned char)pos;
+        buf[pos] = (unsigned char)count;
         pos++;
-        memcpy(buf + pos, ids->ids, 4 * ids->pos);
-        pos += 4 * ids->pos;
-        free(ids);
+        memcpy(buf + pos, ids, 4 * count);
+        pos += 4 * count;
     }
     return pos;
 }
 
-static int rpsSend(struct Popkcel_RbtnodePsrSend *rps)
+static int rpsSend(struct Popkcel_PsrPacket *rps)
 {
-    rps->pending = 0;
-    ssize_t r = popkcel_trySendto((struct Popkcel_Socket *)rps->psr->sock, rps->buffer, rps->bufLen, (struct sockaddr *)&rps->psr->remoteAddr, rps->psr->addrLen, &sendCb, rps);
+    struct Popkcel_PsrField *psr = rps->psr;
+    rps->sendSeq = ++psr->sendSeq;
+    rps->ackSkip = 0;
+    // sendRing中的包移到发送顺序链表的末尾，握手包不在其中
+    if (psr->sendRing && psr->sendRing[rps->id & psr->sendRingMask] == rps) {
+        psrSentUnlink(psr, rps);
+        rps->sentPrev = psr->sentTail;
+        if (psr->sentTail)
+            psr->sentTail->sentNext = rps;
+        else
+            psr->sentHead = rps;
+        psr->sentTail = rps;
+    }
+    if (psrSockSend(psr->sock, rps, (struct sockaddr *)&psr->remoteAddr, psr->addrLen) == POPKCEL_ERROR) {
+        psrError(psr);
+        return POPKCEL_ERROR;
+    }
+    // 排队等待发送的包也当作已经发出，重传和RTT都从现在算起
+    psr->sock->lastSendTime = popkcel_getCurrentTime();
+    if (!rps->sendCount)
+        rps->sendTime = psr->sock->lastSendTime;
+    rps->sendCount++;
+    rps->resendTime = psr->sock->lastSendTime + rpsTimeout(rps);
+    psrArmTimer(psr, rps->resendTime);
+    return (int)rps->bufLen;
+}
 
-    if (r == POPKCEL_ERROR) {
-        popkcel_stopTimer(&rps->timer);
-        psrError(rps->psr);
+// rps到了重传时间，返回POPKCEL_ERROR表示psr已出错
+static int psrRetransmit(struct Popkcel_PsrField *psr, struct Popkcel_PsrPacket *rps)
+{
+    if (rps->sendCount >= psr->maxSendCount) {
+        psrError(psr);
+        return POPKCEL_ERROR;
     }
-    else if (r >= 0) {
-        rps->psr->sock->lastSendTime = popkcel_getCurrentTime();
-        rps->sendCount++;
+    if (psr->state == POPKCEL_PS_TRANSFER && (int32_t)(rps->id - psr->recoverSendId) >= 0) {
+        psr->recoverSendId = psr->mySendId;
+        psr->congestion->onLoss(psr, rps, 1);
     }
-    else if (r == POPKCEL_WOULDBLOCK)
-        rps->pending = 1;
-    return (int)r;
+    return rpsSend(rps) == POPKCEL_ERROR ? POPKCEL_ERROR : POPKCEL_OK;
 }
 
-static int sendCb(void *data, intptr_t rv)
+static int psrHasBuffers(struct Popkcel_PsrField *psr)
 {
-    struct Popkcel_RbtnodePsrSend *rps = data;
-    if (rps->pending == 2) {
-        assert(rps->timer.iter.isRed == 2);
-        free(rps);
+    if (psr->sendRing || psr->recvOrder.ring || psr->ackBits)
         return 1;
+    for (uint32_t i = 0; psr->streams && i < psr->maxStreams; i++) {
+        if (psr->streams[i].reorder.ring)
+            return 1;
     }
-    rps->pending = 0;
+    return 0;
+}
 
-    if (rv == POPKCEL_ERROR) {
-        popkcel_stopTimer(&rps->timer);
-        psrError(rps->psr);
+// 连接空闲时释放空的队列和位图，再次用到时重新分配，这样空闲的连接只占用psrField本身
+static void psrTrim(struct Popkcel_PsrField *psr)
+{
+    if (psr->sendRing && psr->sendBase == psr->unsentId) {
+        free(psr->sendRing);
+        psr->sendRing = NULL;
     }
-    else {
-        rps->psr->sock->lastSendTime = popkcel_getCurrentTime();
-        rps->sendCount++;
-        if (rps->sendCount == 1) {
-            popkcel_setTimer(&rps->timer, 5000, 5000);
-            if (rps->callback)
-                rps->callback(rps->userData, POPKCEL_OK);
-        }
+    if (!psr->recvOrder.count)
+        reorderFree(&psr->recvOrder);
+    for (uint32_t i = 0; psr->streams && i < psr->maxStreams; i++) {
+        if (!psr->streams[i].reorder.count)
+            reorderFree(&psr->streams[i].reorder);
+    }
+    if (psr->ackBits && !psr->ackCount) {
+        free(psr->ackBits);
+        psr->ackBits = NULL;
     }
-    return 0;
 }
 
-// 5000毫秒一次重传
+/* 先发送到了时间的buffer和确认，再处理重传超时和尾包探测。检查所有已发送的包，重传到了时间的包，然后按最早的到期时间重新设置timer。
+ * 尾包探测是一段时间没收到确认，就重发最后发出的包，让对方的确认带出前面丢失的包，避免等待rto。
+ * 没有别的事情要做时开始空闲计时，POPKCEL_PSRIDLEFREE毫秒后释放空的队列。
+ */
 static int psrTimerCb(void *data, intptr_t rv)
 {
-    struct Popkcel_RbtnodePsrSend *rps = data;
-    struct Popkcel_PsrField *psr = rps->psr;
-    if (rps->sendCount >= 3) {
-        psrError(psr);
-        return 1;
+    struct Popkcel_PsrField *psr = data;
+    int64_t now = popkcel_getCurrentTime();
+    int64_t next = 0;
+    psr->timerAt = 0;
+
+    if (psr->flushAt && psr->flushAt <= now) {
+        psr->flushAt = 0;
+        if (psrFlush(psr) == POPKCEL_ERROR)
+            return 1;
+    }
+    else if (psr->flushAt)
+        next = psr->flushAt;
+
+    struct Popkcel_PsrPacket *rps = psr->synPacket;
+    if (rps && !rps->pending) {
+        if (rps->resendTime <= now) {
+            // 版本4之前的服务端只接受8个字节的SYN，重传时不再带第一个包。对方收到过带数据的SYN的话，SYN|REPLY中仍会说明接受了
+            if (rps->bufLen > 8 && (unsigned char)rps->buffer[0] == (POPKCEL_PF_SYN | POPKCEL_PF_APT))
+                rps->bufLen = 8;
+            if (psrRetransmit(psr, rps) == POPKCEL_ERROR)
+                return 1;
+        }
+        if (!next || rps->resendTime < next)
+            next = rps->resendTime;
+    }
+
+    uint32_t n = psrRingCount(psr);
+    for (uint32_t i = 0; i < n; i++) {
+        rps = psr->sendRing[(psr->sendBase + i) & psr->sendRingMask];
+        if (!rps || rps->sendCount <= 0 || rps->pending)
+            continue;
+        if (rps->resendTime <= now) {
+            if (psrRetransmit(psr, rps) == POPKCEL_ERROR)
+                return 1;
+            if (rps->pending)
+                continue;
+        }
+        if (!next || rps->resendTime < next)
+            next = rps->resendTime;
+    }
+
+    if (psr->probeAt && psr->probeAt <= now) {
+        psr->probeAt = 0;
+        rps = psrPacketAt(psr, psr->lastSentId);
+        if (rps && rps->sendCount > 0 && !rps->pending && rps->sendCount < psr->maxSendCount) {
+            if (rpsSend(rps) == POPKCEL_ERROR)
+                return 1;
+        }
     }
+    else if (psr->probeAt && (!next || psr->probeAt < next))
+        next = psr->probeAt;
+
+    if (next)
+        psrArmTimer(psr, next);
+    if (psr->paceAt && psr->paceAt <= now) {
+        psr->paceAt = 0;
+        psrCheckUnsent(psr);
+    }
+    else if (psr->paceAt)
+        psrArmTimer(psr, psr->paceAt);
 
-    rpsSend(rps);
+    if (!psr->timerAt && psrHasBuffers(psr)) {
+        if (!psr->idleAt) {
+            psr->idleAt = psr->timerAt = now + POPKCEL_PSRIDLEFREE;
+            popkcel_setTimer(&psr->timer, POPKCEL_PSRIDLEFREE, 0);
+        }
+        else if (psr->idleAt <= now) {
+            psr->idleAt = 0;
+            psrTrim(psr);
+        }
+    }
     return 0;
 }
 
 static int psrSendBuffer(struct Popkcel_PsrField *psr, Popkcel_FuncCallback cb, void *data, int cs)
 {
     assert(psr->bufferPos);
-    uint32_t ul = bufChecksum(psr->tranId, psr->buffer + 5, psr->bufferPos - 5);
-    memcpy(psr->buffer + 1, &ul, 4);
+    struct Popkcel_PsrPacket *rps = psr->bufferPacket;
+    // 确认频率设置跟着数据包发送，这样丢失时会随数据包一起重传
+    if (psr->peerAckPending && psr->bufferPos + 5 <= POPKCEL_MAXUDPSIZE) {
+        rps->buffer[psr->bufferPos] = POPKCEL_PF_TRANSFORM | POPKCEL_PF_CONFIRM;
+        uint16_t us = htole16(psr->peerAckEvery);
+        memcpy(rps->buffer + psr->bufferPos + 1, &us, 2);
+        us = htole16(psr->peerAckDelay);
+        memcpy(rps->buffer + psr->bufferPos + 3, &us, 2);
+        psr->bufferPos += 5;
+        psr->peerAckPending = 0;
+    }
+    uint32_t ul = bufChecksum(psr, rps->buffer + 5, psr->bufferPos - 5);
+    memcpy(rps->buffer + 1, &ul, 4);
 
-    struct Popkcel_RbtnodePsrSend *rps = malloc(sizeof(struct Popkcel_RbtnodePsrSend) + psr->bufferPos);
     rps->bufLen = psr->bufferPos;
-    memcpy(rps->buffer, psr->buffer, psr->bufferPos);
+    psr->bufferPacket = NULL;
     psr->bufferPos = 0;
     rps->psr = psr;
-    rps->key = psr->mySendId;
-    rps->timer.cbData = rps;
-    rps->timer.funcCb = &psrTimerCb;
-    popkcel_rbtMultiInsert(&psr->nodePieceSend, (struct Popkcel_Rbtnode *)rps);
-    popkcel_initTimer(&rps->timer, psr->sock->loop);
+    rps->id = psr->mySendId;
     psr->mySendId++;
     rps->userData = data;
     rps->callback = cb;
     rps->sendCount = 0;
 
     if (!cs) {
-        rps->sendCount = -1;
+        psrDeferPush(psr, rps);
         return POPKCEL_WOULDBLOCK;
     }
-    else {
-        int r = rpsSend(rps);
-        if (r == POPKCEL_ERROR) {
-            free(rps);
-            psrError(psr);
-            return POPKCEL_ERROR;
-        }
+    else
+        return psrSendNew(psr, rps); // 出错时rpsSend已经调用了psrError
+}
 
-        if (r >= 0) {
-            popkcel_setTimer(&rps->timer, 5000, 5000);
+// 发送SYN。zeroRtt时把第一个包复制到SYN的后面，复制的包序号为0，按版本4使用的CRC32C计算校验和
+static int psrSendConnect(struct Popkcel_PsrField *psr)
+{
+    struct Popkcel_PsrSocket *sock = psr->sock;
+    struct Popkcel_PsrPacket *first = NULL;
+    if (psr->zeroRtt && sockVersion(sock) >= 4) {
+        if (!psr->deferHead && psr->bufferPos) {
+            uint16_t us = htole16(psr->bufferPos - 11);
+            memcpy(psr->bufferPacket->buffer + 9, &us, 2);
+            psrSendBuffer(psr, psr->lastSendCallback, psr->lastSendUserData, 0);
+            psr->lastSendCallback = NULL;
         }
-        return r;
+        first = psr->deferHead;
+        if (first && (first->bufLen + 8 > POPKCEL_MAXUDPSIZE || (unsigned char)first->buffer[0] != (POPKCEL_PF_TRANSFORM | POPKCEL_PF_APT)))
+            first = NULL;
+    }
+
+    struct Popkcel_PsrPacket *rps = psrPacketAlloc(sock);
+    rps->bufLen = 8;
+    rps->buffer[0] = (unsigned char)(POPKCEL_PF_SYN | POPKCEL_PF_APT);
+    rps->buffer[1] = sockVersion(sock);
+    memcpy(rps->buffer + 2, psr->tranId, 4);
+    uint16_t wnd = htole16(psr->window);
+    memcpy(rps->buffer + 6, &wnd, 2);
+    if (first) {
+        char *p = rps->buffer + 8;
+        memcpy(p, first->buffer, first->bufLen);
+        memset(p + 5, 0, 4);
+        char m = psr->checksumMode;
+        psr->checksumMode = POPKCEL_PSRCHECKSUM_CRC32C;
+        uint32_t ul = bufChecksum(psr, p + 5, first->bufLen - 5);
+        psr->checksumMode = m;
+        memcpy(p + 1, &ul, 4);
+        rps->bufLen += first->bufLen;
+        psr->earlyData = 1;
+    }
+    if (psrSendSyn(rps, psr) == POPKCEL_ERROR) {
+        psrPacketFree(rps);
+        return POPKCEL_ERROR;
     }
+    if (first && first->callback) {
+        // 第一个包已经随SYN发出，对方不接受而要再发时不再调用callback
+        Popkcel_FuncCallback cb = first->callback;
+        first->callback = NULL;
+        cb(first->userData, POPKCEL_OK);
+    }
+    return POPKCEL_OK;
 }
 
-// 每10毫秒发送一次的timer cb，用于合并短的发送包
-static int cbPsrTimerSend(void *data, intptr_t rv)
+// 发送buffer中缓存的数据和需要回复的确认，用于合并短的发送包。出错时调用psrError并返回POPKCEL_ERROR
+static int psrFlush(struct Popkcel_PsrField *psr)
 {
-    struct Popkcel_PsrField *psr = data;
+    if (psr->state == POPKCEL_PS_CONNECTING) {
+        // zeroRtt时popkcel_psrTryConnect推迟到这里才发送SYN
+        if (!psr->synPacket && psrSendConnect(psr) == POPKCEL_ERROR) {
+            psrError(psr);
+            return POPKCEL_ERROR;
+        }
+        return POPKCEL_OK;
+    }
     do {
-        char replyOnly;
-        if (psr->bufferPos) {
+        if (psr->bufferPos && !psr->corked) {
             uint16_t us = htole16(psr->bufferPos - 11);
-            memcpy(psr->buffer + 9, &us, 2);
-            replyOnly = 0;
-        }
-        else
-            replyOnly = 1;
-
-        if (psr->nodeReply && psr->bufferPos <= POPKCEL_MAXUDPSIZE - 9) {
-            if (psr->bufferPos == 0) {
-                int a = makeReplyBuffer(psr, psr->buffer + 4, POPKCEL_MAXUDPSIZE - 4);
-                psr->bufferPos = a + 4;
-                psr->buffer[0] = (psr->buffer[4] | POPKCEL_PF_APT);
-            }
-            else {
-                int a = makeReplyBuffer(psr, psr->buffer + psr->bufferPos, POPKCEL_MAXUDPSIZE - psr->bufferPos);
+            memcpy(psr->bufferPacket->buffer + 9, &us, 2);
+            if (psr->ackCount && psr->bufferPos <= POPKCEL_MAXUDPSIZE - 9) {
+                int a = makeReplyBuffer(psr, psr->bufferPacket->buffer + psr->bufferPos, POPKCEL_MAXUDPSIZE - psr->bufferPos);
                 psr->bufferPos += a;
             }
+            if (psrSendBuffer(psr, psr->lastSendCallback, psr->lastSendUserData, canSendNew(psr)) == POPKCEL_ERROR)
+                return POPKCEL_ERROR;
         }
-
-        if (replyOnly) {
-            if (!psr->bufferPos)
+        else if (psr->ackCount) {
+            // 只有确认的包，第一个记录的flag放在包头中。buffer被cork时也用这个单独的包
+            struct Popkcel_PsrPacket *rps = psrPacketAlloc(psr->sock);
+            char *buf = rps->buffer;
+            int a = makeReplyBuffer(psr, buf + 4, POPKCEL_MAXUDPSIZE - 4);
+            if (!a) {
+                psrPacketFree(rps);
                 break;
-            uint32_t ul = bufChecksum(psr->tranId, psr->buffer + 5, psr->bufferPos - 5);
-            memcpy(psr->buffer + 1, &ul, 4);
-
-            ssize_t r = popkcel_trySendto((struct Popkcel_Socket *)psr->sock, psr->buffer, psr->bufferPos, (struct sockaddr *)&psr->remoteAddr, psr->addrLen, NULL, NULL);
-            psr->sock->lastSendTime = popkcel_getCurrentTime();
-            if (r == POPKCEL_ERROR) {
-                psrError(psr);
-                return 1;
             }
+            buf[0] = (buf[4] | POPKCEL_PF_APT);
+            uint32_t ul = bufChecksum(psr, buf + 5, a - 1);
+            memcpy(buf + 1, &ul, 4);
+            rps->bufLen = a + 4;
 
-            psr->bufferPos = 0;
-        }
-        else {
-            if (psrSendBuffer(psr, psr->lastSendCallback, psr->lastSendUserData, 1) == POPKCEL_ERROR) {
-                return 1;
+            if (psrSendOnce(psr, rps) == POPKCEL_ERROR) {
+                psrError(psr);
+                return POPKCEL_ERROR;
             }
         }
-    } while (psr->nodeReply);
-    psr->timerStarted = 0;
-    return 1;
+        else
+            break;
+    } while (psr->ackCount);
+    return POPKCEL_OK;
 }
 
 int popkcel_psrTryConnect(struct Popkcel_PsrField *psr)
 {
     if (psr->state != POPKCEL_PS_INIT)
         return POPKCEL_ERROR;
-    int64_t h = ipPortHash((struct sockaddr *)&psr->remoteAddr);
-    struct Popkcel_RbtnodeData *it;
-    struct Popkcel_RbtInsertPos ipos;
-    if (psr->sock->ipv6) {
-        it = (struct Popkcel_RbtnodeData *)popkcel_rbtFind(psr->sock->nodePf, h);
-        if (it) {
-            do {
-                struct Popkcel_PsrField *pf2 = it->value;
-                if (!memcmp(&pf2->remoteAddr.sin6_addr, &psr->remoteAddr.sin6_addr, sizeof(psr->remoteAddr.sin6_addr)))
-                    return POPKCEL_ERROR;
-                it = (struct Popkcel_RbtnodeData *)popkcel_rbtNext((struct Popkcel_Rbtnode *)it);
-            } while (it && it->key == h);
-        }
-    }
-    else {
-        ipos = popkcel_rbtInsertPos(&psr->sock->nodePf, h);
-        if (!ipos.ipos)
-            return POPKCEL_ERROR;
-    }
-
-    struct Popkcel_RbtnodePsrSend *rps = malloc(sizeof(struct Popkcel_RbtnodePsrSend) + 8);
-    rps->key = 0;
-    rps->bufLen = 8;
+    if (pfTableFind(&psr->sock->pfTable, (struct sockaddr *)&psr->remoteAddr))
+        return POPKCEL_ERROR;
 
     uint32_t rnd = popkcel__rand();
     memcpy(psr->tranId, &rnd, 4);
-    rps->buffer[0] = (unsigned char)(POPKCEL_PF_SYN | POPKCEL_PF_APT);
-    rps->buffer[1] = POPKCEL_PSRVERSION;
-    memcpy(rps->buffer + 2, &rnd, 4);
-    uint16_t wnd = htole16(psr->window);
-    memcpy(rps->buffer + 6, &wnd, 2);
-    if (rpsInit(rps, psr) == POPKCEL_ERROR) {
-        free(rps);
-        return POPKCEL_ERROR;
+    // zeroRtt时SYN等到本轮事件结束再发，这样接下来psrTrySend的数据可以放进SYN中
+    if (!psr->zeroRtt || sockVersion(psr->sock) < 4) {
+        if (psrSendConnect(psr) == POPKCEL_ERROR)
+            return POPKCEL_ERROR;
     }
+    else
+        psrArmFlush(psr, 0);
 
     psr->state = POPKCEL_PS_CONNECTING;
-    it = malloc(sizeof(struct Popkcel_RbtnodeData));
-    it->key = h;
-    it->value = psr;
-    if (psr->sock->ipv6)
-        popkcel_rbtMultiInsert(&psr->sock->nodePf, (struct Popkcel_Rbtnode *)it);
-    else
-        popkcel_rbtInsertAtPos(&psr->sock->nodePf, ipos, (struct Popkcel_Rbtnode *)it);
+    pfTableInsert(&psr->sock->pfTable, psr);
     return POPKCEL_WOULDBLOCK;
 }
 
 int popkcel_psrTrySend(struct Popkcel_PsrField *psr, const char *data, size_t len, Popkcel_FuncCallback callback, void *userData)
 {
-    // printf("psrTrySend %d\n", psr->state);
-    if (psr->state == POPKCEL_PS_CONNECTED) {
-        psr->state = POPKCEL_PS_TRANSFER;
-        psr->mySendId = 0;
-    }
-    else if (psr->state != POPKCEL_PS_TRANSFER)
-        return POPKCEL_ERROR;
-
-    if (len == 0)
-        return POPKCEL_OK;
+    return popkcel_psrTrySendStream(psr, 0, data, len, callback, userData);
+}
 
-    int cs = canSend(psr, psr->mySendId);
+// 把数据加到buffer中，满一个包就发送，最后一个包带上callback。*cs为能否立即发送，会被更新
+static int psrAppend(struct Popkcel_PsrField *psr, uint16_t stream, const char *data, size_t len, Popkcel_FuncCallback callback, void *userData, int *cs)
+{
     int r;
     for (;;) {
         if (!psr->bufferPos) {
-            psr->buffer[0] = (unsigned char)(POPKCEL_PF_TRANSFORM | POPKCEL_PF_APT);
+            // 数据直接写进将要发送的包中
+            psr->bufferPacket = psrPacketAlloc(psr->sock);
+            char *buf = psr->bufferPacket->buffer;
             uint32_t ul = htole32(psr->mySendId);
-            memcpy(psr->buffer + 5, &ul, 4);
-            psr->bufferPos = 11;
+            memcpy(buf + 5, &ul, 4);
+            psr->bufferStream = stream;
+            if (!stream) {
+                buf[0] = (unsigned char)(POPKCEL_PF_TRANSFORM | POPKCEL_PF_APT);
+                psr->bufferPos = 11;
+            }
+            else {
+                // 流中的数据在长度之后写上[流编号2][流内序号4]，长度包括这6个字节
+                buf[0] = (unsigned char)(POPKCEL_PF_TRANSFORM | POPKCEL_PF_SINGLE | POPKCEL_PF_APT);
+                uint16_t us = htole16(stream);
+                memcpy(buf + 11, &us, 2);
+                ul = stream == POPKCEL_PSRSTREAM_UNORDERED ? 0 : htole32(psr->streams[stream].sendSeq++);
+                memcpy(buf + 13, &ul, 4);
+                psr->bufferPos = 17;
+            }
         }
 
-        size_t rlen = POPKCEL_MAXUDPSIZE - psr->bufferPos;
+        // 要发送确认频率设置时给它留出位置
+        uint32_t limit = POPKCEL_MAXUDPSIZE;
+        // zeroRtt时第一个包要和SYN的8个字节放进同一个数据报
+        if (psr->zeroRtt && psr->state == POPKCEL_PS_CONNECTING && !psr->synPacket && !psr->deferHead)
+            limit -= 8;
+        if (psr->peerAckPending && psr->bufferPos < POPKCEL_MAXUDPSIZE - 5)
+            limit -= 5;
+        size_t rlen = limit - psr->bufferPos;
         if (rlen > len) {
-            memcpy(psr->buffer + psr->bufferPos, data, len);
+            memcpy(psr->bufferPacket->buffer + psr->bufferPos, data, len);
             psr->bufferPos += (uint32_t)len;
             r = (int)len;
-            if (!cs) {
+            if (!*cs) {
                 psr->lastSendCallback = callback;
                 psr->lastSendUserData = userData;
             }
             else {
                 psr->lastSendCallback = NULL;
-                if (!psr->timerStarted) {
-                    popkcel_setTimer(&psr->timer, 10, 0);
-                    psr->timerStarted = 1;
-                }
+                if (!psr->corked)
+                    psrArmFlush(psr, psr->sendDelay);
             }
-            break;
+            return r;
         }
         else {
-            memcpy(psr->buffer + psr->bufferPos, data, rlen);
-            uint32_t us = htole16(POPKCEL_MAXUDPSIZE - 11);
-            memcpy(psr->buffer + 9, &us, 2);
-            psr->bufferPos = POPKCEL_MAXUDPSIZE;
-            if (rlen == len) {
-                r = psrSendBuffer(psr, callback, userData, cs);
-                break;
-            }
+            memcpy(psr->bufferPacket->buffer + psr->bufferPos, data, rlen);
+            uint32_t us = htole16(limit - 11);
+            memcpy(psr->bufferPacket->buffer + 9, &us, 2);
+            psr->bufferPos = limit;
+            if (rlen == len)
+                return psrSendBuffer(psr, callback, userData, *cs);
             else
-                r = psrSendBuffer(psr, NULL, NULL, cs);
+                r = psrSendBuffer(psr, NULL, NULL, *cs);
 
             if (r == POPKCEL_ERROR)
                 return POPKCEL_ERROR;
             else if (r == POPKCEL_WOULDBLOCK)
-                cs = 0;
+                *cs = 0;
+            else
+                *cs = canSendNew(psr);
             len -= rlen;
             data += rlen;
         }
     }
+}
+
+int popkcel_psrTrySendStream(struct Popkcel_PsrField *psr, uint16_t stream, const char *data, size_t len, Popkcel_FuncCallback callback, void *userData)
+{
+    // printf("psrTrySend %d\n", psr->state);
+    if (psr->state == POPKCEL_PS_CONNECTED) {
+        psr->state = POPKCEL_PS_TRANSFER;
+        psr->mySendId = 0;
+    }
+    else if (psr->state == POPKCEL_PS_CONNECTING) {
+        // 连接建立前只缓存起来，这时还不知道协商出的版本，只能用流0
+        if (stream)
+            return POPKCEL_ERROR;
+    }
+    else if (psr->state != POPKCEL_PS_TRANSFER)
+        return POPKCEL_ERROR;
+    if (stream && (psr->version < 3 || (stream != POPKCEL_PSRSTREAM_UNORDERED && !psrGetStream(psr, stream))))
+        return POPKCEL_ERROR;
+
+    if (len == 0)
+        return POPKCEL_OK;
+
+    // 消息加上长度后放得下一个新包时，不要把它拆开
+    int whole = 0;
+    if (psr->messageMode) {
+        whole = len + 4 <= POPKCEL_MAXUDPSIZE - 5 - (stream ? 17 : 11);
+        if (len > psr->maxMessage || (stream == POPKCEL_PSRSTREAM_UNORDERED && !whole))
+            return POPKCEL_ERROR;
+    }
+
+    int cs = canSendNew(psr);
+    int r;
+    if (psr->bufferPos && (psr->bufferStream != stream || (whole && psr->bufferPos + len + 4 > POPKCEL_MAXUDPSIZE - 5))) {
+        // buffer中是别的流的数据，或者放不下这个消息，先把它发出去
+        uint16_t us = htole16(psr->bufferPos - 11);
+        memcpy(psr->bufferPacket->buffer + 9, &us, 2);
+        r = psrSendBuffer(psr, psr->lastSendCallback, psr->lastSendUserData, cs);
+        psr->lastSendCallback = NULL;
+        if (r == POPKCEL_ERROR)
+            return POPKCEL_ERROR;
+        else if (r == POPKCEL_WOULDBLOCK)
+            cs = 0;
+        else
+            cs = canSendNew(psr);
+    }
+    if (psr->messageMode) {
+        uint32_t ml = htole32((uint32_t)len);
+        if (psrAppend(psr, stream, (const char *)&ml, 4, NULL, NULL, &cs) == POPKCEL_ERROR)
+            return POPKCEL_ERROR;
+    }
+    r = psrAppend(psr, stream, data, len, callback, userData, &cs);
 
     if (r == POPKCEL_ERROR)
         return POPKCEL_ERROR;
@@ -957,23 +2398,66 @@ int popkcel_psrSendCache(struct Popkcel_PsrField *psr)
 {
     if (psr->bufferPos) {
         uint16_t us = htole16(psr->bufferPos - 11);
-        memcpy(psr->buffer + 9, &us, 2);
-        uint32_t ul = bufChecksum(psr->tranId, psr->buffer + 5, psr->bufferPos - 5);
-        memcpy(psr->buffer + 1, &ul, 4);
-        int r = (int)popkcel_trySendto((struct Popkcel_Socket *)psr->sock, psr->buffer, psr->bufferPos, (struct sockaddr *)&psr->remoteAddr, psr->addrLen, NULL, NULL);
-        psr->bufferPos = 0;
-        return r;
+        memcpy(psr->bufferPacket->buffer + 9, &us, 2);
+        uint32_t len = psr->bufferPos - (psr->bufferStream ? 17 : 11);
+        int r = psrSendBuffer(psr, psr->lastSendCallback, psr->lastSendUserData, canSendNew(psr));
+        if (r < 0)
+            return r;
+        return (int)len;
     }
     else
         return POPKCEL_OK;
 }
 
+int popkcel_psrSendDatagram(struct Popkcel_PsrField *psr, const char *data, size_t len)
+{
+    if (psr->state == POPKCEL_PS_CONNECTED) {
+        psr->state = POPKCEL_PS_TRANSFER;
+        psr->mySendId = 0;
+    }
+    else if (psr->state != POPKCEL_PS_TRANSFER)
+        return POPKCEL_ERROR;
+    if (psr->version < 3 || len == 0 || len > POPKCEL_MAXUDPSIZE - 7)
+        return POPKCEL_ERROR;
+
+    struct Popkcel_PsrPacket *rps = psrPacketAlloc(psr->sock);
+    char *buf = rps->buffer;
+    buf[0] = (unsigned char)(POPKCEL_PF_TRANSFORM | POPKCEL_PF_CONFIRM | POPKCEL_PF_SINGLE | POPKCEL_PF_APT);
+    uint16_t us = htole16((uint16_t)len);
+    memcpy(buf + 5, &us, 2);
+    memcpy(buf + 7, data, len);
+    uint32_t ul = bufChecksum(psr, buf + 5, (int)len + 2);
+    memcpy(buf + 1, &ul, 4);
+    rps->bufLen = len + 7;
+    if (psrSendOnce(psr, rps) == POPKCEL_ERROR) {
+        psrError(psr);
+        return POPKCEL_ERROR;
+    }
+    return (int)len;
+}
+
+void popkcel_psrCork(struct Popkcel_PsrField *psr)
+{
+    psr->corked = 1;
+}
+
+int popkcel_psrUncork(struct Popkcel_PsrField *psr)
+{
+    psr->corked = 0;
+    if (psr->state != POPKCEL_PS_TRANSFER)
+        return POPKCEL_OK;
+    if (psr->bufferPos || psr->ackCount)
+        psrFlushNow(psr);
+    return psr->state == POPKCEL_PS_TRANSFER ? POPKCEL_OK : POPKCEL_ERROR;
+}
+
 void popkcel_psrAcceptOne(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrField *psr, Popkcel_PsrFuncCallback cbFunc)
 {
     popkcel_initPsrField(sock, psr, cbFunc);
     psr->state = POPKCEL_PS_CONNECTED;
     memcpy(psr->tranId, sock->tranId, 4);
     psr->window = sock->psrWindow;
+    psrSetVersion(psr, sock->psrVersion);
     memcpy(&psr->remoteAddr, &sock->remoteAddr, sock->remoteAddrLen);
     psr->addrLen = sock->remoteAddrLen;
 }
@@ -996,7 +2480,28 @@ int popkcel_initPsrSocket(struct Popkcel_PsrSocket *sock, struct Popkcel_Loop *l
     sock->listenCb = listenCb;
     sock->recvCb = recvCb;
     sock->maxWindow = maxWindow;
-    sock->nodePf = NULL;
+    sock->checksumMode = POPKCEL_PSRCHECKSUM_CRC32C;
+    crcInitOnce();
+    memset(&sock->pfTable, 0, sizeof(sock->pfTable));
+    sock->freePackets = NULL;
+    sock->packetSlabs = NULL;
+    sock->sendBatch = NULL;
+    sock->recvBatch = NULL;
+    sock->sendQueue = NULL;
+    sock->sendQueueHead = sock->sendQueueCount = sock->sendQueueMask = 0;
+    sock->sendBatchCount = sock->recvBatchPos = sock->recvBatchCount = 0;
+    sock->psrBatch = 1;
+    sock->gsoOff = 0;
+    sock->timerBatch.funcCb = NULL;
+#ifdef POPKCEL_PSRMMSG
+    sock->timerBatch.funcCb = &psrBatchTimerCb;
+#endif
+    sock->timerBatch.cbData = sock;
+    popkcel_initTimer(&sock->timerBatch, loop);
+    sock->pfTable.seed = popkcel__rand();
+    sock->synCookies = 0;
+    for (int i = 0; i < 2; i++)
+        sock->cookieKey[i] = ((uint64_t)popkcel__rand() << 32) ^ popkcel__rand() ^ ((uint64_t)popkcel_getCurrentTime() << 16);
     sock->lastSendTime = 0;
     sock->remoteAddrLen = sizeof(sock->remoteAddr);
 
@@ -1019,33 +2524,106 @@ int popkcel_initPsrSocket(struct Popkcel_PsrSocket *sock, struct Popkcel_Loop *l
 void popkcel_destroyPsrSocket(struct Popkcel_PsrSocket *sock)
 {
     popkcel_stopTimer(&sock->timerKeepAlive);
+#ifdef POPKCEL_PSRMMSG
+    if (sock->sendBatchCount)
+        psrBatchFlush(sock);
+#endif
+    popkcel_stopTimer(&sock->timerBatch);
     popkcel_destroySocket((struct Popkcel_Socket *)sock);
 
     // 清理所有psrfield
-    struct Popkcel_RbtnodeData *it;
-    while ((it = (struct Popkcel_RbtnodeData *)sock->nodePf)) {
-        psrError(it->value);
+    struct Popkcel_PsrTable *t = &sock->pfTable;
+    pfTableMove(t, 0);
+    for (size_t i = 0; t->slots && i <= t->mask; i++) {
+        struct Popkcel_PsrField *psr = t->slots[i].psr;
+        if (psr && psr != PFDELETED)
+            psrError(psr);
     }
+    free(t->slots);
+    free(t->oldSlots);
+    t->slots = t->oldSlots = NULL;
+
+    // 包池和sendQueue中的包一起释放
+    free(sock->sendQueue);
+    sock->sendQueue = NULL;
+    sock->sendQueueCount = 0;
+    struct PsrSlab *slab = sock->packetSlabs;
+    while (slab) {
+        struct PsrSlab *ns = slab->next;
+        free(slab);
+        slab = ns;
+    }
+    sock->packetSlabs = NULL;
+    sock->freePackets = NULL;
+    free(sock->sendBatch);
+    free(sock->recvBatch);
+    sock->sendBatch = NULL;
+    sock->recvBatch = NULL;
 }
 
 void popkcel_initPsrField(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrField *psr, Popkcel_PsrFuncCallback cbFunc)
 {
     psr->sock = sock;
-    psr->nodePieceReceive = NULL;
-    psr->nodePieceSend = NULL;
-    psr->nodeReply = NULL;
+    memset(&psr->recvOrder, 0, sizeof(psr->recvOrder));
+    psr->streams = NULL;
+    psr->maxStreams = POPKCEL_PSRMAXSTREAMS;
+    psr->recvStream = psr->bufferStream = 0;
+    psr->message.buf = NULL;
+    psr->maxMessage = POPKCEL_PSRMAXMESSAGE;
+    psr->messageMode = 0;
+    psr->sendRing = NULL;
+    psr->deferHead = psr->deferTail = NULL;
+    psr->sentHead = psr->sentTail = NULL;
+    psr->synPacket = NULL;
+    psr->sendBase = psr->unsentId = 0;
+    psr->sendRingMask = 0;
+    psr->ackBits = NULL;
+    psr->ackMask = psr->ackBase = psr->ackEnd = psr->ackCount = 0;
     psr->state = POPKCEL_PS_INIT;
     psr->mySendId = 0;
     psr->oppositeSendId = 0;
     psr->lastMyConfirmedSendId = 0;
     psr->callback = cbFunc;
+    psr->bufferPacket = NULL;
     psr->bufferPos = 0;
     psr->timer.cbData = psr;
-    psr->timer.funcCb = &cbPsrTimerSend;
-    psr->timerStarted = 0;
+    psr->timer.funcCb = &psrTimerCb;
+    psr->timerAt = psr->flushAt = psr->idleAt = 0;
     psr->needSend = 0;
     psr->window = sock->maxWindow;
     psr->synConfirm = 0;
+    psr->zeroRtt = psr->earlyData = 0;
+    psr->hasRtt = 0;
+    psr->srtt = psr->rttVar = 0;
+    psr->rto = POPKCEL_PSRINITRTO;
+    psr->minRto = POPKCEL_PSRMINRTO;
+    psr->maxRto = POPKCEL_PSRMAXRTO;
+    psr->maxSendCount = POPKCEL_PSRMAXSENDCOUNT;
+    psr->checksumMode = POPKCEL_PSRCHECKSUM_XOR;
+    psr->version = 0;
+    psr->ackEvery = POPKCEL_PSRACKEVERY;
+    psr->ackDelay = POPKCEL_PSRACKDELAY;
+    psr->ackOnGap = 1;
+    psr->ackRecvCount = 0;
+    psr->ackNow = 0;
+    psr->peerAckPending = 0;
+    psr->sendDelay = POPKCEL_PSRSENDDELAY;
+    psr->corked = 0;
+    psr->ackFreqId = UINT32_MAX; // 比第一个包的序号0小
+    psr->inflight = 0;
+    psr->recoverSendId = 0;
+    psr->sendSeq = psr->ackedSeq = 0;
+    psr->lastSentId = 0;
+    psr->dupThresh = POPKCEL_PSRDUPTHRESH;
+    psr->tailProbe = 1;
+    psr->probeAt = 0;
+    psr->paceAt = psr->paceTokens = psr->paceTime = 0;
+    psr->kernelRate = UINT32_MAX;
+    psr->pacingBurst = POPKCEL_PSRPACEBURST;
+    psr->pacing = POPKCEL_PSRPACING_TIMER;
+    psr->congestion = NULL;
+    psr->congestionData = NULL;
+    popkcel_psrSetCongestion(psr, NULL);
     popkcel_initTimer(&psr->timer, sock->loop);
     struct sockaddr *sa = (struct sockaddr *)&psr->remoteAddr;
     if (sock->ipv6) {
@@ -1060,94 +2638,264 @@ void popkcel_initPsrField(struct Popkcel_PsrSocket *sock, struct Popkcel_PsrFiel
 
 void popkcel_destroyPsrField(struct Popkcel_PsrField *psr)
 {
-    int64_t h = ipPortHash((struct sockaddr *)&psr->remoteAddr);
-    struct Popkcel_Rbtnode *it = popkcel_rbtFind(psr->sock->nodePf, h);
-    if (it) {
-        if (psr->sock->ipv6) {
-            while (((struct Popkcel_RbtnodeData *)it)->value != psr) {
-                it = popkcel_rbtNext(it);
-                if (!it || it->key != h)
-                    goto notFound;
-            }
-        }
-        popkcel_rbtDelete(&psr->sock->nodePf, it);
-        free(it);
-    }
-notFound:;
-    it = psr->nodePieceSend;
-    while (it) {
-        struct Popkcel_RbtnodePsrSend *oit = (struct Popkcel_RbtnodePsrSend *)it;
-        if (it->left) {
-            it = it->left;
-            oit->left = NULL;
-        }
-        else if (it->right) {
-            it = it->right;
-            oit->right = NULL;
-        }
-        else {
-            it = it->parent;
-            popkcel_stopTimer(&oit->timer);
-            if (oit->pending == 0)
-                free(oit);
-            else
-                oit->pending = 2;
-        }
+    pfTableRemove(&psr->sock->pfTable, psr);
+    uint32_t n = psrRingCount(psr);
+    for (uint32_t i = 0; i < n; i++) {
+        struct Popkcel_PsrPacket *rps = psr->sendRing[(psr->sendBase + i) & psr->sendRingMask];
+        if (rps)
+            psrPacketRelease(rps);
     }
-    psr->nodePieceSend = NULL;
-    it = psr->nodePieceReceive;
-    while (it) {
-        struct Popkcel_Rbtnode *oit = it;
-        if (it->left) {
-            it = it->left;
-            oit->left = NULL;
-        }
-        else if (it->right) {
-            it = it->right;
-            oit->right = NULL;
-        }
-        else {
-            it = it->parent;
-            free(oit);
-        }
+    free(psr->sendRing);
+    psr->sendRing = NULL;
+    psr->sendBase = psr->unsentId;
+    psr->sentHead = psr->sentTail = NULL;
+    while (psr->deferHead) {
+        struct Popkcel_PsrPacket *rps = psr->deferHead;
+        psr->deferHead = rps->next;
+        psrPacketFree(rps);
     }
-    psr->nodePieceReceive = NULL;
-    it = psr->nodeReply;
-    while (it) {
-        struct Popkcel_Rbtnode *oit = it;
-        if (it->left) {
-            it = it->left;
-            oit->left = NULL;
-        }
-        else if (it->right) {
-            it = it->right;
-            oit->right = NULL;
-        }
-        else {
-            it = it->parent;
-            free(oit);
+    psr->deferTail = NULL;
+    if (psr->synPacket) {
+        psrPacketRelease(psr->synPacket);
+        psr->synPacket = NULL;
+    }
+    if (psr->bufferPacket) {
+        psrPacketFree(psr->bufferPacket);
+        psr->bufferPacket = NULL;
+    }
+    psr->bufferPos = 0;
+    reorderFree(&psr->recvOrder);
+    free(psr->message.buf);
+    psr->message.buf = NULL;
+    if (psr->streams) {
+        for (uint32_t i = 0; i < psr->maxStreams; i++) {
+            reorderFree(&psr->streams[i].reorder);
+            free(psr->streams[i].message.buf);
         }
+        free(psr->streams);
+        psr->streams = NULL;
     }
-    psr->nodeReply = NULL;
+    free(psr->ackBits);
+    psr->ackBits = NULL;
+    psr->ackCount = 0;
     psr->state = POPKCEL_PS_CLOSED;
     popkcel_stopTimer(&psr->timer);
+    psr->timerAt = psr->flushAt = psr->idleAt = 0;
+    psr->probeAt = psr->paceAt = 0;
+    if (psr->congestion->destroy)
+        psr->congestion->destroy(psr);
+    psr->congestion = &popkcel_psrReno;
 }
 
 struct Popkcel_PsrField *popkcel_psrFind(struct Popkcel_PsrSocket *sock, struct sockaddr *addr)
 {
-    int64_t h = ipPortHash(addr);
-    struct Popkcel_RbtnodeData *it = (struct Popkcel_RbtnodeData *)popkcel_rbtFind(sock->nodePf, h);
-    if (it) {
-        struct Popkcel_PsrField *psr = it->value;
-        if (sock->ipv6) {
-            while (memcmp(&psr->remoteAddr.sin6_addr, &((struct sockaddr_in6 *)addr)->sin6_addr, sizeof(sock->remoteAddr.sin6_addr))) {
-                it = (struct Popkcel_RbtnodeData *)popkcel_rbtNext((struct Popkcel_Rbtnode *)it);
-                if (!it || it->key != h)
-                    return NULL;
-                psr = it->value;
-            }
+    struct Popkcel_PsrTable *t = &sock->pfTable;
+    if (t->last && addrEqual((struct sockaddr *)&t->last->remoteAddr, addr))
+        return t->last;
+    struct Popkcel_PsrSlot *s = pfTableFind(t, addr);
+    if (!s)
+        return NULL;
+    t->last = s->psr;
+    return s->psr;
+}
+
+uint32_t popkcel__psrCrc32c(char soft, uint32_t crc, const char *buf, size_t len)
+{
+    crcInitOnce();
+    return soft ? crc32cSoft(crc, buf, len) : crc32cFunc(crc, buf, len);
+}
+
+int popkcel_psrSetPeerAckFrequency(struct Popkcel_PsrField *psr, uint16_t ackEvery, uint16_t ackDelay)
+{
+    if ((psr->state != POPKCEL_PS_CONNECTED && psr->state != POPKCEL_PS_TRANSFER) || psr->version < 2)
+        return POPKCEL_ERROR;
+    psr->peerAckEvery = ackEvery;
+    psr->peerAckDelay = ackDelay;
+    psr->peerAckPending = 1;
+    return POPKCEL_OK;
+}
+
+int popkcel_psrSetMaxPacingRate(struct Popkcel_PsrSocket *sock, uint32_t bytesPerSecond)
+{
+#ifdef SO_MAX_PACING_RATE
+    unsigned int rate = bytesPerSecond;
+    if (!setsockopt(sock->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)))
+        return POPKCEL_OK;
+#endif
+    return POPKCEL_ERROR;
+}
+
+void popkcel_psrSetCongestion(struct Popkcel_PsrField *psr, const struct Popkcel_PsrCongestion *cc)
+{
+    if (psr->congestion && psr->congestion->destroy)
+        psr->congestion->destroy(psr);
+    psr->congestion = cc ? cc : &popkcel_psrReno;
+    psr->congestionData = NULL;
+    psr->cwnd = POPKCEL_PSRINITCWND;
+    if (psr->congestion->init)
+        psr->congestion->init(psr);
+}
+
+#ifndef POPKCEL_SINGLETHREAD
+#    if defined(__linux__) && defined(SO_REUSEPORT) && defined(SO_ATTACH_REUSEPORT_CBPF)
+// 让内核按对方地址的最后4个字节异或端口选择分片，与popkcel_psrShardOf的算法相同
+static int psrShardsSteer(int fd, uint32_t n)
+{
+    struct sock_filter code[] = {
+        // 网络层头中的版本号
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF },
+        { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4 },
+        { BPF_JMP | BPF_JEQ | BPF_K, 11, 0, 6 },
+        // IPv4，UDP头在长度可变的IP头之后
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 12 },
+        { BPF_ST, 0, 0, 0 },
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF },
+        { BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xf },
+        { BPF_ALU | BPF_LSH | BPF_K, 0, 0, 2 },
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        { BPF_LD | BPF_H | BPF_IND, 0, 0, (uint32_t)SKF_NET_OFF },
+        { BPF_LDX | BPF_MEM, 0, 0, 0 },
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+        // IPv6，不考虑扩展头
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 20 },
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        { BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 40 },
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+#        define POPKCEL_PSRSHARDS
+#    endif
+
+static int psrShardNotifyCb(void *data, intptr_t rv)
+{
+    (void)rv;
+    struct Popkcel_PsrShard *shard = data;
+    pthread_mutex_lock(&shard->mutex);
+    struct Popkcel_PsrShardMsg *m = shard->head;
+    shard->head = shard->tail = NULL;
+    pthread_mutex_unlock(&shard->mutex);
+    while (m) {
+        struct Popkcel_PsrShardMsg *next = m->next;
+        struct Popkcel_PsrField *psr = popkcel_psrFind(&shard->sock, (struct sockaddr *)&m->addr);
+        m->cb(m->data, (intptr_t)psr);
+        free(m);
+        m = next;
+    }
+    return 0;
+}
+
+int popkcel_initPsrShards(struct Popkcel_PsrShards *shards, struct Popkcel_LoopPool *loopPool, char ipv6, uint16_t port, Popkcel_PsrListenCb listenCb, Popkcel_PsrRecvCb recvCb, uint16_t maxWindow)
+{
+#    ifdef POPKCEL_PSRSHARDS
+    size_t n = loopPool->loopSize;
+    shards->shards = malloc(n * sizeof(struct Popkcel_PsrShard));
+    shards->count = 0;
+    // 分片在SO_REUSEPORT组中的下标就是bind的顺序
+    for (size_t i = 0; i < n; i++) {
+        struct Popkcel_PsrShard *shard = &shards->shards[i];
+        int fd = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+        int on = 1;
+        if (fd == -1)
+            goto labelError;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+            close(fd);
+            goto labelError;
+        }
+        if (popkcel_initNotifier(&shard->notifier, &loopPool->loops[i]) != POPKCEL_OK) {
+            close(fd);
+            goto labelError;
+        }
+        if (popkcel_initPsrSocket(&shard->sock, &loopPool->loops[i], fd, ipv6, port, listenCb, recvCb, maxWindow) != POPKCEL_OK) {
+            close(fd);
+            popkcel_destroyNotifier(&shard->notifier);
+            goto labelError;
+        }
+        popkcel_notifierSetCb(&shard->notifier, &psrShardNotifyCb, shard);
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->head = shard->tail = NULL;
+        shards->count++;
+        if (!port) {
+            // 之后的分片要绑定到第一个分片分配到的端口上
+            struct sockaddr_in6 addr;
+            socklen_t addrLen = sizeof(addr);
+            getsockname(fd, (struct sockaddr *)&addr, &addrLen);
+            port = ntohs(addr.sin6_port);
+        }
+    }
+    if (n > 1 && psrShardsSteer(shards->shards[0].sock.fd, (uint32_t)n))
+        goto labelError;
+    return POPKCEL_OK;
+
+labelError:
+    popkcel_destroyPsrShards(shards);
+#    else
+    (void)loopPool, (void)ipv6, (void)port, (void)listenCb, (void)recvCb, (void)maxWindow;
+    shards->shards = NULL;
+    shards->count = 0;
+#    endif
+    return POPKCEL_ERROR;
+}
+
+void popkcel_destroyPsrShards(struct Popkcel_PsrShards *shards)
+{
+    for (size_t i = 0; i < shards->count; i++) {
+        struct Popkcel_PsrShard *shard = &shards->shards[i];
+        popkcel_destroyPsrSocket(&shard->sock);
+        popkcel_destroyNotifier(&shard->notifier);
+        pthread_mutex_destroy(&shard->mutex);
+        while (shard->head) {
+            struct Popkcel_PsrShardMsg *m = shard->head;
+            shard->head = m->next;
+            free(m);
         }
     }
+    free(shards->shards);
+    shards->shards = NULL;
+    shards->count = 0;
+}
+
+size_t popkcel_psrShardOf(struct Popkcel_PsrShards *shards, const struct sockaddr *addr)
+{
+    uint32_t a;
+    uint16_t port;
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *)addr;
+        memcpy(&a, sa->sin6_addr.s6_addr + 12, 4);
+        port = sa->sin6_port;
+    }
+    else {
+        const struct sockaddr_in *sa = (const struct sockaddr_in *)addr;
+        memcpy(&a, &sa->sin_addr, 4);
+        port = sa->sin_port;
+    }
+    return (ntohl(a) ^ ntohs(port)) % shards->count;
+}
+
+int popkcel_psrShardPost(struct Popkcel_PsrShards *shards, const struct sockaddr *addr, Popkcel_FuncCallback cb, void *data)
+{
+    struct Popkcel_PsrShard *shard = &shards->shards[popkcel_psrShardOf(shards, addr)];
+    struct Popkcel_PsrShardMsg *m = malloc(sizeof(struct Popkcel_PsrShardMsg));
+    m->next = NULL;
+    m->cb = cb;
+    m->data = data;
+    memcpy(&m->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    pthread_mutex_lock(&shard->mutex);
+    // 只有队列由空变为非空时才需要唤醒Loop
+    char wasEmpty = !shard->head;
+    if (shard->tail)
+        shard->tail->next = m;
     else
-        return NULL;
+        shard->head = m;
+    shard->tail = m;
+    pthread_mutex_unlock(&shard->mutex);
+    if (wasEmpty && popkcel_notifierNotify(&shard->notifier) < 0)
+        return POPKCEL_ERROR;
+    return POPKCEL_OK;
 }
+#endif
@@ -586,6 +586,16 @@ void popkcel_destroyLoop(struct Popkcel_Loop *loop)
         free(it2);
     }*/
     popkcel_destroySysTimer(&loop->sysTimer);
+#ifndef POPKCEL_NOFAKESYNC
+    popkcel__freeContexts(loop);
+#endif
+#ifndef POPKCEL_SINGLETHREAD
+    if (loop->workNotifier) {
+        popkcel_destroyNotifier(loop->workNotifier);
+        free(loop->workNotifier);
+    }
+    pthread_mutex_destroy(&loop->workMutex);
+#endif
     free(loop->events);
     close(loop->loopFd);
 }
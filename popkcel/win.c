@@ -36,6 +36,11 @@ int popkcel_initLoop(struct Popkcel_Loop *loop, size_t maxEvents)
 {
     loop->running = 0;
     loop->timers = NULL;
+#ifndef POPKCEL_NOFAKESYNC
+    loop->readyHead = loop->readyTail = loop->runningReady = loop->freeContexts = NULL;
+    loop->curDeadline = NULL;
+    loop->readyTaken = 0;
+#endif
     loop->loopFd = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
     popkcel_initSysTimer(&loop->sysTimer, loop);
     loop->curOverlapped = NULL;
@@ -51,6 +56,9 @@ void popkcel_destroyLoop(struct Popkcel_Loop *loop)
         free(it2);
     }*/
     popkcel_destroySysTimer(&loop->sysTimer);
+#ifndef POPKCEL_NOFAKESYNC
+    popkcel__freeContexts(loop);
+#endif
     if (loop->curOverlapped)
         free(loop->curOverlapped);
     CloseHandle(loop->loopFd);
@@ -71,9 +79,18 @@ int popkcel_runLoop(struct Popkcel_Loop *loop)
 #endif
 
     while (loop->running) {
+#ifndef POPKCEL_NOFAKESYNC
+        // 放在循环开头，这样协程挂起后longjmp回来时，能先把这一批剩下的就绪协程处理完
+        popkcel__runReady(loop);
+        if (!loop->running)
+            break;
+#endif
         int r = popkcel__checkTimers();
         struct Popkcel_IocpCallback *ol;
         r = GetQueuedCompletionStatus(loop->loopFd, &loop->numOfBytes, &loop->completionKey, (LPOVERLAPPED *)&ol, r == -1 ? INFINITE : r);
+#ifndef POPKCEL_NOFAKESYNC
+        loop->readyTaken = 0;
+#endif
         if (ol) {
             if (loop->curOverlapped)
                 free(loop->curOverlapped);
@@ -8,11 +8,21 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 */
 
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <errno.h>
 #include <iostream>
 #include <popkcel.h>
 #include <popkcelpsr.h>
 #include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#    include <poll.h>
+#    include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -221,6 +231,1215 @@ int psrNonexistOsCb(void* data, intptr_t rv)
     return 0;
 }
 
+// 本机上的一对连接，用于丢包、多流、消息模式等测试。两个socket的recvCb按pairLoss（百分比）随机丢弃收到的包
+Popkcel_PsrSocket *pairServerSock, *pairClientSock;
+Popkcel_PsrField *pairServer, *pairClient;
+Popkcel_PsrFuncCallback pairServerCb, pairClientCb;
+// 两端的psrField初始化之后调用，用于修改测试需要的设置，可以为NULL
+void (*pairSetup)(Popkcel_PsrField* pf);
+// 在随机丢包之前调用，返回1表示丢弃这个包，可以为NULL
+int (*pairFilter)(Popkcel_PsrSocket* sock, intptr_t rv);
+// 客户端调用popkcel_psrTryConnect之后、同一轮事件中调用，可以为NULL
+void (*pairStart)();
+Popkcel_Timer pairTimer;
+uint16_t pairPort;
+// 客户端连接的端口，为0时直接连接服务端
+uint16_t pairRemotePort;
+int pairLoss;
+uint32_t pairRand;
+bool pairDone;
+
+int pairRecvCb(Popkcel_PsrSocket* sock, intptr_t rv)
+{
+    if (pairFilter && pairFilter(sock, rv))
+        return 1;
+    pairRand = pairRand * 1103515245 + 12345;
+    return (int)((pairRand >> 16) % 100) < pairLoss ? 1 : 0;
+}
+
+struct Popkcel_PsrField* pairListenCb(struct Popkcel_PsrSocket* sock, struct Popkcel_PsrField* psr)
+{
+    if (psr || pairServer)
+        return NULL;
+    pairServer = new Popkcel_PsrField;
+    popkcel_psrAcceptOne(sock, pairServer, pairServerCb);
+    if (pairSetup)
+        pairSetup(pairServer);
+    return pairServer;
+}
+
+// 测试完成时调用
+void pairFinish()
+{
+    pairDone = true;
+    popkcel_stopLoop(loop);
+}
+
+int pairTimeoutCb(void* data, intptr_t rv)
+{
+    cout << "pair timeout" << endl;
+    popkcel_stopLoop(loop);
+    return 0;
+}
+
+int pairOsCb(void* data, intptr_t rv)
+{
+    pairServerSock = new Popkcel_PsrSocket;
+    if (popkcel_initPsrSocket(pairServerSock, loop, 0, 0, pairPort, &pairListenCb, &pairRecvCb, 1000) == POPKCEL_ERROR) {
+        cout << "initPsrSocket error." << endl;
+        delete pairServerSock;
+        pairServerSock = NULL;
+        popkcel_stopLoop(loop);
+        return 0;
+    }
+    pairClientSock = new Popkcel_PsrSocket;
+    if (popkcel_initPsrSocket(pairClientSock, loop, 0, 0, 0, NULL, &pairRecvCb, 1000) == POPKCEL_ERROR) {
+        cout << "initPsrSocket error2." << endl;
+        delete pairClientSock;
+        pairClientSock = NULL;
+        popkcel_stopLoop(loop);
+        return 0;
+    }
+    pairClient = new Popkcel_PsrField;
+    popkcel_initPsrField(pairClientSock, pairClient, pairClientCb);
+    if (pairSetup)
+        pairSetup(pairClient);
+    popkcel_address((sockaddr_in*)&pairClient->remoteAddr, "127.0.0.1", pairRemotePort ? pairRemotePort : pairPort);
+    pairClient->addrLen = sizeof(sockaddr_in);
+    popkcel_psrTryConnect(pairClient);
+    if (pairStart)
+        pairStart();
+    return 0;
+}
+
+// 建立连接并运行loop，直到测试调用pairFinish或超过timeout毫秒，返回测试是否完成。之后要调用endPsrPair
+bool runPsrPair(uint16_t port, Popkcel_PsrFuncCallback serverCb, Popkcel_PsrFuncCallback clientCb, unsigned int timeout)
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    pairPort = port;
+    pairServerCb = serverCb;
+    pairClientCb = clientCb;
+    pairServerSock = pairClientSock = NULL;
+    pairServer = pairClient = NULL;
+    pairDone = false;
+    popkcel_initTimer(&pairTimer, loop);
+    pairTimer.funcCb = &pairTimeoutCb;
+    pairTimer.cbData = NULL;
+    popkcel_setTimer(&pairTimer, timeout, 0);
+    popkcel_oneShotCallback(loop, &pairOsCb, NULL);
+    popkcel_runLoop(loop);
+    popkcel_stopTimer(&pairTimer);
+    return pairDone;
+}
+
+void endPsrPair()
+{
+    if (pairClient) {
+        popkcel_destroyPsrField(pairClient);
+        delete pairClient;
+    }
+    if (pairServer) {
+        popkcel_destroyPsrField(pairServer);
+        delete pairServer;
+    }
+    if (pairClientSock) {
+        popkcel_destroyPsrSocket(pairClientSock);
+        delete pairClientSock;
+    }
+    if (pairServerSock) {
+        popkcel_destroyPsrSocket(pairServerSock);
+        delete pairServerSock;
+    }
+}
+
+// 批量传输：客户端连接后一次写入bulkTotal字节，服务端检查收到的数据是否完整有序
+size_t bulkTotal, bulkGot;
+int64_t bulkStart;
+
+int bulkServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv > 0) {
+        for (intptr_t i = 0; i < rv; i++) {
+            if ((unsigned char)pf->recvBuf[i] != (bulkGot + i) % 251) {
+                cout << "bulk data mismatch at " << bulkGot + i << endl;
+                popkcel_stopLoop(loop);
+                return 0;
+            }
+        }
+        bulkGot += rv;
+        if (bulkGot == bulkTotal)
+            pairFinish();
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "server error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+int bulkClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED) {
+        bulkStart = popkcel_getCurrentTime();
+        char text[1000];
+        for (size_t sent = 0; sent < bulkTotal;) {
+            size_t n = bulkTotal - sent < sizeof(text) ? bulkTotal - sent : sizeof(text);
+            for (size_t i = 0; i < n; i++)
+                text[i] = (char)((sent + i) % 251);
+            if (popkcel_psrTrySend(pf, text, n, NULL, NULL) == POPKCEL_ERROR) {
+                cout << "send error" << endl;
+                popkcel_stopLoop(loop);
+                return 0;
+            }
+            sent += n;
+        }
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "client error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+// 按loss%丢包传输total字节，返回用的毫秒数，没有完成时返回-1。之后要调用endPsrPair
+int64_t runPsrBulk(uint16_t port, size_t total, int loss)
+{
+    bulkTotal = total;
+    bulkGot = 0;
+    pairLoss = loss;
+    pairRand = 1;
+    if (!runPsrPair(port, &bulkServerCb, &bulkClientCb, 60000))
+        return -1;
+    return popkcel_getCurrentTime() - bulkStart;
+}
+
+// 丢包恢复测试：minRto调高到200毫秒，对比快速重传加尾包探测和只靠超时重传的用时，两种情况下数据都应该完整有序
+bool lossFastRetrans;
+
+void psrLossSetup(Popkcel_PsrField* pf)
+{
+    pf->minRto = 200;
+    if (!lossFastRetrans) {
+        pf->dupThresh = 0;
+        pf->tailProbe = 0;
+    }
+}
+
+// 确认策略对比：默认的确认策略和以前固定等待10毫秒再确认的行为
+bool ackFixedDelay;
+
+void psrAckSetup(Popkcel_PsrField* pf)
+{
+    if (ackFixedDelay) {
+        pf->ackEvery = 0;
+        pf->ackDelay = 10;
+        pf->ackOnGap = 0;
+    }
+}
+
+// 来回测试：客户端每次分两段写入"ping"，服务端原样返回，对比300个来回的用时。pingMode为0时sendDelay为默认的10毫秒，为1时为0，为2时用cork/uncork
+const int pingRounds = 300;
+int pingMode, pingCount;
+size_t pingGot;
+int64_t pingStart;
+
+void psrPingSetup(Popkcel_PsrField* pf)
+{
+    pf->sendDelay = pingMode == 1 ? 0 : POPKCEL_PSRSENDDELAY;
+}
+
+// 写入一段或两段数据，pingMode为2时cork之后写入，再uncork立即发出
+void pingSend(Popkcel_PsrField* pf, const char* a, size_t aLen, const char* b, size_t bLen)
+{
+    if (pingMode == 2)
+        popkcel_psrCork(pf);
+    popkcel_psrTrySend(pf, a, aLen, NULL, NULL);
+    if (bLen)
+        popkcel_psrTrySend(pf, b, bLen, NULL, NULL);
+    if (pingMode == 2)
+        popkcel_psrUncork(pf);
+}
+
+int pingServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv > 0)
+        pingSend(pf, pf->recvBuf, rv, NULL, 0);
+    return 0;
+}
+
+int pingClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED) {
+        pingStart = popkcel_getCurrentTime();
+        pingCount = 0;
+        pingGot = 0;
+        pingSend(pf, "pi", 2, "ng", 2);
+    }
+    else if (rv > 0) {
+        for (intptr_t i = 0; i < rv; i++)
+            assert(pf->recvBuf[i] == "ping"[(pingGot + i) % 4]);
+        pingGot += rv;
+        if (pingGot % 4 == 0) {
+            if (++pingCount == pingRounds) {
+                pairFinish();
+                return 0;
+            }
+            pingSend(pf, "pi", 2, "ng", 2);
+        }
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "client error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+/* 多流测试：每一轮依次向有序流1、2，不保证顺序的流写入8个字节，每50轮发一个数据报，有序流检查顺序，不保证顺序的流检查每个记录只收到一次。
+ * 客户端先写流1再写流2，所以流2收到的数据比流1多，说明流1因为丢包落后时流2没有被阻塞。streamHol为true时只写一轮，并丢弃流1的包直到流2收到数据，
+ * 流1的包可能在流2的包发出之前就被重传，所以不能只丢第一个
+ */
+int streamRounds;
+bool streamHol, streamHolDropped;
+size_t streamGot[3];
+char* streamUnordered;
+int streamUnorderedCount, streamDatagrams, streamAhead;
+
+// 有序流中第pos个字节的值
+char streamByte(int stream, size_t pos)
+{
+    return (char)(pos * 31 + stream);
+}
+
+int streamFilter(Popkcel_PsrSocket* sock, intptr_t rv)
+{
+    // 流的数据包开头为[flag][校验4][序号4][长度2][流编号2][流内序号4]，流编号是小端
+    if (!streamHol || streamGot[2] || sock != pairServerSock || rv < 17
+        || (unsigned char)sock->psrBuffer[0] != (POPKCEL_PF_TRANSFORM | POPKCEL_PF_SINGLE | POPKCEL_PF_APT)
+        || sock->psrBuffer[11] != 1 || sock->psrBuffer[12] != 0)
+        return 0;
+    streamHolDropped = true;
+    return 1;
+}
+
+int streamServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv <= 0) {
+        cout << "server error" << endl;
+        popkcel_stopLoop(loop);
+        return 0;
+    }
+    uint16_t st = pf->recvStream;
+    if (st == 1 || st == 2) {
+        for (intptr_t i = 0; i < rv; i++)
+            assert(pf->recvBuf[i] == streamByte(st, streamGot[st] + i));
+        streamGot[st] += rv;
+        if (st == 2 && streamGot[2] > streamGot[1])
+            streamAhead++;
+    }
+    else if (st == POPKCEL_PSRSTREAM_UNORDERED) {
+        // 每次写入的流都和上一次不同，所以每个包中只有完整的记录
+        assert(rv % 8 == 0);
+        for (intptr_t i = 0; i < rv; i += 8) {
+            uint32_t r;
+            memcpy(&r, pf->recvBuf + i, 4);
+            assert(r < (uint32_t)streamRounds && !streamUnordered[r]);
+            streamUnordered[r] = 1;
+            streamUnorderedCount++;
+        }
+    }
+    else {
+        assert(st == POPKCEL_PSRSTREAM_DATAGRAM && rv == 8 && !memcmp(pf->recvBuf, "datagram", 8));
+        streamDatagrams++;
+    }
+    size_t total = (size_t)streamRounds * 8;
+    if (streamGot[1] == total && streamGot[2] == total && (streamHol || streamUnorderedCount == streamRounds))
+        pairFinish();
+    return 0;
+}
+
+int streamClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED) {
+        char data[8];
+        for (int r = 0; r < streamRounds; r++) {
+            for (int st = 1; st <= 2; st++) {
+                for (int i = 0; i < 8; i++)
+                    data[i] = streamByte(st, (size_t)r * 8 + i);
+                int sr = popkcel_psrTrySendStream(pf, st, data, 8, NULL, NULL);
+                assert(sr != POPKCEL_ERROR);
+            }
+            if (streamHol)
+                continue;
+            uint32_t u = r;
+            memcpy(data, &u, 4);
+            memcpy(data + 4, "unor", 4);
+            int sr = popkcel_psrTrySendStream(pf, POPKCEL_PSRSTREAM_UNORDERED, data, 8, NULL, NULL);
+            assert(sr != POPKCEL_ERROR);
+            if (r % 50 == 0)
+                popkcel_psrSendDatagram(pf, "datagram", 8);
+        }
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "client error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+/* 消息模式测试：流0和流1中交错发送长度不一的消息，大部分放得下一个包，一部分要跨多个包，每10轮向不保证顺序的流发一个短消息。
+ * 每次回调应该正好是一个完整的消息。msgReject为true时服务端的maxMessage比客户端发的消息短，连接应该出错
+ */
+const int msgRounds = 1000;
+const uint32_t msgMax = 8000;
+bool msgReject, msgRejected;
+uint32_t msgNext[2];
+int msgUnordered;
+
+// 第i个消息的长度，85%不超过300字节，其余的最长6000字节
+uint32_t msgLen(uint32_t i, int stream)
+{
+    uint32_t x = i * 2654435761u + stream * 97;
+    return (x >> 7) % 100 < 85 ? 1 + (x >> 3) % 300 : 1 + (x >> 3) % 6000;
+}
+
+char msgByte(uint32_t i, int stream, uint32_t pos)
+{
+    return (char)(i + pos * 7 + stream);
+}
+
+void psrMsgSetup(Popkcel_PsrField* pf)
+{
+    pf->messageMode = 1;
+    pf->maxMessage = msgReject && pf->sock == pairServerSock ? 1000 : msgMax;
+}
+
+int msgServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_ERROR) {
+        if (msgReject) {
+            msgRejected = true;
+            pairFinish();
+        }
+        else {
+            cout << "server error" << endl;
+            popkcel_stopLoop(loop);
+        }
+        return 0;
+    }
+    if (rv <= 0)
+        return 0;
+    assert(!msgReject);
+    uint16_t st = pf->recvStream;
+    if (st == POPKCEL_PSRSTREAM_UNORDERED) {
+        assert(rv == 100 && !memcmp(pf->recvBuf, "unordered", 9));
+        msgUnordered++;
+    }
+    else {
+        assert(st <= 1);
+        uint32_t i = msgNext[st]++;
+        assert((uint32_t)rv == msgLen(i, st));
+        for (intptr_t k = 0; k < rv; k++)
+            assert(pf->recvBuf[k] == msgByte(i, st, k));
+    }
+    if (msgNext[0] == msgRounds && msgNext[1] == msgRounds && msgUnordered == msgRounds / 10)
+        pairFinish();
+    return 0;
+}
+
+int msgClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED) {
+        char* data = new char[msgMax + 1]();
+        int r;
+        if (msgReject) {
+            r = popkcel_psrTrySend(pf, data, 3000, NULL, NULL);
+            assert(r != POPKCEL_ERROR);
+            delete[] data;
+            return 0;
+        }
+        // 超过maxMessage的消息，以及放不下一个包的不保证顺序的消息，都不能发送
+        r = popkcel_psrTrySend(pf, data, msgMax + 1, NULL, NULL);
+        assert(r == POPKCEL_ERROR);
+        r = popkcel_psrTrySendStream(pf, POPKCEL_PSRSTREAM_UNORDERED, data, 2000, NULL, NULL);
+        assert(r == POPKCEL_ERROR);
+        for (int i = 0; i < msgRounds; i++) {
+            for (int st = 0; st <= 1; st++) {
+                uint32_t n = msgLen(i, st);
+                for (uint32_t k = 0; k < n; k++)
+                    data[k] = msgByte(i, st, k);
+                r = popkcel_psrTrySendStream(pf, st, data, n, NULL, NULL);
+                assert(r != POPKCEL_ERROR);
+            }
+            if (i % 10 == 0) {
+                memset(data, 0, 100);
+                memcpy(data, "unordered", 9);
+                r = popkcel_psrTrySendStream(pf, POPKCEL_PSRSTREAM_UNORDERED, data, 100, NULL, NULL);
+                assert(r != POPKCEL_ERROR);
+            }
+        }
+        delete[] data;
+    }
+    else if (rv == POPKCEL_ERROR && !msgReject) {
+        cout << "client error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+/* 延迟转发，模拟有延迟的链路：发到relayFd的包延迟relayDelay毫秒后从outFd转发给服务端，服务端的回复同样延迟后转发给客户端。
+ * relayPeak为每毫秒从客户端收到的包数的最大值，用来观察发送是否有突发
+ */
+const int relayDelay = 20;
+atomic<bool> relayStop;
+int relayPeak;
+
+struct RelayPacket
+{
+    int64_t due;
+    bool toServer;
+    string data;
+};
+
+int relayOpen(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    popkcel_address(&addr, "127.0.0.1", port);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    int size = 8 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return fd;
+}
+
+void relayRun(int relayFd, int outFd, uint16_t serverPort)
+{
+    sockaddr_in server, client;
+    socklen_t clientLen = 0;
+    popkcel_address(&server, "127.0.0.1", serverPort);
+    // 延迟都相同，按到达的顺序就是按转发的时间排序
+    deque<RelayPacket> queue;
+    char data[2048];
+    int64_t bucket = 0;
+    int bucketCount = 0;
+    relayPeak = 0;
+    while (!relayStop) {
+        int64_t now = popkcel_getCurrentTime();
+        while (!queue.empty() && queue.front().due <= now) {
+            RelayPacket& rp = queue.front();
+            if (rp.toServer)
+                sendto(outFd, rp.data.data(), rp.data.size(), 0, (sockaddr*)&server, sizeof(server));
+            else if (clientLen)
+                sendto(relayFd, rp.data.data(), rp.data.size(), 0, (sockaddr*)&client, clientLen);
+            queue.pop_front();
+        }
+        pollfd fds[2] = { { relayFd, POLLIN, 0 }, { outFd, POLLIN, 0 } };
+        if (poll(fds, 2, queue.empty() ? 10 : (int)(queue.front().due - now)) <= 0)
+            continue;
+        for (int i = 0; i < 2; i++) {
+            for (;;) {
+                sockaddr_in from;
+                socklen_t fromLen = sizeof(from);
+                ssize_t n = recvfrom(fds[i].fd, data, sizeof(data), MSG_DONTWAIT, (sockaddr*)&from, &fromLen);
+                if (n < 0)
+                    break;
+                now = popkcel_getCurrentTime();
+                if (i == 0) {
+                    client = from;
+                    clientLen = fromLen;
+                    if (now != bucket) {
+                        bucket = now;
+                        bucketCount = 0;
+                    }
+                    if (++bucketCount > relayPeak)
+                        relayPeak = bucketCount;
+                }
+                queue.push_back({ now + relayDelay, i == 0, string(data, n) });
+            }
+        }
+    }
+}
+
+// 限速测试：经过延迟20毫秒的转发传输3MB，对比不限速和默认的令牌桶限速的突发包数和用时
+bool pacingOn;
+
+void psrPacingSetup(Popkcel_PsrField* pf)
+{
+    pf->pacing = pacingOn ? POPKCEL_PSRPACING_TIMER : POPKCEL_PSRPACING_NONE;
+}
+#endif
+
+// 批量发送对比：psrBatch为1时用sendmmsg和recvmmsg，为0时每个包调用一次系统调用
+char batchOn;
+
+void psrBatchSetup(Popkcel_PsrField* pf)
+{
+    pf->sock->psrBatch = batchOn;
+}
+
+/* SYN带数据的测试：客户端开启zeroRtt，连接后在同一轮事件中写入zrtTotal字节。zrtMode为0时服务端接受SYN中的包，应该在客户端连接完成前收到；
+ * 为1时服务端开启synCookies，为2时模拟只接受8字节SYN的版本3的服务端，这两种情况下缓存的包要在连接完成后重新编号发送；
+ * 为3时丢弃第一个SYN|REPLY，服务端收到数据后回复使自己进入TRANSFER状态，客户端重传的SYN不应该重置连接
+ */
+const size_t zrtTotal = 5000;
+int zrtMode;
+bool zrtOn;
+size_t zrtGot;
+bool zrtEarly, zrtReplied, zrtReplyDropped;
+int zrtSyns;
+int zrtSynState;
+int64_t zrtStart, zrtFirstByte, zrtEnd;
+
+void psrZrtSetup(Popkcel_PsrField* pf)
+{
+    if (pf == pairClient)
+        pf->zeroRtt = zrtOn;
+}
+
+void zrtStartCb()
+{
+    if (zrtMode == 1)
+        pairServerSock->synCookies = 1;
+    zrtStart = popkcel_getCurrentTime();
+    char text[1000];
+    for (size_t sent = 0; sent < zrtTotal; sent += sizeof(text)) {
+        for (size_t i = 0; i < sizeof(text); i++)
+            text[i] = (char)((sent + i) % 251);
+        int r = popkcel_psrTrySend(pairClient, text, sizeof(text), NULL, NULL);
+        assert(r != POPKCEL_ERROR);
+    }
+}
+
+int zrtFilter(Popkcel_PsrSocket* sock, intptr_t rv)
+{
+    unsigned char flag = (unsigned char)sock->psrBuffer[0];
+    if (sock == pairServerSock && flag == (POPKCEL_PF_SYN | POPKCEL_PF_APT)) {
+        zrtSyns++;
+        if (pairServer)
+            zrtSynState = pairServer->state;
+        if (zrtMode == 2) {
+            if (rv != 8)
+                return 1;
+            sock->psrBuffer[1] = 3;
+        }
+    }
+    else if (sock == pairClientSock && zrtMode == 3 && !zrtReplyDropped && rv == 9 && flag == (POPKCEL_PF_SYN | POPKCEL_PF_REPLY | POPKCEL_PF_APT)) {
+        zrtReplyDropped = true;
+        return 1;
+    }
+    return 0;
+}
+
+int zrtServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv > 0) {
+        if (!zrtGot) {
+            zrtFirstByte = popkcel_getCurrentTime();
+            zrtEarly = pairClient->state == POPKCEL_PS_CONNECTING;
+            if (zrtMode == 3) {
+                int r = popkcel_psrTrySend(pf, "ok", 2, NULL, NULL);
+                assert(r != POPKCEL_ERROR);
+            }
+        }
+        for (intptr_t i = 0; i < rv; i++) {
+            if ((unsigned char)pf->recvBuf[i] != (zrtGot + i) % 251) {
+                cout << "zeroRtt data mismatch at " << zrtGot + i << endl;
+                popkcel_stopLoop(loop);
+                return 0;
+            }
+        }
+        zrtGot += rv;
+        if (zrtGot == zrtTotal) {
+            zrtEnd = popkcel_getCurrentTime();
+            if (zrtMode != 3 || zrtReplied)
+                pairFinish();
+        }
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "server error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+int zrtClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv > 0) {
+        assert(rv == 2 && !memcmp(pf->recvBuf, "ok", 2));
+        zrtReplied = true;
+        if (zrtGot == zrtTotal)
+            pairFinish();
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "client error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+#if defined(__linux__) && !defined(POPKCEL_SINGLETHREAD)
+/* 分片服务器测试：4个分片，从shardConns个固定端口连接，检查接受连接的分片就是popkcel_psrShardOf返回的分片，
+ * 再用popkcel_psrShardPost向每个连接发消息，检查回调在该分片的Loop中执行，并找到了那个分片中的psrField。客户端在主线程的loop中运行
+ */
+const int shardConns = 16;
+const uint16_t shardPort = 55571, shardClientPort = 58000;
+Popkcel_LoopPool shardPool;
+Popkcel_PsrShards psrShards;
+Popkcel_PsrSocket* shardClientSocks[shardConns];
+Popkcel_PsrField* shardClients[shardConns];
+// 由分片的线程写入，shardAccepted增加之后主线程才读
+Popkcel_PsrField* shardServer[shardConns];
+int shardOfConn[shardConns];
+atomic<int> shardAccepted, shardPosted, shardFound;
+int shardConnected;
+bool shardDone;
+Popkcel_Timer shardTimer;
+
+sockaddr_in shardClientAddr(int i)
+{
+    sockaddr_in addr;
+    popkcel_address(&addr, "127.0.0.1", shardClientPort + i);
+    return addr;
+}
+
+int shardServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    return 0;
+}
+
+Popkcel_PsrField* shardListenCb(Popkcel_PsrSocket* sock, Popkcel_PsrField* psr)
+{
+    int i = ntohs(((sockaddr_in*)&sock->remoteAddr)->sin_port) - shardClientPort;
+    if (psr || i < 0 || i >= shardConns || shardServer[i])
+        return NULL;
+    Popkcel_PsrField* pf = new Popkcel_PsrField;
+    popkcel_psrAcceptOne(sock, pf, &shardServerCb);
+    // 分片的PsrSocket是Popkcel_PsrShard的第一个成员
+    shardOfConn[i] = (int)((Popkcel_PsrShard*)sock - psrShards.shards);
+    shardServer[i] = pf;
+    shardAccepted++;
+    return pf;
+}
+
+int shardPostCb(void* data, intptr_t rv)
+{
+    int i = (int)(intptr_t)data;
+    if (popkcel_threadLoop == &shardPool.loops[shardOfConn[i]] && (Popkcel_PsrField*)rv == shardServer[i])
+        shardFound++;
+    shardPosted++;
+    return 0;
+}
+
+int shardStopCb(void* data, intptr_t rv)
+{
+    popkcel_stopLoop(popkcel_threadLoop);
+    return 0;
+}
+
+int shardClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED && ++shardConnected == shardConns) {
+        // 服务端在回复SYN|REPLY之前就接受了连接
+        assert(shardAccepted == shardConns);
+        for (int i = 0; i < shardConns; i++) {
+            sockaddr_in addr = shardClientAddr(i);
+            int r = popkcel_psrShardPost(&psrShards, (sockaddr*)&addr, &shardPostCb, (void*)(intptr_t)i);
+            assert(r == POPKCEL_OK);
+        }
+    }
+    else if (rv == POPKCEL_ERROR) {
+        cout << "client error" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+// 每10毫秒检查一次消息是否都已处理
+int shardTimerCb(void* data, intptr_t rv)
+{
+    if (shardPosted == shardConns) {
+        shardDone = true;
+        popkcel_stopLoop(loop);
+    }
+    else if (popkcel_getCurrentTime() > (int64_t)(intptr_t)data) {
+        cout << "shard timeout" << endl;
+        popkcel_stopLoop(loop);
+    }
+    return 0;
+}
+
+int shardOsCb(void* data, intptr_t rv)
+{
+    for (int i = 0; i < shardConns; i++) {
+        shardClientSocks[i] = new Popkcel_PsrSocket;
+        int r = popkcel_initPsrSocket(shardClientSocks[i], loop, 0, 0, shardClientPort + i, NULL, NULL, 100);
+        assert(r == POPKCEL_OK);
+        shardClients[i] = new Popkcel_PsrField;
+        popkcel_initPsrField(shardClientSocks[i], shardClients[i], &shardClientCb);
+        popkcel_address((sockaddr_in*)&shardClients[i]->remoteAddr, "127.0.0.1", shardPort);
+        shardClients[i]->addrLen = sizeof(sockaddr_in);
+        r = popkcel_psrTryConnect(shardClients[i]);
+        assert(r != POPKCEL_ERROR);
+    }
+    return 0;
+}
+#endif
+
+/* 空闲连接的内存测试：memConns个连接各收发一次数据，然后统计每个连接的按需分配的内存，和空闲释放之后的内存。
+ * 释放之后再收发一次，检查队列和位图重新分配后数据仍然正确
+ */
+const int memConns = 200;
+Popkcel_PsrSocket* memSockets[memConns];
+Popkcel_PsrField* memFields[memConns];
+Popkcel_PsrField* memServer[memConns];
+int memAccepted = 0, memEchoed = 0, memRound;
+bool memDone;
+
+size_t psrLazyBytes(Popkcel_PsrField* pf)
+{
+    size_t n = 0;
+    if (pf->sendRing)
+        n += (pf->sendRingMask + 1) * sizeof(void*);
+    if (pf->ackBits)
+        n += (pf->ackMask + 1) / 8;
+    if (pf->recvOrder.ring)
+        n += (pf->recvOrder.mask + 1) * sizeof(void*) + (pf->recvOrder.mask + 1) / 8;
+    if (pf->bufferPacket)
+        n += sizeof(Popkcel_PsrPacket);
+    return n;
+}
+
+void memReport(const char* when)
+{
+    size_t total = 0;
+    for (int i = 0; i < memAccepted; i++)
+        total += psrLazyBytes(memServer[i]);
+    cout << when << ": " << memAccepted << " conns, sizeof(Popkcel_PsrField) " << sizeof(Popkcel_PsrField)
+         << ", lazy bytes per conn " << total / (memAccepted ? memAccepted : 1) << endl;
+}
+
+void memSend(Popkcel_PsrField* pf)
+{
+    char text[100];
+    memset(text, 'a' + memRound, sizeof(text));
+    int r = popkcel_psrTrySend(pf, text, sizeof(text), NULL, NULL);
+    assert(r != POPKCEL_ERROR);
+}
+
+// 两端的队列和位图都应该已经释放，或者都已经重新分配
+void memCheck(bool freed)
+{
+    for (int i = 0; i < memConns; i++) {
+        Popkcel_PsrField* pfs[2] = { memFields[i], memServer[i] };
+        for (Popkcel_PsrField* pf : pfs) {
+            if (freed)
+                assert(!pf->sendRing && !pf->recvOrder.ring && !pf->ackBits && !pf->bufferPacket);
+            else
+                assert(pf->sendRing && pf->ackBits);
+        }
+    }
+}
+
+int memIdleTimer(void* data, intptr_t rv)
+{
+    memReport("after idle");
+    memCheck(true);
+    memRound = 1;
+    memEchoed = 0;
+    for (int i = 0; i < memConns; i++)
+        memSend(memFields[i]);
+    return 0;
+}
+
+int memServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv > 0)
+        popkcel_psrTrySend(pf, pf->recvBuf, rv, NULL, NULL);
+    return 0;
+}
+
+struct Popkcel_PsrField* memListenCb(struct Popkcel_PsrSocket* sock, struct Popkcel_PsrField* psr)
+{
+    if (psr || memAccepted == memConns)
+        return NULL;
+    Popkcel_PsrField* pf = new Popkcel_PsrField;
+    popkcel_psrAcceptOne(sock, pf, &memServerCb);
+    memServer[memAccepted++] = pf;
+    return pf;
+}
+
+int memClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED)
+        memSend(pf);
+    else if (rv > 0) {
+        for (intptr_t i = 0; i < rv; i++)
+            assert(pf->recvBuf[i] == 'a' + memRound);
+        if (++memEchoed < memConns)
+            return 0;
+        memReport(memRound ? "after traffic again" : "after traffic");
+        if (memRound) {
+            memCheck(false);
+            memDone = true;
+            popkcel_stopLoop(loop);
+            return 0;
+        }
+        Popkcel_Timer* timer = new Popkcel_Timer;
+        popkcel_initTimer(timer, loop);
+        timer->funcCb = &memIdleTimer;
+        timer->cbData = NULL;
+        // 最后一次重传检查之后开始空闲计时
+        popkcel_setTimer(timer, POPKCEL_PSRIDLEFREE + POPKCEL_PSRINITRTO + 1000, 0);
+    }
+    else if (rv == POPKCEL_ERROR)
+        cout << "client error" << endl;
+    return 0;
+}
+
+int psrMemoryOsCb(void* data, intptr_t rv)
+{
+    Popkcel_PsrSocket* ps = (Popkcel_PsrSocket*)data;
+    if (popkcel_initPsrSocket(ps, loop, 0, 0, 55556, &memListenCb, NULL, 1000) == POPKCEL_ERROR) {
+        cout << "initPsrSocket error." << endl;
+        popkcel_stopLoop(loop);
+        return 0;
+    }
+    // 每个客户端连接用一个socket，同一个socket不能有两个远端地址相同的连接
+    for (int i = 0; i < memConns; i++) {
+        memSockets[i] = new Popkcel_PsrSocket;
+        if (popkcel_initPsrSocket(memSockets[i], loop, 0, 0, 56000 + i, NULL, NULL, 1000) == POPKCEL_ERROR) {
+            cout << "initPsrSocket error2." << endl;
+            delete memSockets[i];
+            memSockets[i] = NULL;
+            popkcel_stopLoop(loop);
+            return 0;
+        }
+        memFields[i] = new Popkcel_PsrField;
+        popkcel_initPsrField(memSockets[i], memFields[i], &memClientCb);
+        popkcel_address((sockaddr_in*)&memFields[i]->remoteAddr, "127.0.0.1", 55556);
+        memFields[i]->addrLen = sizeof(sockaddr_in);
+        popkcel_psrTryConnect(memFields[i]);
+    }
+    return 0;
+}
+
+/* 连接表测试：随机地建立和销毁连接，使哈希表多次扩容并清理删除标记，每次操作后检查popkcel_psrFind的结果，包括扩容搬迁过程中和最近查找的连接被销毁之后。
+ * zeroRtt时SYN要等到本轮事件结束才发送，连接在那之前都已销毁，所以不会真的发出包
+ */
+const int tableConns = 100000;
+
+void tableAddr(Popkcel_PsrField* pf, int i)
+{
+    sockaddr_in* addr = (sockaddr_in*)&pf->remoteAddr;
+    addr->sin_addr.s_addr = htonl(0x0a000000 + i / 50000);
+    addr->sin_port = htons(1000 + i % 50000);
+    pf->addrLen = sizeof(sockaddr_in);
+}
+
+int tableNoCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    return 0;
+}
+
+int psrTableOsCb(void* data, intptr_t rv)
+{
+    Popkcel_PsrSocket* ps = new Popkcel_PsrSocket;
+    if (popkcel_initPsrSocket(ps, loop, 0, 0, 0, NULL, NULL, 1000) == POPKCEL_ERROR) {
+        cout << "initPsrSocket error." << endl;
+        popkcel_stopLoop(loop);
+        return 0;
+    }
+    Popkcel_PsrField* fields = new Popkcel_PsrField[tableConns];
+    char* in = new char[tableConns]();
+    int migrations = 0, movingChecks = 0, live = 0;
+    uint32_t rs = 1;
+    for (int round = 0; round < tableConns * 4; round++) {
+        rs = rs * 1103515245 + 12345;
+        int i = (rs >> 8) % tableConns;
+        Popkcel_PsrField* pf = fields + i;
+        if (!in[i]) {
+            bool moving = ps->pfTable.oldSlots != NULL;
+            popkcel_initPsrField(ps, pf, &tableNoCb);
+            tableAddr(pf, i);
+            pf->zeroRtt = 1;
+            int r = popkcel_psrTryConnect(pf);
+            assert(r == POPKCEL_WOULDBLOCK);
+            if (!moving && ps->pfTable.oldSlots)
+                migrations++;
+            in[i] = 1;
+            live++;
+        }
+        else if ((rs >> 4) & 1) {
+            // 先查找一次，让它成为缓存的最近查找结果，销毁后不应该再找到
+            assert(popkcel_psrFind(ps, (sockaddr*)&pf->remoteAddr) == pf);
+            popkcel_destroyPsrField(pf);
+            in[i] = 0;
+            live--;
+        }
+        if (ps->pfTable.oldSlots)
+            movingChecks++;
+        assert(popkcel_psrFind(ps, (sockaddr*)&pf->remoteAddr) == (in[i] ? pf : NULL));
+    }
+    for (int i = 0; i < tableConns; i++)
+        assert(popkcel_psrFind(ps, (sockaddr*)&fields[i].remoteAddr) == (in[i] ? fields + i : NULL));
+    cout << live << " live conns, " << migrations << " migrations, " << movingChecks << " lookups during migration" << endl;
+    assert(migrations >= 3 && movingChecks > 0);
+
+    for (int i = 0; i < tableConns; i++) {
+        if (!in[i]) {
+            popkcel_initPsrField(ps, fields + i, &tableNoCb);
+            tableAddr(fields + i, i);
+            fields[i].zeroRtt = 1;
+            popkcel_psrTryConnect(fields + i);
+            in[i] = 1;
+        }
+    }
+    int hits = 0;
+    int64_t t = popkcel_getCurrentTime();
+    for (int k = 0; k < 5000000; k++) {
+        rs = rs * 1103515245 + 12345;
+        hits += popkcel_psrFind(ps, (sockaddr*)&fields[(rs >> 8) % tableConns].remoteAddr) != NULL;
+    }
+    cout << "5M random lookups over " << tableConns << " peers: " << popkcel_getCurrentTime() - t << " ms" << endl;
+    assert(hits == 5000000);
+
+    for (int i = 0; i < tableConns; i++)
+        popkcel_destroyPsrField(fields + i);
+    popkcel_destroyPsrSocket(ps);
+    delete ps;
+    delete[] fields;
+    delete[] in;
+    cout << "ok" << endl;
+    popkcel_stopLoop(loop);
+    return 0;
+}
+
+// 握手速度测试：hsConns个连接同时握手，比较开启synCookies前后每秒完成的握手数
+const int hsConns = 200;
+Popkcel_PsrSocket* hsSockets[hsConns];
+Popkcel_PsrField* hsFields[hsConns];
+Popkcel_PsrField* hsServer[hsConns];
+int hsAccepted, hsConnected;
+int64_t hsStart;
+char hsCookies;
+
+int hsServerCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    return 0;
+}
+
+struct Popkcel_PsrField* hsListenCb(struct Popkcel_PsrSocket* sock, struct Popkcel_PsrField* psr)
+{
+    if (psr || hsAccepted == hsConns)
+        return NULL;
+    Popkcel_PsrField* pf = new Popkcel_PsrField;
+    popkcel_psrAcceptOne(sock, pf, &hsServerCb);
+    hsServer[hsAccepted++] = pf;
+    return pf;
+}
+
+int hsClientCb(Popkcel_PsrField* pf, intptr_t rv)
+{
+    if (rv == POPKCEL_CONNECTED && ++hsConnected == hsConns) {
+        int64_t t = popkcel_getCurrentTime() - hsStart;
+        cout << "synCookies " << (int)hsCookies << ": " << hsConns << " handshakes in "
+             << t << " ms, " << hsConns * 1000 / (t ? t : 1) << "/s" << endl;
+        loop->running = 0;
+    }
+    else if (rv == POPKCEL_ERROR)
+        cout << "client error" << endl;
+    return 0;
+}
+
+int psrHandshakeOsCb(void* data, intptr_t rv)
+{
+    Popkcel_PsrSocket* ps = (Popkcel_PsrSocket*)data;
+    if (popkcel_initPsrSocket(ps, loop, 0, 0, 55557, &hsListenCb, NULL, 1000) == POPKCEL_ERROR) {
+        cout << "initPsrSocket error." << endl;
+        return 0;
+    }
+    ps->synCookies = hsCookies;
+    hsAccepted = hsConnected = 0;
+    hsStart = popkcel_getCurrentTime();
+    for (int i = 0; i < hsConns; i++) {
+        hsSockets[i] = new Popkcel_PsrSocket;
+        if (popkcel_initPsrSocket(hsSockets[i], loop, 0, 0, 57000 + i, NULL, NULL, 1000) == POPKCEL_ERROR) {
+            cout << "initPsrSocket error2." << endl;
+            return 0;
+        }
+        hsFields[i] = new Popkcel_PsrField;
+        popkcel_initPsrField(hsSockets[i], hsFields[i], &hsClientCb);
+        popkcel_address((sockaddr_in*)&hsFields[i]->remoteAddr, "127.0.0.1", 55557);
+        hsFields[i]->addrLen = sizeof(sockaddr_in);
+        popkcel_psrTryConnect(hsFields[i]);
+    }
+    return 0;
+}
+
+int yieldDone;
+
+int yieldCo(void* data, intptr_t rv)
+{
+    for (int i = 0; i < 3; i++) {
+        cout << (const char*)data << i << endl;
+        popkcel_yield();
+    }
+    if (++yieldDone == 2)
+        popkcel_stopLoop(loop);
+    return 0;
+}
+
+void testSpawn()
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    yieldDone = 0;
+    // 应该交替输出a0 b0 a1 b1 a2 b2
+    popkcel_spawn(loop, &yieldCo, (void*)"a");
+    popkcel_spawn(loop, &yieldCo, (void*)"b");
+    popkcel_runLoop(loop);
+    // 两个协程交替yield，之后每次都重复使用loop中留下的Context，总共只分配两个
+    int contexts = 0;
+    for (Popkcel_Context* c = loop->freeContexts; c; c = c->nextReady)
+        contexts++;
+    assert(contexts == 2);
+}
+
+Popkcel_Channel* channel;
+Popkcel_WaitGroup* waitGroup;
+
+int producerCo(void* data, intptr_t rv)
+{
+    for (intptr_t i = 1; i <= 10; i++)
+        popkcel_channelSend(channel, (void*)i);
+    popkcel_waitGroupDone(waitGroup);
+    return 0;
+}
+
+int consumerCo(void* data, intptr_t rv)
+{
+    void* v;
+    intptr_t sum = 0;
+    while (popkcel_channelRecv(channel, &v) == POPKCEL_OK)
+        sum += (intptr_t)v;
+    cout << "consumer sum " << sum << endl;
+    return 0;
+}
+
+int channelMainCo(void* data, intptr_t rv)
+{
+    popkcel_waitGroupAdd(waitGroup, 2);
+    popkcel_spawn(loop, &producerCo, NULL);
+    popkcel_spawn(loop, &producerCo, NULL);
+    popkcel_waitGroupWait(waitGroup);
+    // 两个producer都发送完了，关闭channel后consumer会退出，应该输出110
+    popkcel_channelClose(channel);
+    return 0;
+}
+
+void testChannel()
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    channel = new Popkcel_Channel;
+    popkcel_initChannel(channel, 4);
+    waitGroup = new Popkcel_WaitGroup;
+    popkcel_initWaitGroup(waitGroup);
+    popkcel_spawn(loop, &channelMainCo, NULL);
+    popkcel_spawn(loop, &consumerCo, NULL);
+    popkcel_runLoop(loop);
+}
+
+int deadlineCo(void* data, intptr_t rv)
+{
+    auto dl = new Popkcel_Deadline;
+    popkcel_setDeadline(dl, popkcel_getCurrentTime() + 100);
+    // 应该输出0 -2 -2，第二个sleep在100ms时因Deadline返回
+    cout << popkcel_sleep(50) << endl;
+    cout << popkcel_sleep(100) << endl;
+    void* v;
+    cout << popkcel_channelRecv(channel, &v) << endl;
+    popkcel_clearDeadline(dl);
+    delete dl;
+    return 0;
+}
+
+void testDeadline()
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    channel = new Popkcel_Channel;
+    popkcel_initChannel(channel, 0);
+    popkcel_spawn(loop, &deadlineCo, NULL);
+    popkcel_runLoop(loop);
+}
+
+#ifndef POPKCEL_SINGLETHREAD
+int slowWork(void* data, intptr_t rv)
+{
+    this_thread::sleep_for(chrono::milliseconds(50));
+    return (intptr_t)data * 2;
+}
+
+int afterSlowWork(void* data, intptr_t rv)
+{
+    cout << "after work " << rv << endl;
+    return 0;
+}
+
+int workCo(void* data, intptr_t rv)
+{
+    for (intptr_t i = 0; i < 4; i++)
+        popkcel_queueWork(loop, &slowWork, &afterSlowWork, (void*)i);
+    intptr_t r;
+    // 应该输出await 42，4个afterSlowWork的输出顺序不定
+    popkcel_awaitWork(&slowWork, (void*)21, &r);
+    cout << "await " << r << endl;
+    return 0;
+}
+
+int resolveCo(void* data, intptr_t rv)
+{
+    addrinfo* ai;
+    // 第二次解析应该命中缓存，两次都应该输出127.0.0.1
+    for (int i = 0; i < 2; i++) {
+        if (popkcel_resolve("localhost", "80", NULL, 1000, &ai) == POPKCEL_OK) {
+            char buf[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET, &((sockaddr_in*)ai->ai_addr)->sin_addr, buf, sizeof(buf));
+            cout << "resolve " << buf << endl;
+            popkcel_freeAddrInfo(ai);
+        }
+    }
+    return 0;
+}
+
+void testResolve()
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    auto pool = new Popkcel_WorkerPool;
+    popkcel_initWorkerPool(pool, 1);
+    popkcel_loopSetWorkerPool(loop, pool);
+    popkcel_spawn(loop, &resolveCo, NULL);
+    popkcel_runLoop(loop);
+}
+
+void testWork()
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    auto pool = new Popkcel_WorkerPool;
+    popkcel_initWorkerPool(pool, 2);
+    popkcel_loopSetWorkerPool(loop, pool);
+    popkcel_spawn(loop, &workCo, NULL);
+    popkcel_runLoop(loop);
+}
+#endif
+
 void testOscb(Popkcel_FuncCallback cb)
 {
     loop = new Popkcel_Loop;
@@ -229,6 +1448,377 @@ void testOscb(Popkcel_FuncCallback cb)
     popkcel_runLoop(loop);
 }
 
+void testPsrMemory()
+{
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    memAccepted = memEchoed = memRound = 0;
+    memDone = false;
+    for (int i = 0; i < memConns; i++) {
+        memSockets[i] = NULL;
+        memFields[i] = NULL;
+    }
+    Popkcel_PsrSocket* ps = new Popkcel_PsrSocket;
+    popkcel_oneShotCallback(loop, &psrMemoryOsCb, ps);
+    popkcel_runLoop(loop);
+    assert(memDone);
+    for (int i = 0; i < memConns; i++) {
+        if (memFields[i]) {
+            popkcel_destroyPsrField(memFields[i]);
+            delete memFields[i];
+        }
+        if (memSockets[i]) {
+            popkcel_destroyPsrSocket(memSockets[i]);
+            delete memSockets[i];
+        }
+    }
+    for (int i = 0; i < memAccepted; i++) {
+        popkcel_destroyPsrField(memServer[i]);
+        delete memServer[i];
+    }
+    popkcel_destroyPsrSocket(ps);
+    delete ps;
+}
+
+void testPsrHandshake()
+{
+    for (hsCookies = 0; hsCookies < 2; hsCookies++) {
+        loop = new Popkcel_Loop;
+        popkcel_initLoop(loop, 0);
+        Popkcel_PsrSocket* ps = new Popkcel_PsrSocket;
+        popkcel_oneShotCallback(loop, &psrHandshakeOsCb, ps);
+        popkcel_runLoop(loop);
+        for (int i = 0; i < hsConns; i++) {
+            popkcel_destroyPsrField(hsFields[i]);
+            popkcel_destroyPsrSocket(hsSockets[i]);
+            delete hsFields[i];
+            delete hsSockets[i];
+        }
+        for (int i = 0; i < hsAccepted; i++) {
+            popkcel_destroyPsrField(hsServer[i]);
+            delete hsServer[i];
+        }
+        popkcel_destroyPsrSocket(ps);
+        delete ps;
+    }
+}
+
+void testPsrLoss()
+{
+    pairSetup = &psrLossSetup;
+    for (int loss : { 0, 3, 10 }) {
+        for (int i = 0; i < 2; i++) {
+            lossFastRetrans = i == 0;
+            int64_t t = runPsrBulk(55560, 2000000, loss);
+            cout << "loss " << loss << "%, dupThresh " << pairClient->dupThresh << ", tailProbe " << (int)pairClient->tailProbe
+                 << ": " << t << " ms, rto " << pairClient->rto << ", cwnd " << pairClient->cwnd << endl;
+            assert(t >= 0);
+            assert(pairClient->hasRtt && pairClient->rto >= pairClient->minRto && pairClient->rto <= pairClient->maxRto);
+            assert(pairClient->cwnd >= 1 && pairClient->cwnd <= pairClient->window);
+            // 不丢包时cwnd应该增长过，本机的socket缓冲区满时也会丢包，所以不能断言ssthresh没变；丢包时拥塞控制减小了ssthresh
+            if (loss)
+                assert(pairClient->ssthresh != UINT32_MAX);
+            else
+                assert(pairClient->cwnd > POPKCEL_PSRINITCWND);
+            endPsrPair();
+        }
+    }
+    pairSetup = NULL;
+}
+
+void testPsrAckPolicy()
+{
+    pairSetup = &psrAckSetup;
+    for (int loss : { 0, 3 }) {
+        size_t total = loss ? 2000000 : 20000000;
+        for (int i = 0; i < 2; i++) {
+            ackFixedDelay = i == 1;
+            int64_t t = runPsrBulk(55561, total, loss);
+            cout << total / 1000000 << " MB, loss " << loss << "%, " << (ackFixedDelay ? "fixed 10 ms ack delay" : "default ack policy")
+                 << ": " << t << " ms" << endl;
+            assert(t >= 0);
+            endPsrPair();
+        }
+    }
+    pairSetup = NULL;
+}
+
+void testPsrPingPong()
+{
+    const char* modes[] = { "sendDelay 10", "sendDelay 0", "cork/uncork" };
+    pairSetup = &psrPingSetup;
+    pairLoss = 0;
+    for (pingMode = 0; pingMode < 3; pingMode++) {
+        bool done = runPsrPair(55562, &pingServerCb, &pingClientCb, 60000);
+        cout << modes[pingMode] << ": " << pingRounds << " round trips in " << popkcel_getCurrentTime() - pingStart << " ms" << endl;
+        assert(done);
+        endPsrPair();
+    }
+    pairSetup = NULL;
+}
+
+void testPsrStreams()
+{
+    pairFilter = &streamFilter;
+    for (int i = 0; i < 2; i++) {
+        streamHol = i == 0;
+        streamHolDropped = false;
+        streamRounds = streamHol ? 1 : 2000;
+        streamGot[1] = streamGot[2] = 0;
+        streamUnordered = new char[streamRounds]();
+        streamUnorderedCount = streamDatagrams = streamAhead = 0;
+        pairLoss = streamHol ? 0 : 10;
+        pairRand = 1;
+        bool done = runPsrPair(55563, &streamServerCb, &streamClientCb, 60000);
+        cout << (streamHol ? "first stream 1 packet dropped" : "10% loss") << ": stream 2 ahead of stream 1 " << streamAhead << " times, "
+             << streamUnorderedCount << " unordered, " << streamDatagrams << " datagrams" << endl;
+        assert(done && streamAhead > 0);
+        if (streamHol)
+            assert(streamHolDropped);
+        endPsrPair();
+        delete[] streamUnordered;
+    }
+    pairFilter = NULL;
+}
+
+void testPsrMessages()
+{
+    pairSetup = &psrMsgSetup;
+    for (int i = 0; i < 2; i++) {
+        msgReject = i == 1;
+        msgRejected = false;
+        msgNext[0] = msgNext[1] = 0;
+        msgUnordered = 0;
+        pairLoss = msgReject ? 0 : 10;
+        pairRand = 1;
+        bool done = runPsrPair(55564, &msgServerCb, &msgClientCb, 60000);
+        if (msgReject)
+            cout << "oversized message " << (msgRejected ? "rejected" : "not rejected") << endl;
+        else
+            cout << "10% loss: " << msgNext[0] + msgNext[1] << " messages, " << msgUnordered << " unordered" << endl;
+        assert(done && msgRejected == msgReject);
+        endPsrPair();
+    }
+    pairSetup = NULL;
+}
+
+#ifndef _WIN32
+void testPsrPacing()
+{
+    pairSetup = &psrPacingSetup;
+    pairRemotePort = 55566;
+    int peakOff = 0;
+    for (int i = 0; i < 2; i++) {
+        pacingOn = i == 1;
+        int relayFd = relayOpen(pairRemotePort), outFd = relayOpen(0);
+        assert(relayFd >= 0 && outFd >= 0);
+        relayStop = false;
+        thread relay(&relayRun, relayFd, outFd, 55565);
+        int64_t t = runPsrBulk(55565, 3000000, 0);
+        relayStop = true;
+        relay.join();
+        close(relayFd);
+        close(outFd);
+        cout << "pacing " << (pacingOn ? "on" : "off") << ": peak " << relayPeak << " packets per ms, " << t << " ms" << endl;
+        assert(t >= 0);
+        // 限速后突发的包应该明显减少
+        if (pacingOn)
+            assert(relayPeak < peakOff);
+        else
+            peakOff = relayPeak;
+        endPsrPair();
+    }
+    pairRemotePort = 0;
+    pairSetup = NULL;
+}
+#endif
+
+void testPsrBatch()
+{
+    pairSetup = &psrBatchSetup;
+    for (int round = 0; round < 3; round++) {
+        for (batchOn = 1; batchOn >= 0; batchOn--) {
+            int64_t t = runPsrBulk(55567, 20000000, 0);
+            cout << "20 MB, psrBatch " << (int)batchOn << ": " << t << " ms" << endl;
+            assert(t >= 0);
+            endPsrPair();
+        }
+    }
+    pairSetup = NULL;
+}
+
+void testPsrZeroRtt()
+{
+    const char* modes[] = { "accepted", "synCookies server", "version 3 server", "SYN|REPLY lost" };
+    pairSetup = &psrZrtSetup;
+    pairFilter = &zrtFilter;
+    pairStart = &zrtStartCb;
+    pairLoss = 0;
+    zrtOn = true;
+    for (zrtMode = 0; zrtMode < 4; zrtMode++) {
+        zrtGot = 0;
+        zrtEarly = zrtReplied = zrtReplyDropped = false;
+        zrtSyns = 0;
+        zrtSynState = -1;
+        bool done = runPsrPair(55568, &zrtServerCb, &zrtClientCb, 10000);
+        cout << modes[zrtMode] << ": first byte " << (zrtEarly ? "before" : "after") << " the client connected, " << zrtSyns << " SYN, "
+             << zrtEnd - zrtStart << " ms" << endl;
+        assert(done && pairClient->earlyData == 1);
+        assert(zrtEarly == (zrtMode == 0 || zrtMode == 3));
+        assert((pairServer->earlyData == 2) == zrtEarly);
+        if (zrtMode == 2)
+            assert(pairClient->version == 3);
+        // 重传的SYN到达时服务端已经在发送数据，连接没有被重置。客户端收到服务端的数据时就重传SYN，不用等超时
+        if (zrtMode == 3)
+            assert(zrtSyns >= 2 && zrtSynState == POPKCEL_PS_TRANSFER && zrtEnd - zrtStart < 500);
+        endPsrPair();
+    }
+    pairStart = NULL;
+    pairFilter = NULL;
+    pairSetup = NULL;
+}
+
+#ifndef _WIN32
+// 经过延迟20毫秒的转发，对比开启和关闭zeroRtt时服务端收到第一个字节和全部数据的用时，开启时应该少一个来回
+void testPsrZeroRttLatency()
+{
+    pairSetup = &psrZrtSetup;
+    pairStart = &zrtStartCb;
+    pairRemotePort = 55570;
+    pairLoss = 0;
+    zrtMode = 0;
+    int64_t firstOff = 0;
+    for (int i = 0; i < 2; i++) {
+        zrtOn = i == 1;
+        zrtGot = 0;
+        int relayFd = relayOpen(pairRemotePort), outFd = relayOpen(0);
+        assert(relayFd >= 0 && outFd >= 0);
+        relayStop = false;
+        thread relay(&relayRun, relayFd, outFd, 55569);
+        bool done = runPsrPair(55569, &zrtServerCb, &zrtClientCb, 10000);
+        relayStop = true;
+        relay.join();
+        close(relayFd);
+        close(outFd);
+        cout << "zeroRtt " << (zrtOn ? "on" : "off") << ": first byte after " << zrtFirstByte - zrtStart << " ms, " << zrtTotal
+             << " bytes after " << zrtEnd - zrtStart << " ms" << endl;
+        assert(done);
+        if (zrtOn)
+            assert(zrtFirstByte - zrtStart < firstOff);
+        else
+            firstOff = zrtFirstByte - zrtStart;
+        endPsrPair();
+    }
+    pairRemotePort = 0;
+    pairStart = NULL;
+    pairSetup = NULL;
+}
+#endif
+
+#if defined(__linux__) && !defined(POPKCEL_SINGLETHREAD)
+void testPsrShards()
+{
+    const size_t n = 4;
+    popkcel_initLoopPool(&shardPool, n, 0);
+    int r = popkcel_initPsrShards(&psrShards, &shardPool, 0, shardPort, &shardListenCb, NULL, 100);
+    assert(r == POPKCEL_OK && psrShards.count == n);
+    shardAccepted = shardPosted = shardFound = 0;
+    shardConnected = 0;
+    shardDone = false;
+    for (int i = 0; i < shardConns; i++)
+        shardServer[i] = NULL;
+    // 自己创建线程运行各个分片的Loop，结束时可以等待它们退出
+    vector<thread> threads;
+    for (size_t i = 0; i < n; i++)
+        threads.emplace_back(&popkcel_runLoop, &shardPool.loops[i]);
+
+    loop = new Popkcel_Loop;
+    popkcel_initLoop(loop, 0);
+    popkcel_initTimer(&shardTimer, loop);
+    shardTimer.funcCb = &shardTimerCb;
+    shardTimer.cbData = (void*)(intptr_t)(popkcel_getCurrentTime() + 10000);
+    popkcel_setTimer(&shardTimer, 10, 10);
+    popkcel_oneShotCallback(loop, &shardOsCb, NULL);
+    popkcel_runLoop(loop);
+    popkcel_stopTimer(&shardTimer);
+
+    int perShard[n] = {};
+    int misrouted = 0;
+    for (int i = 0; i < shardConns; i++) {
+        sockaddr_in addr = shardClientAddr(i);
+        if (shardServer[i]) {
+            perShard[shardOfConn[i]]++;
+            if ((size_t)shardOfConn[i] != popkcel_psrShardOf(&psrShards, (sockaddr*)&addr))
+                misrouted++;
+        }
+    }
+    cout << shardConns << " connections, per shard";
+    for (size_t s = 0; s < n; s++)
+        cout << " " << perShard[s];
+    cout << ", " << misrouted << " not on popkcel_psrShardOf, " << shardFound << " of " << shardPosted << " posts found their psrField" << endl;
+
+    // 向每个分片发消息让它的Loop停下来
+    for (size_t s = 0; s < n; s++) {
+        for (int i = 0;; i++) {
+            sockaddr_in addr = shardClientAddr(i);
+            if (popkcel_psrShardOf(&psrShards, (sockaddr*)&addr) == s) {
+                popkcel_psrShardPost(&psrShards, (sockaddr*)&addr, &shardStopCb, NULL);
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+        threads[i].join();
+
+    assert(shardDone && misrouted == 0 && shardFound == shardConns);
+    for (size_t s = 0; s < n; s++)
+        assert(perShard[s] > 0);
+    for (int i = 0; i < shardConns; i++) {
+        popkcel_destroyPsrField(shardClients[i]);
+        delete shardClients[i];
+        popkcel_destroyPsrSocket(shardClientSocks[i]);
+        delete shardClientSocks[i];
+        if (shardServer[i]) {
+            popkcel_destroyPsrField(shardServer[i]);
+            delete shardServer[i];
+        }
+    }
+    popkcel_destroyPsrShards(&psrShards);
+    popkcel_destroyLoopPool(&shardPool);
+}
+#endif
+
+void testCrc32c()
+{
+    // 标准的测试值
+    const char* check = "123456789";
+    assert(~popkcel__psrCrc32c(1, 0xffffffff, check, 9) == 0xe3069283);
+    assert(~popkcel__psrCrc32c(0, 0xffffffff, check, 9) == 0xe3069283);
+    // 不对齐的起始位置和各种长度，两种实现的结果应该相同
+    char* data = new char[POPKCEL_MAXUDPSIZE + 8];
+    for (int i = 0; i < POPKCEL_MAXUDPSIZE + 8; i++)
+        data[i] = (char)(i * 7 + 3);
+    for (int off = 0; off < 8; off++) {
+        for (int len = 0; len <= POPKCEL_MAXUDPSIZE; len += len < 64 ? 1 : 37)
+            assert(popkcel__psrCrc32c(1, 0xffffffff, data + off, len) == popkcel__psrCrc32c(0, 0xffffffff, data + off, len));
+    }
+    // 分段计算和一次计算的结果相同
+    uint32_t crc = popkcel__psrCrc32c(0, 0xffffffff, data + 1, 13);
+    assert(popkcel__psrCrc32c(0, crc, data + 14, 999) == popkcel__psrCrc32c(1, 0xffffffff, data + 1, 1012));
+
+    uint32_t x = 0;
+    int64_t t0 = popkcel_getCurrentTime();
+    for (int i = 0; i < 1000000; i++)
+        x += popkcel__psrCrc32c(0, i, data, POPKCEL_MAXUDPSIZE);
+    int64_t t1 = popkcel_getCurrentTime();
+    for (int i = 0; i < 1000000; i++)
+        x += popkcel__psrCrc32c(1, i, data, POPKCEL_MAXUDPSIZE);
+    int64_t t2 = popkcel_getCurrentTime();
+    cout << "crc32c 1M x " << POPKCEL_MAXUDPSIZE << " bytes: dispatched " << t1 - t0 << " ms, soft " << t2 - t1 << " ms (" << x << ")" << endl;
+    delete[] data;
+    cout << "ok" << endl;
+}
+
 void testRbt()
 {
     Popkcel_Rbtnode* root = NULL;
@@ -280,8 +1870,27 @@ int main()
     popkcel_init();
     testOscb(&psrNonexistOsCb);
     //testRbt();
+    //testSpawn();
+    //testChannel();
+    //testDeadline();
+    //testWork();
+    //testResolve();
     //testOscb(&pfOsCb);
     //testOscb(&sysTimerOsCb);
+    //testPsrMemory();
+    //testPsrHandshake();
+    //testOscb(&psrTableOsCb);
+    //testPsrLoss();
+    //testPsrAckPolicy();
+    //testPsrPingPong();
+    //testPsrStreams();
+    //testPsrMessages();
+    //testPsrPacing();
+    //testPsrBatch();
+    //testPsrZeroRtt();
+    //testPsrZeroRttLatency();
+    //testPsrShards();
+    //testCrc32c();
     /*
     buf = new char[10];
     LoopPool lp(4);